@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "client_api.h"
+#include "stats.h"
+#include "logger.h"
+
+// Load generator. Every client registers through connect_to_server() and then
+// issues requests drawn from a weighted mix, either back to back (closed loop)
+// or on a fixed schedule (open loop, -r). In open loop, latency is also
+// measured from the time each request was scheduled to go out, so a stalled
+// server is charged for the requests it held back (coordinated omission).
+
+#define BENCH_TYPES (NUM_BUILTIN_REQUEST_TYPES)
+
+typedef struct bench_config_t
+{
+    int clients;
+    bool processes;
+    double duration_s;
+    double warmup_s;
+    double rate; // total requests per second, 0 for closed loop
+    unsigned weights[BENCH_TYPES];
+    int batch_len;
+    int vector_len;
+    int max_operand;
+    bool json;
+} bench_config_t;
+
+typedef struct bench_result_t
+{
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t corrected_sum_ns;
+    uint64_t corrected_max_ns;
+    uint64_t by_type[BENCH_TYPES];
+    uint64_t sum_by_type[BENCH_TYPES];
+    uint64_t max_by_type[BENCH_TYPES];
+    uint64_t latency[BENCH_TYPES][HIST_BUCKETS];
+    uint64_t corrected[HIST_BUCKETS];
+} __attribute__((aligned(64))) bench_result_t;
+
+// Lives in a shared anonymous mapping so that forked clients can report back.
+typedef struct bench_shared_t
+{
+    int ready;  // clients registered so far
+    int failed; // clients that could not register
+    int go;     // futex word, set once every client is ready
+    uint64_t start_ns;
+    bench_result_t results[];
+} bench_shared_t;
+
+static bench_config_t config;
+static bench_shared_t *shared;
+
+static const char *type_names[BENCH_TYPES] = {"ARITHMETIC", "EVEN_OR_ODD", "IS_PRIME", "IS_NEGATIVE", "UNREGISTER", "BATCH", "VECTOR_ARITHMETIC"};
+static const char *mix_names[BENCH_TYPES] = {"arith", "even", "prime", "negative", NULL, "batch", "vector"};
+
+static inline uint32_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint32_t)(*state >> 32);
+}
+
+RequestType pick_request_type(uint64_t *rng)
+{
+    unsigned total = 0;
+    for (int t = 0; t < BENCH_TYPES; ++t)
+        total += config.weights[t];
+
+    unsigned r = next_random(rng) % total;
+    for (int t = 0; t < BENCH_TYPES; ++t)
+    {
+        if (r < config.weights[t])
+            return (RequestType)t;
+        r -= config.weights[t];
+    }
+
+    return ARITHMETIC;
+}
+
+// Fills the channel with a request of the given type and returns the header.
+Request make_request(RequestOrResponse *comm_reqres, void *payload, RequestType type, uint64_t *rng)
+{
+    static const char ops[] = {'+', '-', '*', '/'};
+    Request req = {0};
+    req.request_type = type;
+    req.n1 = next_random(rng) % config.max_operand;
+    req.n2 = next_random(rng) % config.max_operand + 1;
+    req.op = ops[next_random(rng) % 4];
+
+    if (type == BATCH)
+    {
+        for (int i = 0; i < config.batch_len; ++i)
+        {
+            comm_reqres->batch_req[i].request_type = IS_PRIME;
+            comm_reqres->batch_req[i].n1 = next_random(rng) % config.max_operand;
+        }
+        comm_reqres->batch_len = config.batch_len;
+    }
+    else if (type == VECTOR_ARITHMETIC)
+    {
+        int *a = (int *)payload, *b = a + config.vector_len;
+        for (int i = 0; i < config.vector_len; ++i)
+        {
+            a[i] = next_random(rng) % config.max_operand;
+            b[i] = next_random(rng) % config.max_operand + 1;
+        }
+        set_vector_payload(&req, config.vector_len);
+    }
+
+    return req;
+}
+
+static void record(bench_result_t *res, RequestType type, uint64_t latency_ns, uint64_t corrected_ns, bool ok)
+{
+    res->completed++;
+    if (!ok)
+        res->errors++;
+    res->by_type[type]++;
+    res->sum_by_type[type] += latency_ns;
+    if (latency_ns > res->max_by_type[type])
+        res->max_by_type[type] = latency_ns;
+    res->latency[type][latency_bucket(latency_ns)]++;
+    res->sum_ns += latency_ns;
+    if (latency_ns > res->max_ns)
+        res->max_ns = latency_ns;
+
+    res->corrected[latency_bucket(corrected_ns)]++;
+    res->corrected_sum_ns += corrected_ns;
+    if (corrected_ns > res->corrected_max_ns)
+        res->corrected_max_ns = corrected_ns;
+}
+
+// Timer wakeups are late by tens of microseconds, so the last stretch is spun.
+#define SLEEP_SPIN_NS (100000)
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    if (deadline_ns > monotonic_ns() + SLEEP_SPIN_NS)
+    {
+        uint64_t wake_ns = deadline_ns - SLEEP_SPIN_NS;
+        struct timespec ts = {wake_ns / 1000000000UL, wake_ns % 1000000000UL};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+            ;
+    }
+    while (monotonic_ns() < deadline_ns)
+        cpu_relax();
+}
+
+void run_client(int idx)
+{
+    bench_result_t *res = &shared->results[idx];
+
+    char name[MAX_CLIENT_NAME_LEN];
+    snprintf(name, sizeof(name), "bench_%d_%d", getpid(), idx);
+
+    // Only vector requests need a payload region.
+    size_t payload_wanted = config.weights[VECTOR_ARITHMETIC] > 0 ? vector_payload_size(config.vector_len) : 0;
+    ClientSession session = {.payload_size = payload_wanted};
+    RequestOrResponse *comm_reqres = NULL;
+    void *payload = NULL;
+    if (connect_to_server(name, &session) < 0 || (comm_reqres = get_session_channel(&session)) == NULL)
+        fprintf(stderr, "ERROR: Client %d could not connect to the server.\n", idx);
+    else if (payload_wanted > 0 && (session.payload_size < payload_wanted || (payload = get_session_payload(&session)) == NULL))
+    {
+        fprintf(stderr, "ERROR: Client %d got %zu of the %zu payload bytes it needs. Is the server's -p too small?\n",
+                idx, session.payload_size, payload_wanted);
+        disconnect_from_server(comm_reqres, &session);
+        comm_reqres = NULL;
+    }
+
+    if (comm_reqres == NULL)
+    {
+        __atomic_add_fetch(&shared->failed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+        futex_wake(&shared->ready, INT_MAX);
+        return;
+    }
+
+    __atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+    futex_wake(&shared->ready, INT_MAX);
+    while (__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE) == 0)
+        futex_wait(&shared->go, 0);
+
+    uint64_t rng = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)(idx + 1) << 32) ^ getpid();
+    uint64_t measure_from = shared->start_ns + (uint64_t)(config.warmup_s * 1e9);
+    uint64_t stop_at = measure_from + (uint64_t)(config.duration_s * 1e9);
+
+    // Open-loop clients are staggered so that the total rate is smooth.
+    uint64_t interval_ns = config.rate > 0 ? (uint64_t)(config.clients * 1e9 / config.rate) : 0;
+    uint64_t intended = shared->start_ns + (interval_ns * idx) / config.clients;
+
+    while (true)
+    {
+        uint64_t now = monotonic_ns();
+        if (interval_ns > 0)
+        {
+            if (intended > now)
+            {
+                sleep_until(intended);
+                now = monotonic_ns();
+            }
+        }
+        else
+            intended = now;
+
+        if (intended >= stop_at)
+            break;
+
+        RequestType type = pick_request_type(&rng);
+        Request req = make_request(comm_reqres, payload, type, &rng);
+        Response response = call_server(comm_reqres, &session, req);
+        uint64_t done = monotonic_ns();
+
+        if (intended >= measure_from)
+            record(res, type, done - now, done - intended, response.response_code == RESPONSE_SUCCESS);
+
+        intended += interval_ns;
+    }
+
+    disconnect_from_server(comm_reqres, &session);
+}
+
+void *client_thread(void *arg)
+{
+    run_client((int)(intptr_t)arg);
+    return NULL;
+}
+
+static void merge_results(bench_result_t *total)
+{
+    memset(total, 0, sizeof(*total));
+    for (int c = 0; c < config.clients; ++c)
+    {
+        bench_result_t *r = &shared->results[c];
+        total->completed += r->completed;
+        total->errors += r->errors;
+        total->sum_ns += r->sum_ns;
+        total->corrected_sum_ns += r->corrected_sum_ns;
+        if (r->max_ns > total->max_ns)
+            total->max_ns = r->max_ns;
+        if (r->corrected_max_ns > total->corrected_max_ns)
+            total->corrected_max_ns = r->corrected_max_ns;
+        for (int t = 0; t < BENCH_TYPES; ++t)
+        {
+            total->by_type[t] += r->by_type[t];
+            total->sum_by_type[t] += r->sum_by_type[t];
+            if (r->max_by_type[t] > total->max_by_type[t])
+                total->max_by_type[t] = r->max_by_type[t];
+            for (int b = 0; b < HIST_BUCKETS; ++b)
+                total->latency[t][b] += r->latency[t][b];
+        }
+        for (int b = 0; b < HIST_BUCKETS; ++b)
+            total->corrected[b] += r->corrected[b];
+    }
+}
+
+static const double report_quantiles[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+static const char *report_quantile_names[] = {"p50", "p90", "p99", "p999", "p9999"};
+#define NUM_REPORT_QUANTILES (sizeof(report_quantiles) / sizeof(report_quantiles[0]))
+
+// Bucket limits can overshoot the largest sample, which is known exactly.
+static uint64_t quantile_at_most(const uint64_t hist[HIST_BUCKETS], double quantile, uint64_t max_ns)
+{
+    uint64_t value = latency_quantile(hist, quantile);
+    return value < max_ns ? value : max_ns;
+}
+
+static void print_latency(const uint64_t hist[HIST_BUCKETS], uint64_t count, uint64_t sum_ns, uint64_t max_ns)
+{
+    if (config.json)
+    {
+        printf("{\"mean\": %.0f", count ? (double)sum_ns / count : 0.0);
+        for (size_t q = 0; q < NUM_REPORT_QUANTILES; ++q)
+            printf(", \"%s\": %lu", report_quantile_names[q], (unsigned long)quantile_at_most(hist, report_quantiles[q], max_ns));
+        printf(", \"max\": %lu}", (unsigned long)max_ns);
+        return;
+    }
+
+    printf("mean %.0fns", count ? (double)sum_ns / count : 0.0);
+    for (size_t q = 0; q < NUM_REPORT_QUANTILES; ++q)
+        printf("  %s %luns", report_quantile_names[q], (unsigned long)quantile_at_most(hist, report_quantiles[q], max_ns));
+    printf("  max %luns\n", (unsigned long)max_ns);
+}
+
+void report(double elapsed_s)
+{
+    bench_result_t *total = calloc(1, sizeof(bench_result_t));
+    if (total == NULL)
+        return;
+    merge_results(total);
+
+    uint64_t overall[HIST_BUCKETS] = {0};
+    for (int t = 0; t < BENCH_TYPES; ++t)
+        for (int b = 0; b < HIST_BUCKETS; ++b)
+            overall[b] += total->latency[t][b];
+
+    double throughput = elapsed_s > 0 ? total->completed / elapsed_s : 0;
+
+    if (config.json)
+    {
+        printf("{\n  \"config\": {\"clients\": %d, \"mode\": \"%s\", \"duration_s\": %g, \"warmup_s\": %g, \"target_rate\": %g, \"batch_len\": %d, \"vector_len\": %d, \"mix\": {",
+               config.clients, config.processes ? "processes" : "threads", config.duration_s, config.warmup_s, config.rate, config.batch_len, config.vector_len);
+        bool first = true;
+        for (int t = 0; t < BENCH_TYPES; ++t)
+        {
+            if (config.weights[t] == 0)
+                continue;
+            printf("%s\"%s\": %u", first ? "" : ", ", type_names[t], config.weights[t]);
+            first = false;
+        }
+        printf("}},\n");
+        printf("  \"completed\": %lu,\n  \"errors\": %lu,\n  \"failed_clients\": %d,\n  \"elapsed_s\": %.3f,\n  \"throughput_rps\": %.1f,\n",
+               (unsigned long)total->completed, (unsigned long)total->errors, shared->failed, elapsed_s, throughput);
+        printf("  \"latency_ns\": ");
+        print_latency(overall, total->completed, total->sum_ns, total->max_ns);
+        printf(",\n  \"corrected_latency_ns\": ");
+        if (config.rate > 0)
+            print_latency(total->corrected, total->completed, total->corrected_sum_ns, total->corrected_max_ns);
+        else
+            printf("null");
+        printf(",\n  \"by_type\": {");
+        first = true;
+        for (int t = 0; t < BENCH_TYPES; ++t)
+        {
+            if (total->by_type[t] == 0)
+                continue;
+            printf("%s\n    \"%s\": {\"completed\": %lu, \"latency_ns\": ", first ? "" : ",", type_names[t], (unsigned long)total->by_type[t]);
+            print_latency(total->latency[t], total->by_type[t], total->sum_by_type[t], total->max_by_type[t]);
+            printf("}");
+            first = false;
+        }
+        printf("\n  }\n}\n");
+    }
+    else
+    {
+        printf("clients %d (%s)  elapsed %.2fs  completed %lu  errors %lu  throughput %.1f req/s\n",
+               config.clients, config.processes ? "processes" : "threads", elapsed_s,
+               (unsigned long)total->completed, (unsigned long)total->errors, throughput);
+        printf("%-28s", "latency");
+        print_latency(overall, total->completed, total->sum_ns, total->max_ns);
+        if (config.rate > 0)
+        {
+            printf("%-28s", "corrected latency");
+            print_latency(total->corrected, total->completed, total->corrected_sum_ns, total->corrected_max_ns);
+        }
+        for (int t = 0; t < BENCH_TYPES; ++t)
+        {
+            if (total->by_type[t] == 0)
+                continue;
+            printf("%-17s %8lu  ", type_names[t], (unsigned long)total->by_type[t]);
+            print_latency(total->latency[t], total->by_type[t], total->sum_by_type[t], total->max_by_type[t]);
+        }
+    }
+
+    free(total);
+}
+
+// Parses "arith:50,prime:30,batch:20" into request weights.
+int parse_mix(const char *mix)
+{
+    memset(config.weights, 0, sizeof(config.weights));
+
+    char buf[256];
+    strncpy(buf, mix, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    unsigned total = 0;
+    for (char *save = NULL, *item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strchr(item, ':');
+        unsigned weight = 1;
+        if (colon != NULL)
+        {
+            *colon = '\0';
+            weight = strtoul(colon + 1, NULL, 10);
+        }
+
+        int t;
+        for (t = 0; t < BENCH_TYPES; ++t)
+            if (mix_names[t] != NULL && strcmp(mix_names[t], item) == 0)
+                break;
+        if (t == BENCH_TYPES)
+        {
+            fprintf(stderr, "ERROR: Unknown request type '%s' in mix.\n", item);
+            return -1;
+        }
+
+        config.weights[t] = weight;
+        total += weight;
+    }
+
+    return total > 0 ? 0 : -1;
+}
+
+void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -c <clients>     number of clients (default 4)\n");
+    printf("  -p               run clients as processes instead of threads\n");
+    printf("  -d <seconds>     measured duration (default 5)\n");
+    printf("  -w <seconds>     warmup before measuring (default 1)\n");
+    printf("  -r <req/s>       total open-loop rate; 0 runs closed loop (default 0)\n");
+    printf("  -m <mix>         weighted request mix of arith, even, prime, negative, batch, vector\n");
+    printf("                   (default arith:50,prime:30,even:20)\n");
+    printf("  -b <len>         entries per batch request (default 16)\n");
+    printf("  -v <len>         lanes per vector request (default 1024)\n");
+    printf("  -n <max>         operands are drawn from [0, max) (default 100000)\n");
+    printf("  -t               print text instead of JSON\n");
+}
+
+int main(int argc, char **argv)
+{
+    config.clients = 4;
+    config.duration_s = 5;
+    config.warmup_s = 1;
+    config.batch_len = 16;
+    config.vector_len = 1024;
+    config.max_operand = 100000;
+    config.json = true;
+    parse_mix("arith:50,prime:30,even:20");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:pd:w:r:m:b:v:n:th")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.clients = atoi(optarg);
+            break;
+        case 'p':
+            config.processes = true;
+            break;
+        case 'd':
+            config.duration_s = atof(optarg);
+            break;
+        case 'w':
+            config.warmup_s = atof(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'm':
+            if (parse_mix(optarg) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'b':
+            config.batch_len = atoi(optarg);
+            break;
+        case 'v':
+            config.vector_len = atoi(optarg);
+            break;
+        case 'n':
+            config.max_operand = atoi(optarg);
+            break;
+        case 't':
+            config.json = false;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (config.clients <= 0 || config.duration_s <= 0 || config.warmup_s < 0 || config.rate < 0 ||
+        config.batch_len <= 0 || config.batch_len > MAX_BATCH_LEN ||
+        config.vector_len <= 0 || config.max_operand <= 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (memory_block_exists(CONNECT_CHANNEL_FNAME) != 1)
+    {
+        fprintf(stderr, "ERROR: Server likely not running. Please start the server and try again.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t shared_size = sizeof(bench_shared_t) + config.clients * sizeof(bench_result_t);
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Could not allocate results for %d clients.\n", config.clients);
+        return EXIT_FAILURE;
+    }
+
+    // Clients are forked before the logger starts its flusher thread, which
+    // would not survive the fork. Benchmarks log warnings and errors only
+    // unless CCS_LOG_LEVEL says otherwise.
+    set_log_level(LOG_LEVEL_WARN);
+
+    pthread_t *threads = NULL;
+    if (config.processes)
+    {
+        for (int i = 0; i < config.clients; ++i)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                init_logger("bench");
+                run_client(i);
+                close_logger();
+                _exit(EXIT_SUCCESS);
+            }
+            if (pid < 0)
+            {
+                fprintf(stderr, "ERROR: Could not fork client %d.\n", i);
+                __atomic_add_fetch(&shared->failed, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELAXED);
+            }
+        }
+        init_logger("bench");
+    }
+    else
+    {
+        init_logger("bench");
+        if (attach_server() < 0)
+        {
+            fprintf(stderr, "ERROR: Could not attach to the server.\n");
+            return EXIT_FAILURE;
+        }
+
+        threads = calloc(config.clients, sizeof(pthread_t));
+        if (threads == NULL)
+            return EXIT_FAILURE;
+        for (int i = 0; i < config.clients; ++i)
+            if (pthread_create(&threads[i], NULL, client_thread, (void *)(intptr_t)i) != 0)
+            {
+                fprintf(stderr, "ERROR: Could not start client thread %d.\n", i);
+                return EXIT_FAILURE;
+            }
+    }
+
+    int ready;
+    while ((ready = __atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE)) < config.clients)
+        futex_wait(&shared->ready, ready);
+
+    shared->start_ns = monotonic_ns();
+    __atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+    futex_wake(&shared->go, INT_MAX);
+
+    if (config.processes)
+        while (wait(NULL) > 0)
+            ;
+    else
+        for (int i = 0; i < config.clients; ++i)
+            pthread_join(threads[i], NULL);
+
+    report(config.duration_s);
+    bool all_failed = shared->failed == config.clients;
+
+    free(threads);
+    munmap(shared, shared_size);
+    close_logger();
+    return all_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "client_api.h"
+#include "logger.h"
+
+#include "ccs_client.h"
+
+// Implementation of libccs_client on top of client_api.h. Requests go out on
+// the channel's request ring (channel_ring.h); those submitted while it is
+// full queue up client-side until answers make room.
+
+_Static_assert(CCS_ARITHMETIC == (int)ARITHMETIC && CCS_EVEN_OR_ODD == (int)EVEN_OR_ODD && CCS_IS_PRIME == (int)IS_PRIME &&
+                   CCS_IS_NEGATIVE == (int)IS_NEGATIVE && CCS_VECTOR_ARITHMETIC == (int)VECTOR_ARITHMETIC &&
+                   CCS_FIRST_MODULE_TYPE == FIRST_MODULE_REQUEST_TYPE,
+               "request types out of sync with the server");
+_Static_assert(CCS_SUCCESS == (int)RESPONSE_SUCCESS && CCS_UNAUTHORIZED == (int)RESPONSE_UNAUTHORIZED &&
+                   CCS_UNSUPPORTED == (int)RESPONSE_UNSUPPORTED && CCS_FAILURE == (int)RESPONSE_FAILURE,
+               "response codes out of sync with the server");
+
+struct ccs_future_t
+{
+    ccs_client_t *client;
+    ccs_request_t req;
+    ccs_response_t res;
+    int done; // set with release order once res is written
+    bool released;
+    ccs_callback_t callback;
+    void *arg;
+    int next; // in the queue or on the free list, -1 at the end
+};
+
+struct ccs_client_t
+{
+    pthread_mutex_t lock; // guards everything below but the futures' done flags
+    ClientSession session;
+    RequestOrResponse *channel;
+    void *payload;
+
+    int outstanding;
+    int free_head;
+    int queue_head, queue_tail; // submitted, not sent yet
+
+    // Future of each request on the ring, by client_seq_num.
+    int on_ring[CHANNEL_RING_SLOTS];
+
+    ccs_future_t futures[CCS_MAX_IN_FLIGHT];
+};
+
+static pthread_mutex_t ccs_logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool ccs_logger_ready = false;
+
+// The log is named after the first client to connect.
+static void init_ccs_logger(const char *name)
+{
+    pthread_mutex_lock(&ccs_logger_lock);
+    if (!ccs_logger_ready)
+    {
+        char log_name[MAX_CLIENT_NAME_LEN];
+        snprintf(log_name, sizeof(log_name), "%s", name);
+        init_logger(log_name);
+        ccs_logger_ready = true;
+    }
+    pthread_mutex_unlock(&ccs_logger_lock);
+}
+
+static Request to_request(const ccs_request_t *req)
+{
+    Request out = {0};
+    out.request_type = (RequestType)req->type;
+    out.n1 = req->n1;
+    out.n2 = req->n2;
+    out.op = req->op;
+    out.payload_offset = req->payload_offset;
+    out.payload_len = req->payload_len;
+    out.reply_offset = req->reply_offset;
+    out.reply_capacity = req->reply_capacity;
+    return out;
+}
+
+static ccs_response_t from_response(Response res)
+{
+    ccs_response_t out = {res.response_code, res.result, res.payload_offset, res.payload_len};
+    return out;
+}
+
+static void free_future(ccs_client_t *client, ccs_future_t *future)
+{
+    int index = (int)(future - client->futures);
+    future->next = client->free_head;
+    client->free_head = index;
+}
+
+// Moves queued requests onto the ring while it has room. Called with the
+// lock held.
+static void send_queued(ccs_client_t *client)
+{
+    int sent = 0;
+    while (client->queue_head >= 0)
+    {
+        int index = client->queue_head;
+        unsigned int seq;
+        if (queue_request(client->channel, &client->session, to_request(&client->futures[index].req), &seq) < 0)
+            break;
+
+        client->on_ring[seq & RING_MASK] = index;
+        client->queue_head = client->futures[index].next;
+        ++sent;
+    }
+
+    if (client->queue_head < 0)
+        client->queue_tail = -1;
+    if (sent > 0)
+        notify_server(client->channel);
+}
+
+// Takes the answers that have arrived off the completion ring. Completed
+// futures with a callback are stored in `completed` for the caller to run
+// outside the lock. Called with the lock held.
+static int collect_responses(ccs_client_t *client, ccs_future_t **completed, int *num_completed)
+{
+    int n = 0;
+    Response res;
+    while (ring_take_completion(client->channel, &res))
+    {
+        ccs_future_t *future = &client->futures[client->on_ring[res.client_seq_num & RING_MASK]];
+        future->res = from_response(res);
+        __atomic_store_n(&future->done, 1, __ATOMIC_RELEASE);
+        ++n;
+
+        if (future->callback != NULL)
+            completed[(*num_completed)++] = future;
+        else
+        {
+            client->outstanding--;
+            if (future->released)
+                free_future(client, future);
+        }
+    }
+
+    return n;
+}
+
+// Runs the callbacks collected by collect_responses() and frees their futures.
+static void run_callbacks(ccs_client_t *client, ccs_future_t **completed, int num_completed)
+{
+    if (num_completed == 0)
+        return;
+
+    for (int i = 0; i < num_completed; ++i)
+        completed[i]->callback(completed[i], &completed[i]->res, completed[i]->arg);
+
+    pthread_mutex_lock(&client->lock);
+    for (int i = 0; i < num_completed; ++i)
+        free_future(client, completed[i]);
+    client->outstanding -= num_completed;
+    pthread_mutex_unlock(&client->lock);
+}
+
+ccs_client_t *ccs_connect(const char *name, size_t payload_size)
+{
+    if (name == NULL || name[0] == '\0')
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    init_ccs_logger(name);
+
+    // If the connection file does not exist, then the server is probably not running.
+    if (memory_block_exists(CONNECT_CHANNEL_FNAME) != 1)
+    {
+        logger("ERROR", "Server likely not running.");
+        errno = ENOENT;
+        return NULL;
+    }
+
+    ccs_client_t *client = malloc(sizeof(ccs_client_t));
+    if (client == NULL)
+    {
+        logger("ERROR", "Could not allocate the client for %s.", name);
+        return NULL;
+    }
+
+    client->session = (ClientSession){.payload_size = payload_size};
+    if (connect_to_server(name, &client->session) < 0)
+    {
+        free(client);
+        return NULL;
+    }
+
+    client->channel = get_session_channel(&client->session);
+    client->payload = get_session_payload(&client->session);
+    if (client->channel == NULL || (client->session.payload_size > 0 && client->payload == NULL))
+    {
+        logger("ERROR", "Could not locate the communication channel or payload region of %s.", name);
+        // The registration is handed back on the channel. Without one, the
+        // server only reclaims it once this process exits.
+        if (client->channel != NULL)
+            disconnect_from_server(client->channel, &client->session);
+        free(client);
+        return NULL;
+    }
+
+    pthread_mutex_init(&client->lock, NULL);
+    client->outstanding = 0;
+    client->queue_head = client->queue_tail = -1;
+    client->free_head = -1;
+    for (int i = CCS_MAX_IN_FLIGHT - 1; i >= 0; --i)
+    {
+        client->futures[i].client = client;
+        free_future(client, &client->futures[i]);
+    }
+
+    return client;
+}
+
+void ccs_disconnect(ccs_client_t *client)
+{
+    if (client == NULL)
+        return;
+
+    ccs_wait_all(client, -1);
+    disconnect_from_server(client->channel, &client->session);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+void *ccs_payload(ccs_client_t *client, size_t *size)
+{
+    if (size != NULL)
+        *size = client->payload != NULL ? client->session.payload_size : 0;
+    return client->payload;
+}
+
+int ccs_submit_batch(ccs_client_t *client, const ccs_request_t *reqs, int count, ccs_future_t **futures,
+                     ccs_callback_t callback, void *arg)
+{
+    if (count < 0 || (futures == NULL && callback == NULL))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        // UNREGISTER is ccs_disconnect()'s, and BATCH has no handler to run it.
+        if (reqs[i].type < 0 || reqs[i].type >= MAX_REQUEST_TYPES || reqs[i].type == UNREGISTER || reqs[i].type == BATCH)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&client->lock);
+    if (client->outstanding + count > CCS_MAX_IN_FLIGHT)
+    {
+        pthread_mutex_unlock(&client->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        int index = client->free_head;
+        ccs_future_t *future = &client->futures[index];
+        client->free_head = future->next;
+
+        future->req = reqs[i];
+        future->done = 0;
+        future->released = false;
+        future->callback = callback;
+        future->arg = arg;
+        future->next = -1;
+        if (client->queue_tail >= 0)
+            client->futures[client->queue_tail].next = index;
+        else
+            client->queue_head = index;
+        client->queue_tail = index;
+
+        if (futures != NULL)
+            futures[i] = future;
+    }
+    client->outstanding += count;
+
+    send_queued(client);
+    pthread_mutex_unlock(&client->lock);
+
+    return count;
+}
+
+ccs_future_t *ccs_submit(ccs_client_t *client, const ccs_request_t *req, ccs_callback_t callback, void *arg)
+{
+    ccs_future_t *future;
+    if (ccs_submit_batch(client, req, 1, &future, callback, arg) < 0)
+        return NULL;
+    return future;
+}
+
+int ccs_poll(ccs_client_t *client)
+{
+    ccs_future_t *completed[CHANNEL_RING_SLOTS];
+    int num_completed = 0;
+
+    pthread_mutex_lock(&client->lock);
+    int n = collect_responses(client, completed, &num_completed);
+    send_queued(client);
+    pthread_mutex_unlock(&client->lock);
+
+    if (n > 0)
+        ring_signal_completion(client->channel);
+
+    run_callbacks(client, completed, num_completed);
+    return n;
+}
+
+// Drives the client until `is_done` holds, sleeping on the completion ring
+// while the server works on what was sent.
+static int wait_until(ccs_client_t *client, bool (*is_done)(void *), void *what, long timeout_ms)
+{
+    unsigned long deadline = timeout_ms < 0 ? 0 : monotonic_ns() + (unsigned long)timeout_ms * 1000000UL;
+
+    while (true)
+    {
+        // Read first, so that answers another thread takes after we looked
+        // wake us.
+        int seen_signal = ring_read_signal(client->channel);
+        ccs_poll(client);
+        if (is_done(what))
+            return 0;
+
+        long remaining = timeout_ms < 0 ? -1 : (long)(deadline - monotonic_ns());
+        if (timeout_ms >= 0 && remaining <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        // With nothing on the ring, what is waited for is a callback running
+        // on another thread.
+        if (ring_outstanding(client->channel) == 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if (ring_wait_completion(client->channel, seen_signal, remaining) < 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+static bool future_done(void *future)
+{
+    return ccs_is_done((ccs_future_t *)future);
+}
+
+static bool client_idle(void *client)
+{
+    return ccs_outstanding((ccs_client_t *)client) == 0;
+}
+
+int ccs_wait(ccs_future_t *future, long timeout_ms)
+{
+    if (ccs_is_done(future))
+        return 0;
+    return wait_until(future->client, future_done, future, timeout_ms);
+}
+
+int ccs_wait_all(ccs_client_t *client, long timeout_ms)
+{
+    return wait_until(client, client_idle, client, timeout_ms);
+}
+
+bool ccs_is_done(const ccs_future_t *future)
+{
+    return __atomic_load_n(&future->done, __ATOMIC_ACQUIRE) != 0;
+}
+
+ccs_response_t ccs_get_response(const ccs_future_t *future)
+{
+    return future->res;
+}
+
+void ccs_release(ccs_future_t *future)
+{
+    ccs_client_t *client = future->client;
+
+    pthread_mutex_lock(&client->lock);
+    if (ccs_is_done(future))
+        free_future(client, future);
+    else
+        future->released = true;
+    pthread_mutex_unlock(&client->lock);
+}
+
+int ccs_outstanding(ccs_client_t *client)
+{
+    pthread_mutex_lock(&client->lock);
+    int outstanding = client->outstanding;
+    pthread_mutex_unlock(&client->lock);
+    return outstanding;
+}
@@ -0,0 +1,118 @@
+#ifndef CCS_CLIENT_H
+#define CCS_CLIENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// libccs_client: asynchronous client library, built into lib/ as
+// libccs_client.a and libccs_client.so (make lib). This header is all an
+// application includes; it does not pull in the server's internal headers.
+//
+// Requests are submitted without waiting and complete through futures, which
+// can be waited on with a timeout, or through callbacks. Up to
+// CCS_MAX_IN_FLIGHT requests may be outstanding per connection. They are
+// served concurrently and complete in whatever order the server finishes
+// them, not the order they were submitted in.
+//
+// A connection may be shared between threads. Callbacks run on whichever
+// thread completes the request inside ccs_poll(), ccs_wait() or
+// ccs_wait_all().
+
+#define CCS_MAX_IN_FLIGHT (1024)
+
+// The library is built with -fvisibility=hidden; only these are exported.
+#define CCS_API __attribute__((visibility("default")))
+
+// Same values as the server's RequestType and ResponseCode.
+enum
+{
+    CCS_ARITHMETIC = 0,
+    CCS_EVEN_OR_ODD = 1,
+    CCS_IS_PRIME = 2,
+    CCS_IS_NEGATIVE = 3,
+    CCS_VECTOR_ARITHMETIC = 6,
+    CCS_FIRST_MODULE_TYPE = 16 // types of handler modules start here
+};
+
+enum
+{
+    CCS_SUCCESS = 200,
+    CCS_UNAUTHORIZED = 401,
+    CCS_UNSUPPORTED = 422,
+    CCS_FAILURE = 500
+};
+
+typedef struct ccs_request_t
+{
+    int type;
+    int n1, n2;
+    char op;
+    // Input and output in the connection's payload region, see ccs_payload().
+    // Requests outstanding at the same time may be served concurrently, so
+    // they must use disjoint parts of it.
+    unsigned int payload_offset, payload_len;
+    unsigned int reply_offset, reply_capacity;
+} ccs_request_t;
+
+typedef struct ccs_response_t
+{
+    int code; // CCS_SUCCESS, ...
+    int result;
+    unsigned int payload_offset, payload_len;
+} ccs_response_t;
+
+typedef struct ccs_client_t ccs_client_t;
+typedef struct ccs_future_t ccs_future_t;
+
+// Called once the request has been answered. The future is released when the
+// callback returns.
+typedef void (*ccs_callback_t)(ccs_future_t *future, const ccs_response_t *res, void *arg);
+
+// Registers with the server under `name`, asking for a payload region of
+// `payload_size` bytes (0 for none). Returns NULL on failure.
+CCS_API ccs_client_t *ccs_connect(const char *name, size_t payload_size);
+
+// Waits for every outstanding request, then unregisters and frees the client.
+CCS_API void ccs_disconnect(ccs_client_t *client);
+
+// The payload region granted at registration, NULL if none.
+CCS_API void *ccs_payload(ccs_client_t *client, size_t *size);
+
+// Queues a request. With a callback the future belongs to the library and
+// the returned pointer must not be used; without one it must be handed back
+// with ccs_release(). Returns NULL with errno EAGAIN when CCS_MAX_IN_FLIGHT
+// requests are outstanding, or EINVAL for a request type that cannot be
+// submitted.
+CCS_API ccs_future_t *ccs_submit(ccs_client_t *client, const ccs_request_t *req, ccs_callback_t callback, void *arg);
+
+// Queues `count` requests at once, or none of them. Their futures are stored
+// in `futures`, which may be NULL if a callback is given. Returns `count`, or
+// -1 with errno set as for ccs_submit().
+CCS_API int ccs_submit_batch(ccs_client_t *client, const ccs_request_t *reqs, int count, ccs_future_t **futures,
+                             ccs_callback_t callback, void *arg);
+
+// Collects whatever responses have arrived and sends what is queued, without
+// blocking. Returns the number of requests completed.
+CCS_API int ccs_poll(ccs_client_t *client);
+
+// Waits for the future to complete, for at most `timeout_ms` (forever if
+// negative). Returns 0, or -1 with errno ETIMEDOUT; the request stays
+// outstanding.
+CCS_API int ccs_wait(ccs_future_t *future, long timeout_ms);
+
+// As ccs_wait(), for every request outstanding on the client.
+CCS_API int ccs_wait_all(ccs_client_t *client, long timeout_ms);
+
+CCS_API bool ccs_is_done(const ccs_future_t *future);
+
+// The response of a completed future.
+CCS_API ccs_response_t ccs_get_response(const ccs_future_t *future);
+
+// Hands a future without callback back. If it has not completed yet, the
+// response is dropped when it arrives.
+CCS_API void ccs_release(ccs_future_t *future);
+
+// Requests submitted and not completed yet.
+CCS_API int ccs_outstanding(ccs_client_t *client);
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "prime_sieve.h"
+
+// Builds the sieve file the server maps with -s. Run once per limit; every
+// server started on the same file shares its pages.
+
+void usage(const char *progname)
+{
+    printf("Usage: %s [-l <limit>] [-t <threads>] [-o <file>]\n", progname);
+    printf("  -l  numbers below this are covered, at most 2^32 (default %llu)\n", (unsigned long long)SIEVE_DEFAULT_LIMIT);
+    printf("  -t  sieving threads (default: online cores)\n");
+    printf("  -o  output file (default %s)\n", SIEVE_DEFAULT_FNAME);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t limit = SIEVE_DEFAULT_LIMIT;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = SIEVE_DEFAULT_FNAME;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (init_logger("ccs-sieve") == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (build_sieve_file(path, limit, threads) < 0)
+    {
+        fprintf(stderr, "Could not build %s\n", path);
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Wrote %s: n < %llu, %llu bytes, %.2fs on %d threads\n", path, (unsigned long long)limit,
+           (unsigned long long)(SIEVE_HEADER_SIZE + (limit + 127) / 128 * 8), elapsed, threads < 1 ? 1 : threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "stats.h"
+
+// Live view of a running server's stats segment. The segment is mapped
+// read-only and sampled once per interval; the server never waits on us.
+
+typedef struct stats_snapshot_t
+{
+    uint64_t taken_ns;
+    stats_shard_t totals; // every shard summed
+} stats_snapshot_t;
+
+// Handler types are named by the server; these are the ones without a handler.
+static const char *request_type_names[NUM_BUILTIN_REQUEST_TYPES] = {"ARITHMETIC", "EVEN_OR_ODD", "IS_PRIME", "IS_NEGATIVE", "UNREGISTER", "BATCH", "VECTOR"};
+static const char *latency_kind_names[NUM_LATENCY_KINDS] = {"queue wait", "handler", "pickup"};
+
+static const char *type_name(const stats_segment_t *stats, int type)
+{
+    static char unknown[16];
+    if (stats->type_names[type][0] != '\0')
+        return stats->type_names[type];
+    if (type < NUM_BUILTIN_REQUEST_TYPES)
+        return request_type_names[type];
+    snprintf(unknown, sizeof(unknown), "TYPE %d", type);
+    return unknown;
+}
+
+void take_snapshot(const stats_segment_t *stats, stats_snapshot_t *snap)
+{
+    memset(&snap->totals, 0, sizeof(snap->totals));
+    snap->taken_ns = monotonic_ns();
+
+    for (int s = 0; s < STATS_NUM_SHARDS; ++s)
+    {
+        const stats_shard_t *shard = &stats->shards[s];
+        stats_shard_t *t = &snap->totals;
+
+        t->serviced += __atomic_load_n(&shard->serviced, __ATOMIC_RELAXED);
+        t->batch_entries += __atomic_load_n(&shard->batch_entries, __ATOMIC_RELAXED);
+        t->tasks += __atomic_load_n(&shard->tasks, __ATOMIC_RELAXED);
+        t->steals += __atomic_load_n(&shard->steals, __ATOMIC_RELAXED);
+        t->auth_failures += __atomic_load_n(&shard->auth_failures, __ATOMIC_RELAXED);
+        t->registrations += __atomic_load_n(&shard->registrations, __ATOMIC_RELAXED);
+        t->unregistrations += __atomic_load_n(&shard->unregistrations, __ATOMIC_RELAXED);
+        t->reaped += __atomic_load_n(&shard->reaped, __ATOMIC_RELAXED);
+        t->cache_hits += __atomic_load_n(&shard->cache_hits, __ATOMIC_RELAXED);
+        t->cache_misses += __atomic_load_n(&shard->cache_misses, __ATOMIC_RELAXED);
+        t->cache_coalesced += __atomic_load_n(&shard->cache_coalesced, __ATOMIC_RELAXED);
+
+        for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+        {
+            t->handler_calls[type] += __atomic_load_n(&shard->handler_calls[type], __ATOMIC_RELAXED);
+            t->handler_ns[type] += __atomic_load_n(&shard->handler_ns[type], __ATOMIC_RELAXED);
+            t->requests[type] += __atomic_load_n(&shard->requests[type], __ATOMIC_RELAXED);
+            for (int kind = 0; kind < NUM_LATENCY_KINDS; ++kind)
+                for (int b = 0; b < HIST_BUCKETS; ++b)
+                    t->latency[type][kind][b] += __atomic_load_n(&shard->latency[type][kind][b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void format_ns(uint64_t ns, char *buf, size_t len)
+{
+    if (ns < 1000)
+        snprintf(buf, len, "%luns", (unsigned long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, len, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, len, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, len, "%.2fs", ns / 1e9);
+}
+
+static inline double rate(uint64_t now, uint64_t before, double secs)
+{
+    return secs > 0 ? (now - before) / secs : 0;
+}
+
+// Prints rates over the last interval and percentiles over either the last
+// interval or, with `cumulative`, everything since the server started.
+void render(const stats_segment_t *stats, const stats_snapshot_t *prev, const stats_snapshot_t *cur, bool cumulative, bool clear)
+{
+    const stats_shard_t *p = &prev->totals;
+    const stats_shard_t *c = &cur->totals;
+    double secs = (cur->taken_ns - prev->taken_ns) / 1e9;
+
+    if (clear)
+        printf("\033[H\033[2J");
+
+    printf("ccs-top  server pid %d  up %.1fs  workers %d  clients %lu  queue depth %lu\n",
+           stats->server_pid, (cur->taken_ns - stats->start_ns) / 1e9, stats->pool_size,
+           (unsigned long)__atomic_load_n(&stats->connected_clients, __ATOMIC_RELAXED),
+           (unsigned long)__atomic_load_n(&stats->queue_depth, __ATOMIC_RELAXED));
+    printf("serviced %.0f/s (total %lu)  batch entries %.0f/s  tasks %.0f/s  steals %.0f/s\n",
+           rate(c->serviced, p->serviced, secs), (unsigned long)c->serviced, rate(c->batch_entries, p->batch_entries, secs),
+           rate(c->tasks, p->tasks, secs), rate(c->steals, p->steals, secs));
+    printf("registrations %lu  unregistrations %lu  reaped %lu  auth failures %lu\n",
+           (unsigned long)c->registrations, (unsigned long)c->unregistrations, (unsigned long)c->reaped,
+           (unsigned long)c->auth_failures);
+
+    uint64_t lookups = (c->cache_hits - p->cache_hits) + (c->cache_misses - p->cache_misses) + (c->cache_coalesced - p->cache_coalesced);
+    printf("cache hits %.0f/s  misses %.0f/s  coalesced %.0f/s  hit ratio %.1f%%\n\n",
+           rate(c->cache_hits, p->cache_hits, secs), rate(c->cache_misses, p->cache_misses, secs),
+           rate(c->cache_coalesced, p->cache_coalesced, secs), lookups ? 100.0 * (c->cache_hits - p->cache_hits) / lookups : 0);
+
+    printf("%-12s %10s", "TYPE", "REQ/S");
+    for (int kind = 0; kind < NUM_LATENCY_KINDS; ++kind)
+        printf("  %-26s", latency_kind_names[kind]);
+    printf("\n%-12s %10s", "", "");
+    for (int kind = 0; kind < NUM_LATENCY_KINDS; ++kind)
+        printf("  %8s %8s %8s", "p50", "p99", "p999");
+    printf("\n");
+
+    for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+    {
+        if (c->requests[type] == 0)
+            continue;
+
+        printf("%-12s %10.0f", type_name(stats, type), rate(c->requests[type], p->requests[type], secs));
+        for (int kind = 0; kind < NUM_LATENCY_KINDS; ++kind)
+        {
+            uint64_t hist[HIST_BUCKETS];
+            for (int b = 0; b < HIST_BUCKETS; ++b)
+                hist[b] = cumulative ? c->latency[type][kind][b] : c->latency[type][kind][b] - p->latency[type][kind][b];
+
+            char p50[16], p99[16], p999[16];
+            format_ns(latency_quantile(hist, 0.50), p50, sizeof(p50));
+            format_ns(latency_quantile(hist, 0.99), p99, sizeof(p99));
+            format_ns(latency_quantile(hist, 0.999), p999, sizeof(p999));
+            printf("  %8s %8s %8s", p50, p99, p999);
+        }
+        printf("\n");
+    }
+
+    // Handler calls include batch entries, which the table above counts as
+    // part of their BATCH.
+    printf("\n%-12s %10s %10s\n", "HANDLER", "CALLS/S", "MEAN");
+    for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+    {
+        uint64_t calls = c->handler_calls[type] - p->handler_calls[type];
+        uint64_t ns = c->handler_ns[type] - p->handler_ns[type];
+        if (cumulative)
+        {
+            calls = c->handler_calls[type];
+            ns = c->handler_ns[type];
+        }
+        if (c->handler_calls[type] == 0)
+            continue;
+
+        char mean[16];
+        format_ns(calls ? ns / calls : 0, mean, sizeof(mean));
+        printf("%-12s %10.0f %10s\n", type_name(stats, type), rate(c->handler_calls[type], p->handler_calls[type], secs), mean);
+    }
+
+    fflush(stdout);
+}
+
+void usage(const char *prog)
+{
+    printf("Usage: %s [-i <interval_ms>] [-n <iterations>] [-c]\n", prog);
+    printf("  -c  show percentiles since server start instead of over the last interval\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long interval_ms = 1000;
+    long iterations = 0; // 0 runs until interrupted
+    bool cumulative = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:c")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval_ms = atol(optarg);
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'c':
+            cumulative = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (interval_ms <= 0)
+        interval_ms = 1000;
+
+    const stats_segment_t *stats = attach_stats_segment();
+    if (stats == NULL)
+    {
+        fprintf(stderr, "ERROR: No server stats found. Is the server running in this directory with the same CCS_SHM_BACKEND?\n");
+        return EXIT_FAILURE;
+    }
+
+    stats_snapshot_t *prev = malloc(sizeof(stats_snapshot_t));
+    stats_snapshot_t *cur = malloc(sizeof(stats_snapshot_t));
+    if (prev == NULL || cur == NULL)
+        return EXIT_FAILURE;
+
+    bool clear = isatty(STDOUT_FILENO);
+    take_snapshot(stats, prev);
+    for (long i = 0; iterations == 0 || i < iterations; ++i)
+    {
+        msleep(interval_ms);
+        if (kill(stats->server_pid, 0) == -1 && errno == ESRCH)
+        {
+            fprintf(stderr, "Server %d has exited.\n", stats->server_pid);
+            break;
+        }
+
+        take_snapshot(stats, cur);
+        render(stats, prev, cur, cumulative, clear);
+
+        stats_snapshot_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    detach_memory_block(stats);
+    free(prev);
+    free(cur);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_DECODER_ONLY
+#include "trace.h"
+
+// Rebuilds the text log from a binary trace directory written by a
+// LOG_BINARY_TRACE build. Records from all threads are merged by timestamp.
+
+#define MAX_MESSAGE_SIZE (2048)
+
+typedef struct site_info_t
+{
+    int line;
+    const char *code;
+    const char *file;
+    const char *func;
+    const char *format;
+} site_info_t;
+
+typedef struct ring_view_t
+{
+    const trace_header_t *hdr;
+    const trace_record_t *records;
+    size_t map_size;
+    uint64_t next; // next record to print
+    uint64_t end;
+} ring_view_t;
+
+static site_info_t *sites;
+static uint32_t num_sites;
+static char *sites_blob;
+
+int load_sites(const char *dir)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sites", dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERROR: Cannot open %s.\n", path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    sites_blob = malloc(size + 1);
+    if (sites_blob == NULL || fread(sites_blob, 1, size, f) != (size_t)size)
+    {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    sites_blob[size] = '\0';
+
+    if (size < 12 || memcmp(sites_blob, TRACE_SITES_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ERROR: %s is not a trace site table.\n", path);
+        return -1;
+    }
+
+    memcpy(&num_sites, sites_blob + 8, sizeof(num_sites));
+    sites = calloc(num_sites, sizeof(site_info_t));
+    if (sites == NULL)
+        return -1;
+
+    char *p = sites_blob + 12;
+    char *blob_end = sites_blob + size;
+    for (uint32_t i = 0; i < num_sites; ++i)
+    {
+        if (p + sizeof(int32_t) > blob_end)
+            return -1;
+        int32_t line;
+        memcpy(&line, p, sizeof(line));
+        p += sizeof(line);
+        sites[i].line = line;
+
+        const char **fields[] = {&sites[i].code, &sites[i].file, &sites[i].func, &sites[i].format};
+        for (size_t k = 0; k < sizeof(fields) / sizeof(fields[0]); ++k)
+        {
+            if (p >= blob_end)
+                return -1;
+            *fields[k] = p;
+            p += strlen(p) + 1;
+        }
+    }
+
+    return 0;
+}
+
+int open_ring(const char *path, ring_view_t *view)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < TRACE_HEADER_SIZE)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return -1;
+
+    const trace_header_t *hdr = (const trace_header_t *)mem;
+    if (memcmp(hdr->magic, TRACE_MAGIC, 8) != 0 || hdr->version != TRACE_VERSION || hdr->record_size != TRACE_RECORD_SIZE ||
+        TRACE_HEADER_SIZE + hdr->capacity * TRACE_RECORD_SIZE > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "WARN: Skipping %s, not a trace ring.\n", path);
+        munmap(mem, st.st_size);
+        return -1;
+    }
+
+    view->hdr = hdr;
+    view->records = (const trace_record_t *)((const char *)mem + TRACE_HEADER_SIZE);
+    view->map_size = st.st_size;
+    view->end = hdr->written;
+    view->next = hdr->written > hdr->capacity ? hdr->written - hdr->capacity : 0;
+    return 0;
+}
+
+static inline const trace_record_t *ring_record(const ring_view_t *view, uint64_t n)
+{
+    return &view->records[n & (view->hdr->capacity - 1)];
+}
+
+// Formats the site's format string against the arguments stored in rec.
+void render_message(const site_info_t *site, const trace_record_t *rec, char *out, size_t out_size)
+{
+    size_t used = 0;
+    size_t pos = 0;
+    const char *fmt = site->format;
+    const char *end;
+    trace_arg_kind_t kind;
+
+#define APPEND(...)                                                          \
+    do                                                                       \
+    {                                                                        \
+        if (used < out_size)                                                 \
+        {                                                                    \
+            int n = snprintf(out + used, out_size - used, __VA_ARGS__);      \
+            used += n > 0 ? (size_t)n : 0;                                   \
+        }                                                                    \
+    } while (0)
+
+    for (const char *conv = next_trace_conversion(fmt, &end, &kind); conv != NULL; conv = next_trace_conversion(fmt, &end, &kind))
+    {
+        char literal[1024];
+        size_t literal_len = conv - fmt < (long)sizeof(literal) - 1 ? (size_t)(conv - fmt) : sizeof(literal) - 1;
+        memcpy(literal, fmt, literal_len);
+        literal[literal_len] = '\0';
+        APPEND(literal, 0);
+
+        char spec[32];
+        size_t spec_len = end - conv < (long)sizeof(spec) - 1 ? (size_t)(end - conv) : sizeof(spec) - 1;
+        memcpy(spec, conv, spec_len);
+        spec[spec_len] = '\0';
+        fmt = end;
+
+        if (kind == TRACE_ARG_STRING)
+        {
+            if (pos >= rec->len)
+                break;
+            char s[TRACE_MAX_STRING_ARG + 1];
+            size_t len = rec->payload[pos++];
+            memcpy(s, rec->payload + pos, len);
+            s[len] = '\0';
+            pos += len;
+            APPEND(spec, s);
+            continue;
+        }
+
+        if (pos + sizeof(uint64_t) > rec->len)
+            break;
+        uint64_t value;
+        memcpy(&value, rec->payload + pos, sizeof(value));
+        pos += sizeof(value);
+
+        switch (kind)
+        {
+        case TRACE_ARG_LONG:
+            APPEND(spec, (long)value);
+            break;
+        case TRACE_ARG_LLONG:
+            APPEND(spec, (long long)value);
+            break;
+        case TRACE_ARG_SIZE:
+            APPEND(spec, (size_t)value);
+            break;
+        case TRACE_ARG_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            APPEND(spec, d);
+            break;
+        }
+        case TRACE_ARG_POINTER:
+            APPEND(spec, (void *)(uintptr_t)value);
+            break;
+        default:
+            APPEND(spec, (int)value);
+            break;
+        }
+    }
+
+    if (rec->truncated)
+        APPEND("...<truncated>");
+    else
+        APPEND(fmt, 0);
+
+#undef APPEND
+}
+
+void print_record(FILE *out, const ring_view_t *view, const trace_record_t *rec)
+{
+    const trace_header_t *hdr = view->hdr;
+    if (rec->site >= num_sites)
+    {
+        fprintf(out, "WARN trace record with unknown site %u\n", rec->site);
+        return;
+    }
+    const site_info_t *site = &sites[rec->site];
+
+    double offset_ns = ((double)(int64_t)(rec->tsc - hdr->base_tsc)) / hdr->tsc_per_ns;
+    uint64_t ns = hdr->base_realtime_ns + (int64_t)offset_ns;
+    time_t secs = ns / 1000000000ull;
+    struct tm lt;
+    localtime_r(&secs, &lt);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &lt);
+
+    char msg[MAX_MESSAGE_SIZE];
+    render_message(site, rec, msg, sizeof(msg));
+
+    fprintf(out, "%s %s.%06lu (%s:%d) [%d:%08x] %s \"%s\"\n", site->code, timestamp, (unsigned long)(ns % 1000000000ull) / 1000,
+            site->file, site->line, hdr->pid, hdr->thread_tag, site->func, msg);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s <trace-dir> [output-file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *dir = argv[1];
+    if (load_sites(dir) == -1)
+        return EXIT_FAILURE;
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        fprintf(stderr, "ERROR: Cannot open trace directory %s.\n", dir);
+        return EXIT_FAILURE;
+    }
+
+    size_t num_rings = 0, rings_cap = 16;
+    ring_view_t *rings = malloc(rings_cap * sizeof(ring_view_t));
+    struct dirent *ent;
+    while (rings != NULL && (ent = readdir(d)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 5, ".ring") != 0)
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (num_rings == rings_cap)
+        {
+            rings_cap *= 2;
+            rings = realloc(rings, rings_cap * sizeof(ring_view_t));
+            if (rings == NULL)
+                break;
+        }
+        if (open_ring(path, &rings[num_rings]) == 0)
+            num_rings++;
+    }
+    closedir(d);
+    if (rings == NULL)
+        return EXIT_FAILURE;
+
+    FILE *out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Cannot open %s for writing.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    // Each ring is already in time order, so merge by always taking the oldest head.
+    unsigned long total = 0;
+    while (1)
+    {
+        ring_view_t *oldest = NULL;
+        for (size_t i = 0; i < num_rings; ++i)
+        {
+            if (rings[i].next == rings[i].end)
+                continue;
+            if (oldest == NULL || (int64_t)(ring_record(&rings[i], rings[i].next)->tsc - ring_record(oldest, oldest->next)->tsc) < 0)
+                oldest = &rings[i];
+        }
+        if (oldest == NULL)
+            break;
+
+        print_record(out, oldest, ring_record(oldest, oldest->next));
+        oldest->next++;
+        total++;
+    }
+
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "Decoded %lu records from %zu threads.\n", total, num_rings);
+    for (size_t i = 0; i < num_rings; ++i)
+        munmap((void *)rings[i].hdr, rings[i].map_size);
+    free(rings);
+    free(sites);
+    free(sites_blob);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+#ifndef CHANNEL_ARENA_H
+#define CHANNEL_ARENA_H
+
+#include <stddef.h>
+
+#include "common_structs.h"
+#include "shared_memory.h"
+#include "doorbell.h"
+#include "logger.h"
+
+#define CHANNEL_ARENA_FNAME "srv_channel_arena"
+
+#define ARENA_NO_SLOT (0xffffffffUL)
+
+// One shared block holding the communication channel of every client.
+// Channels are fixed-size slots handed out from a lock-free free-list, and
+// clients locate theirs by its offset from the start of the arena.
+typedef struct channel_arena_t
+{
+    size_t num_slots;
+    size_t slots_offset;
+    size_t next_free_offset;
+
+    // Head of the free-list: ABA tag in the high 32 bits, slot in the low 32.
+    unsigned long free_head __attribute__((aligned(64)));
+} channel_arena_t;
+
+static inline unsigned int *arena_next_free(channel_arena_t *arena)
+{
+    return (unsigned int *)((char *)arena + arena->next_free_offset);
+}
+
+static inline RequestOrResponse *arena_channel(channel_arena_t *arena, int slot)
+{
+    return (RequestOrResponse *)((char *)arena + arena->slots_offset) + slot;
+}
+
+static inline size_t arena_channel_offset(channel_arena_t *arena, int slot)
+{
+    return arena->slots_offset + slot * sizeof(RequestOrResponse);
+}
+
+// Channel pages are only touched once a slot is handed out, so a large arena
+// costs address space rather than memory.
+channel_arena_t *create_channel_arena(size_t num_slots)
+{
+    logger("DEBUG", "Initialising channel arena");
+    if (num_slots == 0 || num_slots > MAX_CLIENTS)
+        num_slots = MAX_CLIENTS;
+
+    size_t next_free_offset = (sizeof(channel_arena_t) + 63) & ~(size_t)63;
+    size_t slots_offset = (next_free_offset + num_slots * sizeof(unsigned int) + 4095) & ~(size_t)4095;
+    size_t size = slots_offset + num_slots * sizeof(RequestOrResponse);
+
+    prepare_memory_block_name(CHANNEL_ARENA_FNAME);
+    channel_arena_t *arena = (channel_arena_t *)attach_memory_block(CHANNEL_ARENA_FNAME, size);
+    if (arena == NULL)
+    {
+        logger("ERROR", "Could not create shared memory block for the channel arena.");
+        return NULL;
+    }
+
+    arena->num_slots = num_slots;
+    arena->slots_offset = slots_offset;
+    arena->next_free_offset = next_free_offset;
+
+    unsigned int *next_free = arena_next_free(arena);
+    for (size_t i = 0; i < num_slots; ++i)
+        next_free[i] = i + 1 < num_slots ? i + 1 : ARENA_NO_SLOT;
+    arena->free_head = 0;
+
+    logger("INFO", "Channel arena creation succesful with %zu slots", num_slots);
+    return arena;
+}
+
+channel_arena_t *get_channel_arena()
+{
+    // The whole block is mapped, so the header size is enough to find it.
+    channel_arena_t *arena = (channel_arena_t *)attach_memory_block(CHANNEL_ARENA_FNAME, sizeof(channel_arena_t));
+    if (arena == NULL)
+    {
+        logger("ERROR", "Could not attach the channel arena.");
+        return NULL;
+    }
+
+    return arena;
+}
+
+// Pops a free slot. Returns -1 if every slot is in use.
+int alloc_arena_slot(channel_arena_t *arena)
+{
+    unsigned int *next_free = arena_next_free(arena);
+    unsigned long head = __atomic_load_n(&arena->free_head, __ATOMIC_ACQUIRE);
+    while (true)
+    {
+        unsigned long slot = head & 0xffffffffUL;
+        if (slot == ARENA_NO_SLOT)
+            return -1;
+
+        unsigned long next = __atomic_load_n(&next_free[slot], __ATOMIC_RELAXED);
+        unsigned long new_head = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&arena->free_head, &head, new_head, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (int)slot;
+    }
+}
+
+void free_arena_slot(channel_arena_t *arena, int slot)
+{
+    unsigned int *next_free = arena_next_free(arena);
+    unsigned long head = __atomic_load_n(&arena->free_head, __ATOMIC_RELAXED);
+    while (true)
+    {
+        __atomic_store_n(&next_free[slot], (unsigned int)(head & 0xffffffffUL), __ATOMIC_RELAXED);
+        unsigned long new_head = (((head >> 32) + 1) << 32) | (unsigned long)slot;
+        if (__atomic_compare_exchange_n(&arena->free_head, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+// Client side: locates the channel handed out at registration.
+RequestOrResponse *get_req_or_res(channel_arena_t *arena, size_t channel_offset)
+{
+    if (channel_offset < arena->slots_offset || channel_offset >= arena_channel_offset(arena, arena->num_slots))
+    {
+        logger("ERROR", "Channel offset %zu lies outside the channel arena.", channel_offset);
+        return NULL;
+    }
+
+    return (RequestOrResponse *)((char *)arena + channel_offset);
+}
+
+int destroy_channel_arena(channel_arena_t *arena)
+{
+    logger("INFO", "Starting channel arena cleanup");
+
+    detach_memory_block(arena);
+    destroy_memory_block(CHANNEL_ARENA_FNAME);
+    release_memory_block_name(CHANNEL_ARENA_FNAME);
+
+    logger("INFO", "Completed channel arena cleanup");
+    return 0;
+}
+
+#endif
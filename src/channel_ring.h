@@ -0,0 +1,157 @@
+#ifndef CHANNEL_RING_H
+#define CHANNEL_RING_H
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "utils.h"
+#include "common_structs.h"
+
+// Pipelined requests on a client channel. The client publishes requests on
+// the channel's request ring (sq) and the server answers each of them on the
+// completion ring (cq) as soon as it is done, so answers come back in the
+// order they were computed, not the order they were sent. Both are tagged:
+// a response carries the client_seq_num of its request.
+//
+// sq has one producer, the client. Workers claim its entries with a CAS on
+// sq_head, since a second worker may answer a doorbell rung while the first
+// is still draining. cq has many producers, the workers, which reserve their
+// entry with a fetch-and-add on cq_tail, and one consumer, the client.
+//
+// The client keeps at most CHANNEL_RING_SLOTS requests outstanding, counting
+// until their answers are taken off cq, so that no cq entry is reused before
+// it was read. Answers come back out of order, so that alone does not mean
+// the request CHANNEL_RING_SLOTS back was served: an sq entry is only reused
+// once the answer to its previous request was taken.
+//
+// Client-side calls are not thread-safe; a client sharing its channel
+// between threads serialises them.
+
+#define RING_MASK (CHANNEL_RING_SLOTS - 1)
+
+// Client: requests sent whose answer has not been taken yet.
+static inline unsigned int ring_outstanding(RequestOrResponse *channel)
+{
+    return __atomic_load_n(&channel->sq_tail, __ATOMIC_RELAXED) - __atomic_load_n(&channel->cq_head, __ATOMIC_RELAXED);
+}
+
+// Client: publishes `req` on the request ring and stores its client_seq_num
+// in `seq`. Returns -1 with errno EAGAIN if the ring is full, or its next
+// entry still waits for an answer. The server
+// still has to be told, with a doorbell.
+int ring_submit(RequestOrResponse *channel, Request req, unsigned int *seq)
+{
+    unsigned int tail = channel->sq_tail;
+    ring_request_t *slot = &channel->sq[tail & RING_MASK];
+    if (slot->busy)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    slot->busy = 1;
+    req.client_seq_num = tail;
+    slot->req = req;
+    slot->submit_ns = monotonic_ns();
+    __atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&channel->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    *seq = tail;
+    return 0;
+}
+
+// Client: takes the next answer off the completion ring. Returns false if
+// none has arrived.
+bool ring_take_completion(RequestOrResponse *channel, Response *res)
+{
+    unsigned int head = channel->cq_head;
+    ring_completion_t *slot = &channel->cq[head & RING_MASK];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1)
+        return false;
+
+    *res = slot->res;
+    channel->sq[res->client_seq_num & RING_MASK].busy = 0;
+    __atomic_store_n(&channel->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline bool ring_has_completion(RequestOrResponse *channel)
+{
+    unsigned int head = __atomic_load_n(&channel->cq_head, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&channel->cq[head & RING_MASK].seq, __ATOMIC_ACQUIRE) == head + 1;
+}
+
+static inline int ring_read_signal(RequestOrResponse *channel)
+{
+    return __atomic_load_n(&channel->cq_signal, __ATOMIC_SEQ_CST);
+}
+
+// Client: waits until an answer can be taken, or the signal moved on from
+// `seen_signal` (read with ring_read_signal() before the caller last looked),
+// for at most `timeout_ns` (forever if negative). Returns 0, or -1 with errno
+// ETIMEDOUT.
+int ring_wait_completion(RequestOrResponse *channel, int seen_signal, long timeout_ns)
+{
+    for (int i = 0; i < stage_spin_count; ++i)
+    {
+        if (ring_has_completion(channel) || ring_read_signal(channel) != seen_signal)
+            return 0;
+        cpu_relax();
+    }
+
+    unsigned long start = monotonic_ns();
+    while (!ring_has_completion(channel) && ring_read_signal(channel) == seen_signal)
+    {
+        long remaining = timeout_ns < 0 ? -1 : timeout_ns - (long)(monotonic_ns() - start);
+        if (timeout_ns >= 0 && remaining <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        __atomic_add_fetch(&channel->cq_waiters, 1, __ATOMIC_SEQ_CST);
+        if (ring_read_signal(channel) == seen_signal)
+            futex_wait_timed(&channel->cq_signal, seen_signal, remaining);
+        __atomic_sub_fetch(&channel->cq_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+// Moves the signal on and wakes whoever is parked in ring_wait_completion().
+// Called by the server for every answer, and by a client thread that took
+// answers other threads of the client may be waiting for.
+void ring_signal_completion(RequestOrResponse *channel)
+{
+    __atomic_add_fetch(&channel->cq_signal, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&channel->cq_waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&channel->cq_signal, INT_MAX);
+}
+
+// Server: claims the next published request. Returns false if there is none.
+bool ring_claim_request(RequestOrResponse *channel, unsigned int *seq)
+{
+    unsigned int head = __atomic_load_n(&channel->sq_head, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&channel->sq[head & RING_MASK].seq, __ATOMIC_ACQUIRE) == head + 1)
+    {
+        if (__atomic_compare_exchange_n(&channel->sq_head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *seq = head;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Server: publishes the answer to a claimed request and wakes the client if
+// it is parked.
+void ring_post_completion(RequestOrResponse *channel, Response res)
+{
+    unsigned int tail = __atomic_fetch_add(&channel->cq_tail, 1, __ATOMIC_ACQ_REL);
+    ring_completion_t *slot = &channel->cq[tail & RING_MASK];
+    res.server_seq_num = tail;
+    slot->res = res;
+    __atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+    ring_signal_completion(channel);
+}
+
+#endif
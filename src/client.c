@@ -2,59 +2,32 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "shared_memory.h"
 #include "common_structs.h"
 #include "utils.h"
-#include "conn_chanel.h"
+#include "client_api.h"
 #include "logger.h"
 
-int connect_to_server(const char *client_name)
+int communicate(const ClientSession *session)
 {
-    queue_t *conn_q = get_queue();
-    if (conn_q == NULL)
-    {
-        logger("ERROR", "Could not get connection queue.");
-        return -1;
-    }
-
-    logger("INFO", "Sending register request to server with name %s", client_name);
-    RequestOrResponse *conn_reqres = post(conn_q, client_name);
-    if (conn_reqres == NULL)
-    {
-        logger("ERROR", "Could not get personal connection channel to connect to server. Registration failed.");
-        return -1;
-    }
-
-    wait_until_stage(conn_reqres, 1); // TODO: Use a timed wait here.
-
-    if (conn_reqres->res.response_code != RESPONSE_SUCCESS)
-    {
-        logger("ERROR", "Registering to server failed with response code %d", conn_reqres->res.response_code);
-        return -1;
-    }
+    int key = session->key;
 
-    int key = conn_reqres->res.result;
-    logger("DEBUG", "Succesfully connected to the server and received key %d", key);
-
-    logger("INFO", "Cleaning up the personal connection channel");
-    if (destroy_node(conn_reqres) == -1)
-        logger("WARN", "Personal connection channel could not be cleaned up succesfully.");
-
-    return key;
-}
-
-int communicate(const char *client_name, int key)
-{
-    RequestOrResponse *comm_reqres = get_req_or_res(client_name);
+    RequestOrResponse *comm_reqres = get_session_channel(session);
     if (comm_reqres == NULL)
     {
-        // TODO: Add logging
+        logger("ERROR", "Could not locate the communication channel.");
         return -1;
     }
 
-    // We don't set key here, but while making request,
-    // since we can never be sure if the server tampered with the key
+    // May be NULL, in which case vector requests are unavailable.
+    int *payload = (int *)get_session_payload(session);
+    int max_lanes = payload != NULL ? max_vector_lanes(session->payload_size) : 0;
+    int vec_len = 0;
+
+    // We don't set key and token here, but while making request,
+    // since we can never be sure if the server tampered with them
 
     logger("DEBUG", "Obtained communication channel succesfully");
 
@@ -67,8 +40,8 @@ int communicate(const char *client_name, int key)
         wait_until_stage(comm_reqres, 0);
 #ifndef DEBUGGER
         printf(
-            "Options:\nArithmetic Operations: %d\nCheck even or odd: %d\nCheck prime?: %d\nCheck negative: %d\nUnregister: %d\nEnter your choice: ",
-            ARITHMETIC, EVEN_OR_ODD, IS_PRIME, IS_NEGATIVE, UNREGISTER);
+            "Options:\nArithmetic Operations: %d\nCheck even or odd: %d\nCheck prime?: %d\nCheck negative: %d\nUnregister: %d\nCheck primes in a range: %d\nVector arithmetic: %d\nEnter your choice: ",
+            ARITHMETIC, EVEN_OR_ODD, IS_PRIME, IS_NEGATIVE, UNREGISTER, BATCH, VECTOR_ARITHMETIC);
         scanf("%d", &current_choice);
 #else
         current_choice = EVEN_OR_ODD;
@@ -86,6 +59,7 @@ int communicate(const char *client_name, int key)
 #endif
 
             comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
             comm_reqres->req.request_type = ARITHMETIC;
             comm_reqres->req.n1 = n1;
             comm_reqres->req.n2 = n2;
@@ -93,7 +67,7 @@ int communicate(const char *client_name, int key)
 
             logger("DEBUG", "Sending request of type %d to server with params: n1: %d op: %c n2: %d", current_choice, n1, op, n2);
 
-            next_stage(comm_reqres);
+            send_request(comm_reqres);
         }
 
         else if (current_choice == EVEN_OR_ODD)
@@ -106,12 +80,13 @@ int communicate(const char *client_name, int key)
 #endif
 
             comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
             comm_reqres->req.request_type = EVEN_OR_ODD;
             comm_reqres->req.n1 = n1;
 
             logger("DEBUG", "Sending request of type %d to server with params: n1: %d", current_choice, n1);
 
-            next_stage(comm_reqres);
+            send_request(comm_reqres);
         }
 
         else if (current_choice == IS_PRIME)
@@ -124,12 +99,13 @@ int communicate(const char *client_name, int key)
             n1 = 43;
 #endif
             comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
             comm_reqres->req.request_type = IS_PRIME;
             comm_reqres->req.n1 = n1;
 
             logger("DEBUG", "Sending request of type %d to server with params: n1: %d", current_choice, n1);
 
-            next_stage(comm_reqres);
+            send_request(comm_reqres);
         }
 
         else if (current_choice == IS_NEGATIVE)
@@ -142,12 +118,79 @@ int communicate(const char *client_name, int key)
             n1 = -5;
 #endif
             comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
             comm_reqres->req.request_type = IS_NEGATIVE;
             comm_reqres->req.n1 = n1;
 
             logger("DEBUG", "Sending request of type %d to server with params: n1: %d", current_choice, n1);
 
-            next_stage(comm_reqres);
+            send_request(comm_reqres);
+        }
+
+        else if (current_choice == BATCH)
+        {
+#ifndef DEBUGGER
+
+            printf("Enter range with format <from> <to> (at most %d numbers): ", MAX_BATCH_LEN);
+            scanf("%d %d", &n1, &n2);
+#else
+            n1 = 1, n2 = 100;
+#endif
+            if (n2 - n1 + 1 > MAX_BATCH_LEN)
+                n2 = n1 + MAX_BATCH_LEN - 1;
+
+            int batch_len = 0;
+            for (int n = n1; n <= n2; ++n, ++batch_len)
+            {
+                comm_reqres->batch_req[batch_len].request_type = IS_PRIME;
+                comm_reqres->batch_req[batch_len].n1 = n;
+            }
+            comm_reqres->batch_len = batch_len;
+
+            comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
+            comm_reqres->req.request_type = BATCH;
+
+            logger("DEBUG", "Sending request of type %d to server with %d entries", current_choice, batch_len);
+
+            send_request(comm_reqres);
+        }
+
+        else if (current_choice == VECTOR_ARITHMETIC)
+        {
+            if (payload == NULL)
+            {
+                printf("The server granted no payload region, so vector requests are unavailable.\n");
+                continue;
+            }
+#ifndef DEBUGGER
+            printf("Enter operation with format <op> <length> (at most %d lanes): ", max_lanes);
+            scanf(" %c %d", &op, &vec_len);
+            if (vec_len < 0 || vec_len > max_lanes)
+                vec_len = max_lanes;
+            printf("Enter the %d elements of the first vector: ", vec_len);
+            for (int i = 0; i < vec_len; ++i)
+                scanf("%d", &payload[i]);
+            printf("Enter the %d elements of the second vector: ", vec_len);
+            for (int i = 0; i < vec_len; ++i)
+                scanf("%d", &payload[vec_len + i]);
+#else
+            op = '/', vec_len = max_lanes < 16 ? max_lanes : 16;
+            for (int i = 0; i < vec_len; ++i)
+            {
+                payload[i] = 100 * i;
+                payload[vec_len + i] = i % 4;
+            }
+#endif
+            comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
+            comm_reqres->req.request_type = VECTOR_ARITHMETIC;
+            comm_reqres->req.op = op;
+            set_vector_payload(&comm_reqres->req, vec_len);
+
+            logger("DEBUG", "Sending request of type %d to server with %d lanes", current_choice, vec_len);
+
+            send_request(comm_reqres);
         }
 
         else if (current_choice == UNREGISTER)
@@ -155,11 +198,12 @@ int communicate(const char *client_name, int key)
             printf("Unregistering...\n");
             logger("INFO", "Initiating unregister");
             comm_reqres->req.key = key;
+            comm_reqres->req.token = session->token;
             comm_reqres->req.request_type = UNREGISTER;
 
             logger("DEBUG", "Sending request of type %d to server", current_choice);
 
-            next_stage(comm_reqres);
+            send_request(comm_reqres);
             break;
         }
 
@@ -170,11 +214,36 @@ int communicate(const char *client_name, int key)
             break;
         }
 
-        wait_until_stage(comm_reqres, 2); // TODO: Use a timed wait here as well.
+        wait_for_response(comm_reqres);
 
         logger("INFO", "Received response from server with status code: %d", comm_reqres->res.response_code);
 
-        if (comm_reqres->res.response_code == RESPONSE_SUCCESS)
+        if (comm_reqres->res.response_code == RESPONSE_SUCCESS && comm_reqres->req.request_type == BATCH)
+        {
+            for (int i = 0; i < comm_reqres->res.result; ++i)
+            {
+                if (comm_reqres->batch_res[i].response_code == RESPONSE_SUCCESS)
+                    printf("Result for %d: %d\n", comm_reqres->batch_req[i].n1, comm_reqres->batch_res[i].result);
+                else
+                    printf("Request for %d failed with response code %d\n", comm_reqres->batch_req[i].n1, comm_reqres->batch_res[i].response_code);
+            }
+        }
+
+        else if (comm_reqres->res.response_code == RESPONSE_SUCCESS && comm_reqres->req.request_type == VECTOR_ARITHMETIC)
+        {
+            const int *results = (const int *)((char *)payload + comm_reqres->res.payload_offset);
+            const uint8_t *errors = (const uint8_t *)(results + vec_len);
+            for (int i = 0; i < vec_len; ++i)
+            {
+                if (errors[i / 8] & (1 << (i % 8)))
+                    printf("Lane %d: %d %c %d failed\n", i, payload[i], comm_reqres->req.op, payload[vec_len + i]);
+                else
+                    printf("Lane %d: %d\n", i, results[i]);
+            }
+            printf("%d of %d lanes failed\n", comm_reqres->res.result, vec_len);
+        }
+
+        else if (comm_reqres->res.response_code == RESPONSE_SUCCESS)
             printf("Result: %d\n", comm_reqres->res.result);
 
         else if (comm_reqres->res.response_code == RESPONSE_UNSUPPORTED)
@@ -185,7 +254,7 @@ int communicate(const char *client_name, int key)
 
         else
             logger("ERROR", "Unsupported response. Something is wrong with the server.");
-        next_stage(comm_reqres);
+        release_response(comm_reqres);
     }
 
     return 0;
@@ -210,21 +279,22 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
 
     // If the connection file does not exist, then the server is probably not running.
-    int connect_channel_exists = does_file_exist(CONNECT_CHANNEL_FNAME);
+    int connect_channel_exists = memory_block_exists(CONNECT_CHANNEL_FNAME);
     if (connect_channel_exists != 1)
     {
         logger("ERROR", "Server likely not running. Please start the server and try again or debug with other messages.");
         return EXIT_FAILURE;
     }
 
-    int key = connect_to_server(client_name);
+    ClientSession session = {.payload_size = DEFAULT_PAYLOAD_REGION_SIZE};
+    int key = connect_to_server(client_name, &session);
     if (key < 0)
     {
         logger("ERROR", "Could not connect to server. Ending the process.");
         return EXIT_FAILURE;
     }
 
-    communicate(client_name, key);
+    communicate(&session);
 
     close_logger();
 
@@ -0,0 +1,213 @@
+#ifndef CLIENT_API_H
+#define CLIENT_API_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared_memory.h"
+#include "common_structs.h"
+#include "utils.h"
+#include "conn_chanel.h"
+#include "channel_arena.h"
+#include "channel_ring.h"
+#include "payload_arena.h"
+#include "logger.h"
+
+// Client side of the protocol: registration, request submission and
+// unregistration. Shared by the interactive client and the load generator.
+
+static queue_t *conn_q;
+static channel_arena_t *client_arena;
+static payload_arena_t *client_payload_arena;
+
+// What the server hands out at registration.
+typedef struct ClientSession
+{
+    int key;
+    unsigned long token;
+    size_t channel_offset;
+    size_t payload_offset;
+    size_t payload_size; // bytes of payload region wanted, then granted
+} ClientSession;
+
+// Attaches the server's connection queue and channel arena. Must be called
+// once per process before any thread connects.
+int attach_server()
+{
+    if (conn_q == NULL)
+        conn_q = get_queue();
+    if (conn_q == NULL)
+    {
+        logger("ERROR", "Could not get connection queue.");
+        return -1;
+    }
+
+    if (client_arena == NULL)
+        client_arena = get_channel_arena();
+    if (client_arena == NULL)
+    {
+        logger("ERROR", "Could not attach the channel arena.");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Publishes the request written on the channel and wakes a server worker.
+void send_request(RequestOrResponse *comm_reqres)
+{
+    comm_reqres->submit_ns = monotonic_ns();
+    next_stage(comm_reqres);
+    ring_doorbell(&conn_q->ready, comm_reqres->slot);
+}
+
+// Waits for the response to the request in flight. The response stays on the
+// channel until release_response() is called.
+void wait_for_response(RequestOrResponse *comm_reqres)
+{
+    wait_until_stage(comm_reqres, 2); // TODO: Use a timed wait here as well.
+    // Reported with the next request, for the server's pickup latency.
+    comm_reqres->pickup_ns = monotonic_ns() - comm_reqres->completed_ns;
+}
+
+// Hands the channel back for the next request.
+void release_response(RequestOrResponse *comm_reqres)
+{
+    next_stage(comm_reqres);
+}
+
+// Publishes a pipelined request on the channel's request ring and stores its
+// client_seq_num in `seq`. Returns -1 with errno EAGAIN if the ring has no
+// room, see ring_submit(). The server only looks at the ring once
+// notify_server() is called.
+int queue_request(RequestOrResponse *comm_reqres, const ClientSession *session, Request req, unsigned int *seq)
+{
+    req.key = session->key;
+    req.token = session->token;
+    return ring_submit(comm_reqres, req, seq);
+}
+
+// Wakes a server worker for the requests queued since the last call.
+void notify_server(RequestOrResponse *comm_reqres)
+{
+    ring_doorbell(&conn_q->ready, comm_reqres->slot);
+}
+
+// session->payload_size is the payload region to ask for, 0 for none. On
+// return it holds what the server granted, which may be less.
+int connect_to_server(const char *client_name, ClientSession *session)
+{
+    if (attach_server() < 0)
+        return -1;
+
+    logger("INFO", "Sending register request to server with name %s", client_name);
+    RequestOrResponse *conn_reqres = post(conn_q, client_name, session->payload_size);
+    if (conn_reqres == NULL)
+    {
+        logger("ERROR", "Could not get personal connection channel to connect to server. Registration failed.");
+        return -1;
+    }
+
+    wait_until_stage(conn_reqres, 1); // TODO: Use a timed wait here.
+
+    if (conn_reqres->res.response_code != RESPONSE_SUCCESS)
+    {
+        logger("ERROR", "Registering to server failed with response code %d", conn_reqres->res.response_code);
+        release_node(conn_q, conn_reqres);
+        return -1;
+    }
+
+    int key = conn_reqres->res.result;
+    session->key = key;
+    session->token = conn_reqres->session_token;
+    session->channel_offset = conn_reqres->channel_offset;
+    session->payload_offset = conn_reqres->payload_offset;
+    session->payload_size = conn_reqres->payload_size;
+    logger("DEBUG", "Succesfully connected to the server and received key %d", key);
+
+    logger("INFO", "Releasing the registration slot");
+    if (release_node(conn_q, conn_reqres) == -1)
+        logger("WARN", "Registration slot could not be released succesfully.");
+
+    return key;
+}
+
+// Locates the session's channel in the arena.
+RequestOrResponse *get_session_channel(const ClientSession *session)
+{
+    if (attach_server() < 0)
+        return NULL;
+
+    return get_req_or_res(client_arena, session->channel_offset);
+}
+
+// Locates the session's payload region. Returns NULL if it was granted none.
+void *get_session_payload(const ClientSession *session)
+{
+    if (session->payload_size == 0)
+        return NULL;
+
+    if (client_payload_arena == NULL)
+        client_payload_arena = get_payload_arena();
+    if (client_payload_arena == NULL)
+        return NULL;
+
+    return get_payload(client_payload_arena, session->payload_offset, session->payload_size);
+}
+
+// VECTOR_ARITHMETIC layout used by our clients: the two operand arrays at the
+// start of the payload region, the reply right behind them.
+static inline size_t vector_payload_size(int lanes)
+{
+    return 3 * lanes * sizeof(int) + (lanes + 7) / 8;
+}
+
+// Largest vector that fits in a payload region of `payload_size` bytes.
+static inline int max_vector_lanes(size_t payload_size)
+{
+    // 3 ints and a bit per lane.
+    return (int)(payload_size * 8 / (3 * sizeof(int) * 8 + 1));
+}
+
+// Points the request at `lanes` lanes laid out as above.
+void set_vector_payload(Request *req, int lanes)
+{
+    req->payload_offset = 0;
+    req->payload_len = 2 * lanes * sizeof(int);
+    req->reply_offset = req->payload_len;
+    req->reply_capacity = lanes * sizeof(int) + (lanes + 7) / 8;
+}
+
+// Sends one request and waits for its response.
+Response call_server(RequestOrResponse *comm_reqres, const ClientSession *session, Request req)
+{
+    wait_until_stage(comm_reqres, 0);
+
+    // Key and token are set on every request, since we can never be sure if
+    // the server tampered with them.
+    req.key = session->key;
+    req.token = session->token;
+    comm_reqres->req = req;
+    send_request(comm_reqres);
+
+    wait_for_response(comm_reqres);
+    Response res = comm_reqres->res;
+    release_response(comm_reqres);
+
+    return res;
+}
+
+// Unregisters the session. The server tears the channel down without
+// answering, so the channel must not be used afterwards.
+void disconnect_from_server(RequestOrResponse *comm_reqres, const ClientSession *session)
+{
+    wait_until_stage(comm_reqres, 0);
+
+    comm_reqres->req.key = session->key;
+    comm_reqres->req.token = session->token;
+    comm_reqres->req.request_type = UNREGISTER;
+    send_request(comm_reqres);
+}
+
+#endif
@@ -7,247 +7,364 @@
 #include <pthread.h>
 
 #include "common_structs.h"
+#include "doorbell.h"
 #include "logger.h"
+#include "utils.h"
+
+// Index of registered clients. Formerly a binary search tree behind one
+// mutex; now two sharded open-addressing hash tables:
+//   by_key:  key       -> hash of the client name (per-request validation)
+//   by_name: name hash -> key                     (duplicate name checks)
+// Each shard is guarded by a seqlock, so readers never take a lock or write
+// to shared memory, and writers to different shards do not contend.
+
+#define CLIENT_INDEX_SHARDS (64)
+// Room for every client even if keys cluster on a few shards.
+#ifndef CLIENT_INDEX_CAPACITY
+#define CLIENT_INDEX_CAPACITY (4 * MAX_CLIENTS)
+#endif
+#define CLIENT_INDEX_SHARD_CAPACITY (CLIENT_INDEX_CAPACITY / CLIENT_INDEX_SHARDS)
+
+typedef enum IndexEntryState
+{
+    INDEX_ENTRY_EMPTY = 0,
+    INDEX_ENTRY_USED,
+    INDEX_ENTRY_TOMBSTONE
+} IndexEntryState;
 
-typedef struct tree_node_t
+typedef struct index_entry_t
 {
-    int key;
-    char *client_name;
-    struct tree_node_t *left;
-    struct tree_node_t *right;
-} tree_node_t;
+    unsigned long key;
+    unsigned long value;
+    int state;
+} index_entry_t;
 
-tree_node_t *create_node(int key, char *client_name)
+typedef struct index_shard_t
 {
-    logger("DEBUG", "Creating new node for client %s with key %d", client_name, key);
-    tree_node_t *new_node = (tree_node_t *)malloc(sizeof(tree_node_t));
-    new_node->key = key;
-    new_node->client_name = strdup(client_name);
-    new_node->left = new_node->right = NULL;
-    logger("INFO", "Successfully created new node for client %s with key %d", client_name, key);
+    unsigned int seq __attribute__((aligned(64))); // odd while a writer is active
+    pthread_mutex_t write_lock;
+    size_t size;
+    size_t tombstones;
+    index_entry_t entries[CLIENT_INDEX_SHARD_CAPACITY];
+} index_shard_t;
 
-    return new_node;
-}
+typedef struct hash_index_t
+{
+    index_shard_t shards[CLIENT_INDEX_SHARDS];
+} hash_index_t;
 
 typedef struct client_tree_t
 {
-    tree_node_t *root;
+    hash_index_t by_key;
+    hash_index_t by_name;
     size_t size;
 } client_tree_t;
 
 static client_tree_t *tree;
-static pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-const size_t get_num_connected_clients()
+static inline unsigned long mix_hash(unsigned long x)
 {
-    return tree->size;
+    // splitmix64 finalizer, spreads sequential or clustered keys.
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9UL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebUL;
+    x ^= x >> 31;
+    return x;
 }
 
-client_tree_t *init_client_tree()
+unsigned long hash_client_name(const char *client_name)
 {
-    logger("DEBUG", "Initialising client tree");
-    if (tree)
+    unsigned long hash = 14695981039346656037UL;
+    for (const char *c = client_name; *c; ++c)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211UL;
+    return hash;
+}
+
+static void init_hash_index(hash_index_t *index)
+{
+    for (int i = 0; i < CLIENT_INDEX_SHARDS; ++i)
     {
-        logger("WARN", "client tree is being reinitialized. Possibly leaking the pointer.");
+        index_shard_t *shard = &index->shards[i];
+        shard->seq = 0;
+        shard->size = 0;
+        shard->tombstones = 0;
+        pthread_mutex_init(&shard->write_lock, NULL);
+        memset(shard->entries, 0, sizeof(shard->entries));
     }
-
-    tree = (client_tree_t *)malloc(sizeof(client_tree_t));
-    tree->root = NULL;
-    tree->size = 0;
-
-    logger("INFO", "Tree initialized succesfully");
-
-    return tree;
 }
 
-int insert_to_client_tree(int key, char *client_name)
+static inline index_shard_t *shard_for(hash_index_t *index, unsigned long hash)
 {
-    pthread_mutex_lock(&tree_mutex);
+    return &index->shards[hash % CLIENT_INDEX_SHARDS];
+}
 
-    if (tree->root == NULL)
-    {
-        tree->root = create_node(key, client_name);
-        tree->size++;
-        pthread_mutex_unlock(&tree_mutex);
-        return 0;
-    }
+// Lock-free lookup. Returns true and stores the value if `key` is present.
+static bool index_lookup(hash_index_t *index, unsigned long key, unsigned long *value)
+{
+    unsigned long hash = mix_hash(key);
+    index_shard_t *shard = shard_for(index, hash);
+    size_t start = (hash / CLIENT_INDEX_SHARDS) % CLIENT_INDEX_SHARD_CAPACITY;
 
-    tree_node_t *current = tree->root;
     while (true)
     {
-        if (key < current->key)
+        unsigned int seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
         {
-            if (current->left == NULL)
-            {
-                current->left = create_node(key, client_name);
-                break;
-            }
-            current = current->left;
+            cpu_relax();
+            continue;
         }
-        else if (key > current->key)
+
+        bool found = false;
+        unsigned long found_value = 0;
+        for (size_t i = 0; i < CLIENT_INDEX_SHARD_CAPACITY; ++i)
         {
-            if (current->right == NULL)
+            index_entry_t *entry = &shard->entries[(start + i) % CLIENT_INDEX_SHARD_CAPACITY];
+            int state = __atomic_load_n(&entry->state, __ATOMIC_RELAXED);
+            if (state == INDEX_ENTRY_EMPTY)
+                break;
+            if (state == INDEX_ENTRY_USED && __atomic_load_n(&entry->key, __ATOMIC_RELAXED) == key)
             {
-                current->right = create_node(key, client_name);
+                found_value = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+                found = true;
                 break;
             }
-            current = current->right;
         }
-        else
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq)
         {
-            logger("ERROR", "Duplicate key found. Invalid state.");
-            pthread_mutex_unlock(&tree_mutex);
-            return -1;
+            if (found)
+                *value = found_value;
+            return found;
         }
     }
+}
 
-    tree->size++;
-    pthread_mutex_unlock(&tree_mutex);
-    return 0;
+static inline void begin_shard_write(index_shard_t *shard)
+{
+    pthread_mutex_lock(&shard->write_lock);
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-int validate_key_client(int key, const char *client_name)
+static inline void end_shard_write(index_shard_t *shard)
 {
-    pthread_mutex_lock(&tree_mutex);
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shard->write_lock);
+}
 
-    tree_node_t *current = tree->root;
-    while (current != NULL)
-    {
-        if (key < current->key)
-            current = current->left;
-        else if (key > current->key)
-            current = current->right;
-        else
-            break;
-    }
+static void store_entry(index_entry_t *entry, unsigned long key, unsigned long value, int state)
+{
+    __atomic_store_n(&entry->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->state, state, __ATOMIC_RELAXED);
+}
 
-    if (current == NULL)
+// Rebuilds a shard without tombstones. Caller holds the write section.
+static void compact_shard(index_shard_t *shard)
+{
+    static __thread index_entry_t live[CLIENT_INDEX_SHARD_CAPACITY];
+    size_t num_live = 0;
+    for (size_t i = 0; i < CLIENT_INDEX_SHARD_CAPACITY; ++i)
     {
-        logger("ERROR", "Key %d not found in the client tree.", key);
-        pthread_mutex_unlock(&tree_mutex);
-        return -1;
+        if (shard->entries[i].state == INDEX_ENTRY_USED)
+            live[num_live++] = shard->entries[i];
+        store_entry(&shard->entries[i], 0, 0, INDEX_ENTRY_EMPTY);
     }
 
-    if (strcmp(client_name, current->client_name))
+    for (size_t n = 0; n < num_live; ++n)
     {
-        logger("ERROR", "key-value mismatch: Client name in tree (%s) did not match passed client name (%s)", current->client_name, client_name);
-        return -1;
+        unsigned long hash = mix_hash(live[n].key);
+        size_t start = (hash / CLIENT_INDEX_SHARDS) % CLIENT_INDEX_SHARD_CAPACITY;
+        for (size_t i = 0; i < CLIENT_INDEX_SHARD_CAPACITY; ++i)
+        {
+            index_entry_t *entry = &shard->entries[(start + i) % CLIENT_INDEX_SHARD_CAPACITY];
+            if (entry->state == INDEX_ENTRY_EMPTY)
+            {
+                store_entry(entry, live[n].key, live[n].value, INDEX_ENTRY_USED);
+                break;
+            }
+        }
     }
 
-    pthread_mutex_unlock(&tree_mutex);
-    return 0;
+    shard->tombstones = 0;
 }
 
-int remove_from_client_tree(int key)
+// Returns 1 if the key is already present and -1 if the shard is full.
+static int index_insert(hash_index_t *index, unsigned long key, unsigned long value)
 {
-    pthread_mutex_lock(&tree_mutex);
+    unsigned long hash = mix_hash(key);
+    index_shard_t *shard = shard_for(index, hash);
+    size_t start = (hash / CLIENT_INDEX_SHARDS) % CLIENT_INDEX_SHARD_CAPACITY;
 
-    if (tree->root == NULL)
-    {
-        logger("ERROR", "Tree is empty. Nothing to delete here.");
-        pthread_mutex_unlock(&tree_mutex);
-        return -1;
-    }
+    begin_shard_write(shard);
 
-    tree_node_t *parent = NULL;
-    tree_node_t *current = tree->root;
+    if (shard->tombstones > CLIENT_INDEX_SHARD_CAPACITY / 4)
+        compact_shard(shard);
 
-    while (current != NULL && current->key != key)
+    index_entry_t *free_entry = NULL;
+    for (size_t i = 0; i < CLIENT_INDEX_SHARD_CAPACITY; ++i)
     {
-        parent = current;
-        if (key < current->key)
-            current = current->left;
-
-        else
-            current = current->right;
+        index_entry_t *entry = &shard->entries[(start + i) % CLIENT_INDEX_SHARD_CAPACITY];
+        if (entry->state == INDEX_ENTRY_USED && entry->key == key)
+        {
+            end_shard_write(shard);
+            return 1;
+        }
+        if (entry->state != INDEX_ENTRY_USED && free_entry == NULL)
+            free_entry = entry;
+        if (entry->state == INDEX_ENTRY_EMPTY)
+            break;
     }
 
-    if (current == NULL)
+    if (free_entry == NULL)
     {
-        logger("ERROR", "Node with key %d not found", key);
-        pthread_mutex_unlock(&tree_mutex);
+        end_shard_write(shard);
+        logger("ERROR", "Client index shard is full.");
         return -1;
     }
 
-    if (current->left == NULL && current->right == NULL)
+    if (free_entry->state == INDEX_ENTRY_TOMBSTONE)
+        shard->tombstones--;
+    store_entry(free_entry, key, value, INDEX_ENTRY_USED);
+    shard->size++;
+
+    end_shard_write(shard);
+    return 0;
+}
+
+// Returns -1 if the key is not present.
+static int index_remove(hash_index_t *index, unsigned long key, unsigned long *value)
+{
+    unsigned long hash = mix_hash(key);
+    index_shard_t *shard = shard_for(index, hash);
+    size_t start = (hash / CLIENT_INDEX_SHARDS) % CLIENT_INDEX_SHARD_CAPACITY;
+
+    begin_shard_write(shard);
+
+    for (size_t i = 0; i < CLIENT_INDEX_SHARD_CAPACITY; ++i)
     {
-        if (parent == NULL)
+        index_entry_t *entry = &shard->entries[(start + i) % CLIENT_INDEX_SHARD_CAPACITY];
+        if (entry->state == INDEX_ENTRY_EMPTY)
+            break;
+        if (entry->state == INDEX_ENTRY_USED && entry->key == key)
         {
-            free(current->client_name);
-            free(current);
-            tree->size--;
-            pthread_mutex_unlock(&tree_mutex);
+            if (value != NULL)
+                *value = entry->value;
+            store_entry(entry, 0, 0, INDEX_ENTRY_TOMBSTONE);
+            shard->size--;
+            shard->tombstones++;
+            end_shard_write(shard);
             return 0;
         }
+    }
 
-        if (current == parent->left)
-            parent->left = NULL;
-        else
-            parent->right = NULL;
+    end_shard_write(shard);
+    return -1;
+}
 
-        free(current->client_name);
-        free(current);
-    }
+size_t get_num_connected_clients()
+{
+    return __atomic_load_n(&tree->size, __ATOMIC_RELAXED);
+}
 
-    else if (current->left == NULL)
+client_tree_t *init_client_tree()
+{
+    logger("DEBUG", "Initialising client index");
+    if (tree)
     {
-        if (parent == NULL)
-            tree->root = current->right;
-        else if (current == parent->left)
-            parent->left = current->right;
-        else
-            parent->right = current->right;
+        logger("WARN", "client index is being reinitialized. Possibly leaking the pointer.");
     }
 
-    else if (current->right == NULL)
+    tree = (client_tree_t *)aligned_alloc(64, sizeof(client_tree_t));
+    init_hash_index(&tree->by_key);
+    init_hash_index(&tree->by_name);
+    tree->size = 0;
+
+    logger("INFO", "Client index initialized succesfully");
+
+    return tree;
+}
+
+// Returns -1 if the key is already taken, in which case the caller may retry
+// with another key, and -2 if the client can not be indexed at all.
+int insert_to_client_tree(int key, char *client_name)
+{
+    unsigned long name_hash = hash_client_name(client_name);
+
+    int res = index_insert(&tree->by_name, name_hash, (unsigned long)(unsigned int)key);
+    if (res != 0)
     {
-        if (parent == NULL)
-            tree->root = current->left;
-        else if (current == parent->left)
-            parent->left = current->left;
-        else
-            parent->right = current->left;
-
-        free(current->client_name);
-        free(current);
+        if (res > 0)
+            logger("ERROR", "Client %s is already registered.", client_name);
+        return -2;
     }
 
-    else
+    res = index_insert(&tree->by_key, (unsigned long)(unsigned int)key, name_hash);
+    if (res != 0)
     {
-        tree_node_t *successor_parent = current;
-        tree_node_t *successor = current->right;
+        if (res > 0)
+            logger("WARN", "Duplicate key found.");
+        index_remove(&tree->by_name, name_hash, NULL);
+        return res > 0 ? -1 : -2;
+    }
 
-        while (successor->left != NULL)
-        {
-            successor_parent = successor;
-            successor = successor->left;
-        }
+    __atomic_add_fetch(&tree->size, 1, __ATOMIC_RELAXED);
+    logger("DEBUG", "Indexed client %s with key %d", client_name, key);
+    return 0;
+}
 
-        if (successor_parent != current)
-        {
-            successor_parent->left = successor->right;
-            successor->right = current->right;
-        }
+int validate_key_client(int key, const char *client_name)
+{
+    unsigned long name_hash;
+    if (!index_lookup(&tree->by_key, (unsigned long)(unsigned int)key, &name_hash))
+    {
+        logger("ERROR", "Key %d not found in the client index.", key);
+        return -1;
+    }
 
-        if (parent == NULL)
-            tree->root = successor;
+    if (name_hash != hash_client_name(client_name))
+    {
+        logger("ERROR", "key-value mismatch: Client registered with key %d is not %s", key, client_name);
+        return -1;
+    }
 
-        else if (current == parent->left)
-            parent->left = successor;
+    return 0;
+}
 
-        else
-            parent->right = successor;
+bool is_client_registered(const char *client_name)
+{
+    unsigned long key;
+    return index_lookup(&tree->by_name, hash_client_name(client_name), &key);
+}
 
-        successor->left = current->left;
-        free(current->client_name);
-        free(current);
+int remove_from_client_tree(int key)
+{
+    unsigned long name_hash;
+    if (index_remove(&tree->by_key, (unsigned long)(unsigned int)key, &name_hash) < 0)
+    {
+        logger("ERROR", "Node with key %d not found", key);
+        return -1;
     }
 
-    tree->size--;
-    pthread_mutex_unlock(&tree_mutex);
+    index_remove(&tree->by_name, name_hash, NULL);
+    __atomic_sub_fetch(&tree->size, 1, __ATOMIC_RELAXED);
     return 0;
 }
 
-// TODO: Cleanup tree function.
+void destroy_client_tree()
+{
+    if (tree == NULL)
+        return;
+
+    for (int i = 0; i < CLIENT_INDEX_SHARDS; ++i)
+    {
+        pthread_mutex_destroy(&tree->by_key.shards[i].write_lock);
+        pthread_mutex_destroy(&tree->by_name.shards[i].write_lock);
+    }
+    free(tree);
+    tree = NULL;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,7 @@
 #ifndef COMMON_STRUCTS_H
 #define COMMON_STRUCTS_H
 
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -13,15 +14,33 @@
 #define MAX_CLIENT_NAME_LEN (1024)
 #define MAX_BUFFER_SIZE (1024)
 
+// Maximum number of requests carried by a single BATCH request.
+#define MAX_BATCH_LEN (256)
+
+// Number of times wait_until_stage re-reads the stage word before parking on
+// the futex. Can be changed at runtime with set_stage_spin_count().
+#ifndef STAGE_SPIN_COUNT
+#define STAGE_SPIN_COUNT (2000)
+#endif
+
 typedef enum RequestType
 {
     ARITHMETIC,
     EVEN_OR_ODD,
     IS_PRIME,
     IS_NEGATIVE,
-    UNREGISTER
+    UNREGISTER,
+    BATCH,
+    VECTOR_ARITHMETIC
 } RequestType;
 
+#define NUM_BUILTIN_REQUEST_TYPES (VECTOR_ARITHMETIC + 1)
+
+// Request types from here on are left to handler modules loaded by the
+// server, and are sent as their raw number.
+#define FIRST_MODULE_REQUEST_TYPE (16)
+#define MAX_REQUEST_TYPES (32)
+
 typedef enum ResponseCode
 {
     RESPONSE_SUCCESS = 200,
@@ -36,78 +55,162 @@ typedef struct Request
     int n1, n2;
     char op;
     int key;
-    // int client_seq_num, server_seq_num;
+    unsigned long token; // session token issued at registration
+    // Input in the channel's payload region, and where the handler may
+    // write its output. Offsets are relative to the region.
+    unsigned int payload_offset, payload_len;
+    unsigned int reply_offset, reply_capacity;
+    unsigned int client_seq_num; // pipelined requests: position on the request ring
 } Request;
 
 typedef struct Response
 {
     ResponseCode response_code;
-    // int client_seq_num, server_seq_num;
+    // Pipelined requests: client_seq_num of the request answered, and the
+    // position of the answer on the completion ring.
+    unsigned int client_seq_num, server_seq_num;
     int result;
+    // Output written to the channel's payload region, if any.
+    unsigned int payload_offset, payload_len;
 } Response;
 
+// Requests a client may have outstanding on its channel's rings. Must be a
+// power of two.
+#define CHANNEL_RING_SLOTS (64)
+
+typedef struct ring_request_t
+{
+    unsigned int seq; // client_seq_num + 1 once the request is published
+    int busy;         // client-side: the answer has not been taken yet
+    unsigned long submit_ns;
+    Request req;
+} ring_request_t;
+
+typedef struct ring_completion_t
+{
+    unsigned int seq; // server_seq_num + 1 once the response is published
+    Response res;
+} ring_completion_t;
+
 typedef struct RequestOrResponse
 {
     /* Synchronization structures */
     pthread_mutex_t lock;
-    int stage;
+    int stage;   // futex word, only accessed atomically
+    int waiters; // number of peers parked on `stage`
+    int slot;    // doorbell slot of a channel, or index of a registration slot
 
     /* Utility variables */
     char client_name[MAX_CLIENT_NAME_LEN];
-    char filename[MAX_CLIENT_NAME_LEN];
+    size_t channel_offset;       // registration answer: the client's slot in the channel arena
+    unsigned long session_token; // registration answer: token to send with every request
+    size_t payload_offset;       // registration answer: the client's region in the payload arena
+    size_t payload_size;         // registration: bytes wanted, then bytes granted (0 for no region)
+    int client_pid;              // registration: the client process, 0 once it released the slot
+
+    /* Timing, in monotonic_ns(). Feeds the latency histograms in stats.h. */
+    unsigned long submit_ns;    // client published the request
+    unsigned long completed_ns; // server published the response
+    unsigned long pickup_ns;    // how long the client took to see the previous response, 0 if not reported
 
     /* Request Object */
     Request req;
 
     /* Response Object */
     Response res;
+
+    /* Pipelined requests, see channel_ring.h. Used alongside the single
+       request above, which still carries registration and UNREGISTER. */
+    unsigned int sq_tail __attribute__((aligned(64))); // client: next request to publish
+    unsigned int cq_head;                               // client: next completion to take
+    int cq_waiters;                                     // client threads parked on cq_signal
+    unsigned int sq_head __attribute__((aligned(64)));  // server: next request to take
+    unsigned int cq_tail;                               // server: next completion to fill
+    int cq_signal;                                      // futex word, bumped on every completion
+    ring_request_t sq[CHANNEL_RING_SLOTS];
+    ring_completion_t cq[CHANNEL_RING_SLOTS];
+
+    /* Batch Objects, only read when req.request_type == BATCH. */
+    int batch_len;
+    Request batch_req[MAX_BATCH_LEN];
+    Response batch_res[MAX_BATCH_LEN];
 } RequestOrResponse;
 
-RequestOrResponse *get_comm_channel(int comm_channel_block_id)
+// Mutexes in shared memory are robust: if a process dies holding one, the next
+// locker gets EOWNERDEAD and takes it over instead of blocking forever.
+void init_shared_mutex(pthread_mutex_t *mutex)
 {
-    RequestOrResponse *comm_channel = (RequestOrResponse *)attach_with_shared_block_id(comm_channel_block_id);
-    if (comm_channel == NULL)
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// These mutexes only guard the stage word, which is consistent after every
+// store, so a dead owner leaves nothing to repair.
+static inline void lock_shared_mutex(pthread_mutex_t *mutex)
+{
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
     {
-        logger("ERROR", "Could not create shared RequestOrResponse object.");
-        return NULL;
+        logger("WARN", "Took over a channel mutex from a process that died holding it");
+        pthread_mutex_consistent(mutex);
     }
-
-    return comm_channel;
 }
 
-int create_comm_channel(const char *client_name)
+// Resets a channel slot for a newly registered client.
+void init_comm_channel(RequestOrResponse *comm_channel, const char *client_name, int slot)
 {
-    create_file_if_does_not_exist(client_name);
-    int comm_channel_block_id = get_shared_block(client_name, sizeof(RequestOrResponse));
-    if (comm_channel_block_id == IPC_RESULT_ERROR)
+    comm_channel->stage = 0;
+    comm_channel->waiters = 0;
+    comm_channel->slot = slot;
+    comm_channel->submit_ns = 0;
+    comm_channel->completed_ns = 0;
+    comm_channel->pickup_ns = 0;
+    strncpy(comm_channel->client_name, client_name, MAX_CLIENT_NAME_LEN - 1);
+    comm_channel->client_name[MAX_CLIENT_NAME_LEN - 1] = '\0';
+    init_shared_mutex(&comm_channel->lock);
+
+    // The previous owner's sequence numbers must not pass for published.
+    comm_channel->sq_tail = comm_channel->sq_head = 0;
+    comm_channel->cq_tail = comm_channel->cq_head = 0;
+    comm_channel->cq_signal = 0;
+    comm_channel->cq_waiters = 0;
+    for (int i = 0; i < CHANNEL_RING_SLOTS; ++i)
     {
-        logger("ERROR", "get_shared_block failed. Could not get comm_channel_block_id.");
-        return IPC_RESULT_ERROR;
+        comm_channel->sq[i].seq = 0;
+        comm_channel->sq[i].busy = 0;
+        comm_channel->cq[i].seq = 0;
     }
+}
 
-    RequestOrResponse *comm_channel = get_comm_channel(comm_channel_block_id);
-    if (comm_channel == NULL)
-        return IPC_RESULT_ERROR;
-
-    comm_channel->stage = 0;
-    strncpy(comm_channel->filename, client_name, MAX_CLIENT_NAME_LEN);
+static int stage_spin_count = STAGE_SPIN_COUNT;
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&comm_channel->lock, &attr);
-    pthread_mutexattr_destroy(&attr);
+void set_stage_spin_count(int spin_count)
+{
+    stage_spin_count = spin_count < 0 ? 0 : spin_count;
+}
 
-    return comm_channel_block_id;
+static inline int load_stage(RequestOrResponse *req_or_res)
+{
+    return __atomic_load_n(&req_or_res->stage, __ATOMIC_SEQ_CST);
 }
 
+// Stage a worker moves a pending request (stage 1) to when it takes it, so
+// that a second doorbell rung for the channel, e.g. for its request ring,
+// cannot take the same request again. Clients only ever wait for 0 and 2.
+#define STAGE_CLAIMED (3)
+
+#ifdef STAGE_HANDOFF_POLL
+
 // TODO: Make this a timed wait. Such that, if wait time exceeds a certain duration, kill the wait with a failed state.
 void wait_until_stage(RequestOrResponse *req_or_res, int stage)
 {
     bool reached_stage = false;
     while (!reached_stage)
     {
-        pthread_mutex_lock(&req_or_res->lock);
+        lock_shared_mutex(&req_or_res->lock);
         logger("DEBUG", "On stage: %d waiting for stage: %d",  req_or_res->stage, stage);
         reached_stage = (req_or_res->stage == stage);
         pthread_mutex_unlock(&req_or_res->lock);
@@ -116,9 +219,28 @@ void wait_until_stage(RequestOrResponse *req_or_res, int stage)
     }
 }
 
+// Waits until the stage moves off `stage`, for at most `timeout_ns` (forever
+// if negative). Returns the new stage, or -1 with errno ETIMEDOUT.
+int wait_while_stage(RequestOrResponse *req_or_res, int stage, long timeout_ns)
+{
+    unsigned long start = monotonic_ns();
+    int current;
+    while ((current = load_stage(req_or_res)) == stage)
+    {
+        long remaining = timeout_ns < 0 ? 500 * 1000000L : timeout_ns - (long)(monotonic_ns() - start);
+        if (remaining <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        msleep(remaining < 500 * 1000000L ? (remaining + 999999) / 1000000 : 500);
+    }
+    return current;
+}
+
 void next_stage(RequestOrResponse *req_or_res)
 {
-    pthread_mutex_lock(&req_or_res->lock);
+    lock_shared_mutex(&req_or_res->lock);
     req_or_res->stage = (req_or_res->stage + 1) % 3;
     logger("DEBUG", "Set stage to: %d",  req_or_res->stage);
     pthread_mutex_unlock(&req_or_res->lock);
@@ -126,28 +248,110 @@ void next_stage(RequestOrResponse *req_or_res)
 
 void set_stage(RequestOrResponse *req_or_res, int stage)
 {
-    pthread_mutex_lock(&req_or_res->lock);
+    lock_shared_mutex(&req_or_res->lock);
     req_or_res->stage = stage;
     logger("DEBUG", "Set stage to: %d",  req_or_res->stage);
     pthread_mutex_unlock(&req_or_res->lock);
 }
 
-RequestOrResponse *get_req_or_res(const char *client_name)
+// Moves a pending request to STAGE_CLAIMED. Returns false if none was pending
+// or another worker took it first.
+bool claim_stage(RequestOrResponse *req_or_res)
+{
+    lock_shared_mutex(&req_or_res->lock);
+    bool claimed = req_or_res->stage == 1;
+    if (claimed)
+        req_or_res->stage = STAGE_CLAIMED;
+    pthread_mutex_unlock(&req_or_res->lock);
+    return claimed;
+}
+
+#else
+
+// Spin for a short while, since the peer usually answers within microseconds,
+// then park on the stage word until the peer publishes the stage we want.
+// TODO: Make this a timed wait. Such that, if wait time exceeds a certain duration, kill the wait with a failed state.
+void wait_until_stage(RequestOrResponse *req_or_res, int stage)
+{
+    for (int i = 0; i < stage_spin_count; ++i)
+    {
+        if (load_stage(req_or_res) == stage)
+            return;
+        cpu_relax();
+    }
+
+    int current;
+    while ((current = load_stage(req_or_res)) != stage)
+    {
+        __atomic_add_fetch(&req_or_res->waiters, 1, __ATOMIC_SEQ_CST);
+        if (load_stage(req_or_res) == current)
+            futex_wait(&req_or_res->stage, current);
+        __atomic_sub_fetch(&req_or_res->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Waits until the stage moves off `stage`, for at most `timeout_ns` (forever
+// if negative). Returns the new stage, or -1 with errno ETIMEDOUT.
+int wait_while_stage(RequestOrResponse *req_or_res, int stage, long timeout_ns)
+{
+    for (int i = 0; i < stage_spin_count; ++i)
+    {
+        int current = load_stage(req_or_res);
+        if (current != stage)
+            return current;
+        cpu_relax();
+    }
+
+    unsigned long start = monotonic_ns();
+    int current;
+    while ((current = load_stage(req_or_res)) == stage)
+    {
+        long remaining = timeout_ns < 0 ? -1 : timeout_ns - (long)(monotonic_ns() - start);
+        if (timeout_ns >= 0 && remaining <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        __atomic_add_fetch(&req_or_res->waiters, 1, __ATOMIC_SEQ_CST);
+        if (load_stage(req_or_res) == stage)
+            futex_wait_timed(&req_or_res->stage, stage, remaining);
+        __atomic_sub_fetch(&req_or_res->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return current;
+}
+
+// Publishes the stage and wakes the peer only if it is parked on the futex.
+static void publish_stage(RequestOrResponse *req_or_res, int stage)
 {
-    create_file_if_does_not_exist(client_name);
-    RequestOrResponse *req_or_res =
-        (RequestOrResponse *)attach_memory_block(client_name, sizeof(req_or_res));
+    __atomic_store_n(&req_or_res->stage, stage, __ATOMIC_SEQ_CST);
+    logger("DEBUG", "Set stage to: %d",  stage);
 
-    return req_or_res;
+    if (__atomic_load_n(&req_or_res->waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&req_or_res->stage, INT_MAX);
 }
 
-void destroy_req_or_res(RequestOrResponse *req_or_res)
+void next_stage(RequestOrResponse *req_or_res)
 {
-    pthread_mutex_destroy(&req_or_res->lock);
+    // Only the party owning the current stage advances it, so there is no
+    // competing writer between the load and the store.
+    publish_stage(req_or_res, (load_stage(req_or_res) + 1) % 3);
+}
 
-    detach_memory_block(req_or_res);
-    req_or_res = NULL;
-    // destroy_memory_block(req_or_res);
+void set_stage(RequestOrResponse *req_or_res, int stage)
+{
+    publish_stage(req_or_res, stage);
 }
 
+// Moves a pending request to STAGE_CLAIMED. Returns false if none was pending
+// or another worker took it first. Nobody waits for STAGE_CLAIMED, so nobody
+// is woken.
+bool claim_stage(RequestOrResponse *req_or_res)
+{
+    int expected = 1;
+    return __atomic_compare_exchange_n(&req_or_res->stage, &expected, STAGE_CLAIMED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
 #endif
\ No newline at end of file
@@ -4,224 +4,347 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "common_structs.h"
+#include "doorbell.h"
 #include "shared_memory.h"
 #include "logger.h"
 
-#define MAX_QUEUE_LEN 100
+// Default number of registration slots (and cells of each ring). Overridable
+// at server start; always rounded up to a power of two.
+#define DEFAULT_QUEUE_CAPACITY (1024)
+
+// Number of times a producer or consumer re-checks a full or empty ring
+// before parking.
+#define QUEUE_SPIN_COUNT (1000)
 
 typedef struct node_t
 {
-    int req_or_res_block_id;
+    int slot; // index into the registration slots of the connection segment
 } node_t;
 
+// A cell is free for the producer at position `pos` when seq == pos, and
+// holds a published node for the consumer at `pos` when seq == pos + 1.
+typedef struct queue_cell_t
+{
+    unsigned long seq;
+    node_t node;
+} queue_cell_t;
+
+// Bounded lock-free multi-producer, multi-consumer ring (Vyukov). Its cells
+// live in the connection segment at `cells_offset` from the segment start.
+typedef struct ring_t
+{
+    unsigned long enqueue_pos __attribute__((aligned(64)));
+    unsigned long dequeue_pos __attribute__((aligned(64)));
+
+    /* Producers park here while the ring is full */
+    int not_full_seq __attribute__((aligned(64)));
+    int full_waiters;
+
+    /* Consumers park here while the ring is empty */
+    int not_empty_seq;
+    int empty_waiters;
+
+    size_t cells_offset;
+} ring_t;
+
+// Layout of the connection segment. Registration slots are preallocated and
+// recycled: clients take a free slot index from `free_slots`, fill the slot
+// in place and post the index to `pending`, which the server consumes.
 typedef struct queue_t
 {
-    pthread_mutex_t lock;
-    int head;
-    int tail;
-    size_t size;
-    node_t nodes[MAX_QUEUE_LEN];
+    size_t capacity;
+    size_t mask;
+
+    ring_t pending;
+    ring_t free_slots;
+
+    /* Channels with a pending request, rung by clients */
+    ready_set_t ready;
+
+    size_t slots_offset;
 } queue_t;
 
-queue_t *create_queue()
+size_t round_up_to_power_of_two(size_t n)
 {
-    logger("DEBUG", "Initialising connection channel queue");
-    create_file_if_does_not_exist(CONNECT_CHANNEL_FNAME);
-    queue_t *q = (queue_t *)attach_memory_block(CONNECT_CHANNEL_FNAME, sizeof(queue_t));
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
 
-    if (q == NULL)
-    {
-        logger("ERROR", "Could not create shared memory block for queue.");
-        return NULL;
-    }
+static inline queue_cell_t *ring_cells(queue_t *q, ring_t *r)
+{
+    return (queue_cell_t *)((char *)q + r->cells_offset);
+}
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&q->lock, &attr);
-    pthread_mutexattr_destroy(&attr);
-    q->head = 0;
-    q->tail = 0;
-    q->size = 0;
+static inline RequestOrResponse *registration_slot(queue_t *q, int slot)
+{
+    return (RequestOrResponse *)((char *)q + q->slots_offset) + slot;
+}
 
-    logger("INFO", "Connection channel queue creation succesful");
-    return q;
+static void init_ring(queue_t *q, ring_t *r, size_t cells_offset)
+{
+    r->enqueue_pos = 0;
+    r->dequeue_pos = 0;
+    r->not_full_seq = 0;
+    r->full_waiters = 0;
+    r->not_empty_seq = 0;
+    r->empty_waiters = 0;
+    r->cells_offset = cells_offset;
+
+    queue_cell_t *cells = ring_cells(q, r);
+    for (size_t i = 0; i < q->capacity; ++i)
+        cells[i].seq = i;
 }
 
-queue_t *get_queue()
+// Spins for a while, then parks on `futex_word` until it moves past
+// `seen_seq`. `seen_seq` must have been read before the ring was last
+// observed full (or empty).
+static void wait_on_ring(int *futex_word, int *waiters, int seen_seq, int *spins)
 {
-    queue_t *q = (queue_t *)attach_memory_block(CONNECT_CHANNEL_FNAME, sizeof(queue_t));
-    if (q == NULL)
+    if (*spins < QUEUE_SPIN_COUNT)
     {
-        logger("ERROR", "Could not create shared memory block for queue.");
-        return NULL;
+        ++*spins;
+        cpu_relax();
+        return;
     }
 
-    return q;
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(futex_word, __ATOMIC_SEQ_CST) == seen_seq)
+        futex_wait(futex_word, seen_seq);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
 }
 
-RequestOrResponse *post(queue_t *q, const char *client_name)
+static void signal_ring(int *futex_word, int *waiters)
 {
-    pthread_mutex_lock(&q->lock);
-    if (q->size == MAX_QUEUE_LEN)
+    __atomic_add_fetch(futex_word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(futex_word, 1);
+}
+
+// Blocks while the ring is full instead of failing.
+void enqueue_node(queue_t *q, ring_t *r, node_t node)
+{
+    queue_cell_t *cells = ring_cells(q, r);
+    int spins = 0;
+    unsigned long pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    queue_cell_t *cell;
+    while (true)
     {
-        logger("ERROR", "Could not enqueue to connection queue. Connection queue is full.");
-        pthread_mutex_unlock(&q->lock);
-        return NULL;
+        int seen_seq = __atomic_load_n(&r->not_full_seq, __ATOMIC_SEQ_CST);
+        cell = &cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            wait_on_ring(&r->not_full_seq, &r->full_waiters, seen_seq, &spins);
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+        }
+        else
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
     }
 
-    char shm_reqres_fname[MAX_CLIENT_NAME_LEN];
-    sprintf(shm_reqres_fname, "queue_%d", q->tail);
-    create_file_if_does_not_exist(shm_reqres_fname);
+    cell->node = node;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    signal_ring(&r->not_empty_seq, &r->empty_waiters);
+}
 
-    int req_or_res_block_id = get_shared_block(shm_reqres_fname, sizeof(RequestOrResponse));
-    RequestOrResponse *shm_req_or_res = (RequestOrResponse *)attach_with_shared_block_id(req_or_res_block_id);
-    if (shm_req_or_res == NULL)
+// Returns false if the ring is empty, unless `block` is set, in which case it
+// waits for a node to be enqueued.
+bool dequeue_node(queue_t *q, ring_t *r, node_t *node, bool block)
+{
+    queue_cell_t *cells = ring_cells(q, r);
+    int spins = 0;
+    unsigned long pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    queue_cell_t *cell;
+    while (true)
     {
-        logger("ERROR", "Could not create shared memory block %s for the personal connection channel.", shm_reqres_fname);
-        pthread_mutex_unlock(&q->lock);
-        return NULL;
-    }
+        int seen_seq = __atomic_load_n(&r->not_empty_seq, __ATOMIC_SEQ_CST);
+        cell = &cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)(pos + 1);
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shm_req_or_res->lock, &attr);
-    pthread_mutexattr_destroy(&attr);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            if (!block)
+                return false;
+            wait_on_ring(&r->not_empty_seq, &r->empty_waiters, seen_seq, &spins);
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+        }
+        else
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    }
 
-    strncpy(shm_req_or_res->client_name, client_name, MAX_CLIENT_NAME_LEN);
-    strncpy(shm_req_or_res->filename, shm_reqres_fname, MAX_CLIENT_NAME_LEN);
-    shm_req_or_res->stage = 0;
+    *node = cell->node;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
 
-    q->nodes[q->tail].req_or_res_block_id = req_or_res_block_id;
+    signal_ring(&r->not_full_seq, &r->full_waiters);
+    return true;
+}
 
-    q->tail = (q->tail + 1) % MAX_QUEUE_LEN;
-    q->size += 1;
-    pthread_mutex_unlock(&q->lock);
+// Approximate number of nodes in the ring.
+size_t ring_depth(ring_t *r)
+{
+    unsigned long tail = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    return tail > head ? tail - head : 0;
+}
 
-    return shm_req_or_res;
+// Approximate number of queued registrations.
+size_t queue_depth(queue_t *q)
+{
+    return ring_depth(&q->pending);
 }
 
-RequestOrResponse *dequeue(queue_t *q)
+queue_t *create_queue(size_t capacity)
 {
-    pthread_mutex_lock(&q->lock);
+    logger("DEBUG", "Initialising connection channel queue");
+    capacity = round_up_to_power_of_two(capacity > 0 ? capacity : DEFAULT_QUEUE_CAPACITY);
 
-    if (q->size == 0)
+    size_t pending_offset = (sizeof(queue_t) + 63) & ~(size_t)63;
+    size_t free_offset = pending_offset + capacity * sizeof(queue_cell_t);
+    size_t slots_offset = (free_offset + capacity * sizeof(queue_cell_t) + 63) & ~(size_t)63;
+    size_t size = slots_offset + capacity * sizeof(RequestOrResponse);
+
+    prepare_memory_block_name(CONNECT_CHANNEL_FNAME);
+    queue_t *q = (queue_t *)attach_memory_block(CONNECT_CHANNEL_FNAME, size);
+
+    if (q == NULL)
     {
-        logger("INFO", "Connection queue empty. Nothing to dequeue.");
-        pthread_mutex_unlock(&q->lock);
+        logger("ERROR", "Could not create shared memory block for queue.");
         return NULL;
     }
 
-    int req_or_res_block_id = q->nodes[q->head].req_or_res_block_id;
-
-    // Whether we are able to delete the node or not, the connection request no longer remains valid
-    // if a shared memory block can not be attached to it. Ideally, this should not be possible.
-    // But it seems, that it is infact, very possible.
-    q->head = (q->head + 1) % MAX_QUEUE_LEN;
-    q->size -= 1;
+    q->capacity = capacity;
+    q->mask = capacity - 1;
+    q->slots_offset = slots_offset;
+    init_ring(q, &q->pending, pending_offset);
+    init_ring(q, &q->free_slots, free_offset);
+    init_ready_set(&q->ready);
 
-    RequestOrResponse *req_or_res = attach_with_shared_block_id(req_or_res_block_id);
-    if (req_or_res == NULL)
+    for (size_t i = 0; i < capacity; ++i)
     {
-        logger("ERROR", "Could not dequeue and get shared block.");
-        return (void *)(-1);
+        RequestOrResponse *slot = registration_slot(q, i);
+        init_shared_mutex(&slot->lock);
+        slot->stage = 0;
+        slot->waiters = 0;
+        slot->slot = i;
+        slot->client_pid = 0;
+
+        node_t node = {(int)i};
+        enqueue_node(q, &q->free_slots, node);
     }
 
-    pthread_mutex_unlock(&q->lock);
-
-    return req_or_res;
+    logger("INFO", "Connection channel queue creation succesful with %zu registration slots", capacity);
+    return q;
 }
 
-RequestOrResponse *fetch(queue_t *q)
+queue_t *get_queue()
 {
-    pthread_mutex_lock(&q->lock);
-
-    if (q->size == 0)
+    // shmat maps the whole segment, so the header size is enough to find it.
+    queue_t *q = (queue_t *)attach_memory_block(CONNECT_CHANNEL_FNAME, sizeof(queue_t));
+    if (q == NULL)
     {
-        logger("INFO", "Connection queue empty. Nothing to fetch.");
-        pthread_mutex_unlock(&q->lock);
-
+        logger("ERROR", "Could not create shared memory block for queue.");
         return NULL;
     }
 
-    int req_or_res_block_id = q->nodes[q->head].req_or_res_block_id;
-
-    RequestOrResponse *req_or_res = attach_with_shared_block_id(req_or_res_block_id);
-    pthread_mutex_unlock(&q->lock);
-
-    return req_or_res;
+    return q;
 }
 
-int empty(queue_t *q)
+// Takes a free registration slot, waiting for one if all are in use, and
+// posts it to the server. `payload_size` is the payload region the client
+// asks for, 0 for none.
+RequestOrResponse *post(queue_t *q, const char *client_name, size_t payload_size)
 {
-    pthread_mutex_lock(&q->lock);
+    node_t node;
+    dequeue_node(q, &q->free_slots, &node, true);
 
-    q->size = 0;
-    pthread_mutex_unlock(&q->lock);
+    RequestOrResponse *reqres = registration_slot(q, node.slot);
+    strncpy(reqres->client_name, client_name, MAX_CLIENT_NAME_LEN - 1);
+    reqres->client_name[MAX_CLIENT_NAME_LEN - 1] = '\0';
+    reqres->payload_size = payload_size;
+    reqres->payload_offset = 0;
+    reqres->client_pid = getpid();
+    reqres->res.response_code = RESPONSE_FAILURE;
+    __atomic_store_n(&reqres->stage, 0, __ATOMIC_SEQ_CST);
 
-    return 0;
+    enqueue_node(q, &q->pending, node);
+
+    return reqres;
 }
 
-int destroy_node(RequestOrResponse *reqres)
+RequestOrResponse *dequeue(queue_t *q)
 {
-
-    logger("INFO", "Starting cleanup of node");
-    if (reqres == NULL)
+    node_t node;
+    if (!dequeue_node(q, &q->pending, &node, false))
     {
-        logger("ERROR", "Failed to destroy connection memory block. Null pointer was passed");
-        return -1;
+        logger("DEBUG", "Connection queue empty. Nothing to dequeue.");
+        return NULL;
     }
 
-    char filename[MAX_CLIENT_NAME_LEN];
-    strncpy(filename, reqres->filename, MAX_CLIENT_NAME_LEN);
-
-    if (pthread_mutex_destroy(&reqres->lock) != 0)
-    {
-        if (errno == EINVAL)
-            logger("ERROR", "Failed to destroy mutex on connection block %s used by client %s. The value specified by the mutex is invalid", filename, reqres->client_name);
-
-        else if (errno == EBUSY)
-            logger("ERROR", "Failed to destroy mutex on connection block %s used by client %s. The mutex is locked", filename, reqres->client_name);
-
-        else
-            logger("ERROR", "Failed to destroy mutex on connection block %s used by client %s. Unknown error occured", filename, reqres->client_name);
+    return registration_slot(q, node.slot);
+}
 
-        return -1;
-    }
+// Waits on the pending ring's futex until a registration is posted, then
+// takes up to `max` of them without waiting again. Returns how many.
+int dequeue_batch(queue_t *q, RequestOrResponse **batch, int max)
+{
+    node_t node;
+    dequeue_node(q, &q->pending, &node, true);
+    batch[0] = registration_slot(q, node.slot);
+
+    int n = 1;
+    while (n < max && dequeue_node(q, &q->pending, &node, false))
+        batch[n++] = registration_slot(q, node.slot);
+    return n;
+}
 
-    if (detach_memory_block(reqres) == IPC_RESULT_ERROR)
+// Hands a registration slot back once the client has read the server's
+// answer.
+int release_node(queue_t *q, RequestOrResponse *reqres)
+{
+    if (reqres == NULL)
     {
-        logger("ERROR", "Failed to detach connection memory block %s used by client %s", filename, reqres->client_name);
+        logger("ERROR", "Failed to release registration slot. Null pointer was passed");
         return -1;
     }
 
-    if (destroy_memory_block(filename) == IPC_RESULT_ERROR)
-    {
-        logger("ERROR", "Failed to destroy connection memory block %s used by client %s", filename, reqres->client_name);
-        return -1;
-    }
+    // Cleared first, so that a slot still carrying a dead client's pid is
+    // known to have never been released.
+    __atomic_store_n(&reqres->client_pid, 0, __ATOMIC_SEQ_CST);
+    node_t node = {reqres->slot};
+    enqueue_node(q, &q->free_slots, node);
 
-    logger("INFO", "Deleting file %s", filename);
-    return remove_file(filename);
+    return 0;
 }
 
 int destroy_queue(queue_t *q)
 {
     logger("INFO", "Starting queue cleanup");
-    while (q->size)
-    {
-        logger("DEBUG", "Cleaning node at index %d", q->head);
-
-        RequestOrResponse *reqres = dequeue(q); // ! What if dequeue returns NULL or -1. > Null occurs only when queue is empty. Should not occur in this case.
-        if (reqres == (void *)(-1))
-        {
-            break;
-        }
 
-        destroy_node(reqres);
+    // Fail pending registrations so that their clients do not wait forever.
+    RequestOrResponse *reqres;
+    while ((reqres = dequeue(q)) != NULL)
+    {
+        logger("DEBUG", "Rejecting pending registration of client %s", reqres->client_name);
+        reqres->res.response_code = RESPONSE_FAILURE;
+        set_stage(reqres, 1);
     }
 
     logger("DEBUG", "Detaching memory block for queue.");
@@ -231,11 +354,11 @@ int destroy_queue(queue_t *q)
     destroy_memory_block(CONNECT_CHANNEL_FNAME);
 
     logger("INFO", "Deleting file %s", CONNECT_CHANNEL_FNAME);
-    remove_file(CONNECT_CHANNEL_FNAME);
+    release_memory_block_name(CONNECT_CHANNEL_FNAME);
 
     logger("INFO", "Completed queue cleanup");
 
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
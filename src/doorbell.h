@@ -0,0 +1,87 @@
+#ifndef DOORBELL_H
+#define DOORBELL_H
+
+#include <limits.h>
+
+#include "utils.h"
+
+#define MAX_CLIENTS (4096)
+#define READY_SET_WORDS (MAX_CLIENTS / 64)
+
+// Set of channels with a pending request. Lives in the connection segment so
+// that clients can ring it; server workers claim slots out of it.
+typedef struct ready_set_t
+{
+    int seq;      // futex word, bumped on every ring
+    int sleepers; // number of workers parked on `seq`
+    unsigned long bits[READY_SET_WORDS];
+} ready_set_t;
+
+void init_ready_set(ready_set_t *rs)
+{
+    rs->seq = 0;
+    rs->sleepers = 0;
+    for (int i = 0; i < READY_SET_WORDS; ++i)
+        rs->bits[i] = 0;
+}
+
+// Marks `slot` as having a pending request and wakes one idle worker.
+// Must be called after the request has been published on the channel.
+void ring_doorbell(ready_set_t *rs, int slot)
+{
+    __atomic_fetch_or(&rs->bits[slot / 64], 1UL << (slot % 64), __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&rs->seq, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&rs->sleepers, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&rs->seq, 1);
+}
+
+// Wakes one parked worker without marking any slot, e.g. when there is work
+// to steal.
+void nudge_doorbell(ready_set_t *rs)
+{
+    __atomic_add_fetch(&rs->seq, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&rs->sleepers, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&rs->seq, 1);
+}
+
+int read_doorbell_seq(ready_set_t *rs)
+{
+    return __atomic_load_n(&rs->seq, __ATOMIC_SEQ_CST);
+}
+
+// Claims one ringing slot, clearing its bit. Returns -1 if none is ringing.
+// `hint` rotates the scan start so that low slots do not starve high ones.
+int claim_ready_slot(ready_set_t *rs, unsigned int *hint)
+{
+    for (int i = 0; i < READY_SET_WORDS; ++i)
+    {
+        int word = (*hint + i) % READY_SET_WORDS;
+        unsigned long bits = __atomic_load_n(&rs->bits[word], __ATOMIC_ACQUIRE);
+        while (bits)
+        {
+            unsigned long mask = 1UL << __builtin_ctzl(bits);
+            unsigned long old = __atomic_fetch_and(&rs->bits[word], ~mask, __ATOMIC_ACQ_REL);
+            if (old & mask)
+            {
+                *hint = word + 1;
+                return word * 64 + __builtin_ctzl(mask);
+            }
+            bits = old & ~mask;
+        }
+    }
+
+    return -1;
+}
+
+// Parks the caller until the doorbell is rung after `seen_seq` was read.
+void wait_for_doorbell(ready_set_t *rs, int seen_seq)
+{
+    __atomic_add_fetch(&rs->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (read_doorbell_seq(rs) == seen_seq)
+        futex_wait(&rs->seq, seen_seq);
+    __atomic_sub_fetch(&rs->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+#endif
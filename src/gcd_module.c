@@ -0,0 +1,42 @@
+#include <stdlib.h>
+
+#include "handler_module.h"
+
+// Example handler module: GCD of n1 and n2 as request type 16. Load it with
+// server -l bin/gcd_module.so.
+
+#define GCD_REQUEST_TYPE (FIRST_MODULE_REQUEST_TYPE)
+
+static Response handle_gcd(const handler_ctx_t *ctx, Request req)
+{
+    (void)ctx;
+    Response res = {0};
+
+    // |INT_MIN| does not fit in an int.
+    unsigned int a = req.n1 < 0 ? 0U - (unsigned int)req.n1 : (unsigned int)req.n1;
+    unsigned int b = req.n2 < 0 ? 0U - (unsigned int)req.n2 : (unsigned int)req.n2;
+    while (b != 0)
+    {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    if (a > 0x7fffffffU)
+    {
+        res.response_code = RESPONSE_UNSUPPORTED;
+        return res;
+    }
+    res.result = (int)a;
+    res.response_code = RESPONSE_SUCCESS;
+    return res;
+}
+
+int ccs_register_handlers(const handler_module_api_t *api)
+{
+    static const request_handler_t gcd = {GCD_REQUEST_TYPE, "GCD", HANDLER_COST_CHEAP, true, handle_gcd, NULL};
+
+    if (api->version != HANDLER_MODULE_API_VERSION)
+        return -1;
+    return api->register_handler(&gcd);
+}
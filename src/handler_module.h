@@ -0,0 +1,60 @@
+#ifndef HANDLER_MODULE_H
+#define HANDLER_MODULE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "common_structs.h"
+
+// What a request handler looks like to the server, and the entry point of a
+// handler module: a shared object the server loads with -l at start.
+//
+// A module exports CCS_HANDLER_MODULE_ENTRY, which the server calls once
+// with a handler_module_api_t. The module registers each of its handlers
+// through it, under request types from FIRST_MODULE_REQUEST_TYPE on, and
+// returns 0, or -1 to be unloaded again.
+
+#define HANDLER_MODULE_API_VERSION (1)
+#define CCS_HANDLER_MODULE_ENTRY "ccs_register_handlers"
+
+typedef enum HandlerCost
+{
+    HANDLER_COST_CHEAP,     // a few instructions; caching would cost more than it saves
+    HANDLER_COST_MODERATE,
+    HANDLER_COST_EXPENSIVE  // worth a result cache lookup
+} HandlerCost;
+
+// What a handler can see of the channel its request came in on.
+typedef struct handler_ctx_t
+{
+    void *payload;       // the channel's payload region, NULL if it has none
+    size_t payload_size;
+} handler_ctx_t;
+
+typedef Response (*handler_fn_t)(const handler_ctx_t *ctx, Request req);
+
+// Answers `count` batch entries of the handler's type at once, e.g. to
+// interleave their work. Batch entries never carry payloads.
+typedef void (*batch_handler_fn_t)(const Request *req, Response *res, int count);
+
+typedef struct request_handler_t
+{
+    int type; // request_type served, below MAX_REQUEST_TYPES
+    const char *name;
+    HandlerCost cost;
+    // The response depends only on the request's n1, n2 and op, so it may be
+    // answered from the result cache. Cacheable handlers get no payload.
+    bool cacheable;
+    handler_fn_t handle;
+    batch_handler_fn_t handle_batch; // optional
+} request_handler_t;
+
+typedef struct handler_module_api_t
+{
+    int version; // HANDLER_MODULE_API_VERSION
+    int (*register_handler)(const request_handler_t *handler);
+} handler_module_api_t;
+
+typedef int (*handler_module_entry_t)(const handler_module_api_t *api);
+
+#endif
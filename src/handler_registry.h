@@ -0,0 +1,131 @@
+#ifndef HANDLER_REGISTRY_H
+#define HANDLER_REGISTRY_H
+
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <dlfcn.h>
+
+#include "logger.h"
+#include "common_structs.h"
+#include "handler_module.h"
+#include "stats.h"
+
+// Handlers indexed by request type, so dispatch is one table lookup. The
+// table is filled at server start, before the worker pool runs, and only
+// read afterwards.
+
+#define MAX_HANDLER_MODULES (16)
+
+static request_handler_t handler_table[MAX_REQUEST_TYPES];
+
+static inline const request_handler_t *find_handler(int type)
+{
+    if ((unsigned)type >= MAX_REQUEST_TYPES || handler_table[type].handle == NULL)
+        return NULL;
+    return &handler_table[type];
+}
+
+// Case-insensitive, so that -k can name handlers in lower case.
+const request_handler_t *find_handler_by_name(const char *name)
+{
+    for (int type = 0; type < MAX_REQUEST_TYPES; ++type)
+        if (handler_table[type].handle != NULL && strcasecmp(handler_table[type].name, name) == 0)
+            return &handler_table[type];
+    return NULL;
+}
+
+int register_handler(const request_handler_t *handler)
+{
+    if (handler == NULL || handler->handle == NULL || handler->name == NULL)
+    {
+        logger("ERROR", "Handler registered without a name or entry point.");
+        return -1;
+    }
+    if ((unsigned)handler->type >= MAX_REQUEST_TYPES || handler->type == UNREGISTER || handler->type == BATCH)
+    {
+        logger("ERROR", "Handler %s cannot serve request type %d.", handler->name, handler->type);
+        return -1;
+    }
+    if (handler_table[handler->type].handle != NULL)
+    {
+        logger("ERROR", "Request type %d already served by %s.", handler->type, handler_table[handler->type].name);
+        return -1;
+    }
+
+    handler_table[handler->type] = *handler;
+    set_stats_type_name(handler->type, handler->name);
+    logger("INFO", "Registered handler %s for request type %d", handler->name, handler->type);
+    return 0;
+}
+
+// What modules register through, which keeps them to the types from
+// FIRST_MODULE_REQUEST_TYPE on.
+static int register_module_handler(const request_handler_t *handler)
+{
+    if (handler != NULL && (handler->type < FIRST_MODULE_REQUEST_TYPE || handler->type >= MAX_REQUEST_TYPES))
+    {
+        logger("ERROR", "Handler module cannot serve request type %d, only %d to %d.", handler->type,
+               FIRST_MODULE_REQUEST_TYPE, MAX_REQUEST_TYPES - 1);
+        return -1;
+    }
+    return register_handler(handler);
+}
+
+// Loads a handler module and lets it register its handlers. The module stays
+// loaded until exit, unless it fails to register.
+int load_handler_module(const char *path)
+{
+    void *module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (module == NULL)
+    {
+        logger("ERROR", "Could not load handler module %s: %s", path, dlerror());
+        return -1;
+    }
+
+    handler_module_entry_t entry = (handler_module_entry_t)dlsym(module, CCS_HANDLER_MODULE_ENTRY);
+    if (entry == NULL)
+    {
+        logger("ERROR", "%s does not export %s.", path, CCS_HANDLER_MODULE_ENTRY);
+        dlclose(module);
+        return -1;
+    }
+
+    bool was_free[MAX_REQUEST_TYPES];
+    for (int type = 0; type < MAX_REQUEST_TYPES; ++type)
+        was_free[type] = handler_table[type].handle == NULL;
+
+    // What the module registered before failing points into it, so it is
+    // dropped before the module is unloaded.
+    handler_module_api_t api = {HANDLER_MODULE_API_VERSION, register_module_handler};
+    if (entry(&api) < 0)
+    {
+        logger("ERROR", "Handler module %s failed to register.", path);
+        for (int type = FIRST_MODULE_REQUEST_TYPE; type < MAX_REQUEST_TYPES; ++type)
+        {
+            if (was_free[type] && handler_table[type].handle != NULL)
+            {
+                handler_table[type] = (request_handler_t){0};
+                set_stats_type_name(type, "");
+            }
+        }
+        dlclose(module);
+        return -1;
+    }
+
+    logger("INFO", "Loaded handler module %s", path);
+    return 0;
+}
+
+// Mask of 1 << type of the handlers worth caching by default: the
+// cacheable ones that are expensive.
+unsigned int default_cached_types()
+{
+    unsigned int mask = 0;
+    for (int type = 0; type < MAX_REQUEST_TYPES; ++type)
+        if (handler_table[type].handle != NULL && handler_table[type].cacheable && handler_table[type].cost == HANDLER_COST_EXPENSIVE)
+            mask |= 1U << type;
+    return mask;
+}
+
+#endif
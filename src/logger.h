@@ -6,48 +6,330 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
 
 #define LOG_FILENAME "main.log"
 #define MAX_LOG_MSG_SIZE (1024)
 
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Asynchronous logger. Each thread formats its messages into its own
+// single-producer ring; a background flusher thread drains every ring and
+// writes them out in batches, so callers never take a lock or make a syscall.
+// Building with -DLOG_BINARY_TRACE (make TRACE=1) swaps the text output for
+// binary trace rings, see trace.h.
+//
+// Messages below LOG_MIN_LEVEL (build time, -DLOG_MIN_LEVEL=1 drops DEBUG) are
+// compiled out. Messages below the runtime level (set_log_level(), or the
+// CCS_LOG_LEVEL environment variable at init) cost one compare.
+
+#define LOG_LEVEL_DEBUG (0)
+#define LOG_LEVEL_INFO (1)
+#define LOG_LEVEL_WARN (2)
+#define LOG_LEVEL_ERROR (3)
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Folds to a constant for the string literals passed to logger().
+#define LOG_LEVEL_OF(code) \
+    ((code)[0] == 'D' ? LOG_LEVEL_DEBUG : (code)[0] == 'I' ? LOG_LEVEL_INFO : (code)[0] == 'W' ? LOG_LEVEL_WARN : LOG_LEVEL_ERROR)
+
+static int log_level = LOG_LEVEL_INFO;
+
+void set_log_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int parse_log_level(const char *name)
+{
+    if (name == NULL)
+        return -1;
+    if (strcmp(name, "DEBUG") == 0 || strcmp(name, "debug") == 0)
+        return LOG_LEVEL_DEBUG;
+    if (strcmp(name, "INFO") == 0 || strcmp(name, "info") == 0)
+        return LOG_LEVEL_INFO;
+    if (strcmp(name, "WARN") == 0 || strcmp(name, "warn") == 0)
+        return LOG_LEVEL_WARN;
+    if (strcmp(name, "ERROR") == 0 || strcmp(name, "error") == 0)
+        return LOG_LEVEL_ERROR;
+    return -1;
+}
+
+#ifdef LOG_BINARY_TRACE
+
+#include "trace.h"
+
+#define logger(code, format, ...)                                                                                 \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (LOG_LEVEL_OF(code) >= LOG_MIN_LEVEL && LOG_LEVEL_OF(code) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+        {                                                                                                         \
+            TRACE_SITE(_trace_site, code, LOG_LEVEL_OF(code), format);                                           \
+            trace_record(&_trace_site, ##__VA_ARGS__);                                                            \
+        }                                                                                                         \
+    } while (0)
+
+int close_logger()
+{
+    return close_trace();
+}
+
+int init_logger(const char *log_name)
+{
+    int level = parse_log_level(getenv("CCS_LOG_LEVEL"));
+    if (level >= 0)
+        set_log_level(level);
+
+    return init_trace(log_name);
+}
+
+#else
+
+// Records per thread ring. Must be a power of two.
+#define LOG_RING_RECORDS (128)
+// How long the flusher sleeps when nobody asks it to flush earlier.
+#define LOG_FLUSH_INTERVAL_MS (20)
+// How many times a producer waits for room before dropping a message.
+#define LOG_FULL_RETRIES (1000)
+
+typedef struct log_record_t
+{
+    int len;
+    char text[MAX_LOG_MSG_SIZE];
+} log_record_t;
+
+typedef struct log_ring_t
+{
+    unsigned long head __attribute__((aligned(64))); // next record to flush
+    unsigned long tail __attribute__((aligned(64))); // next record to fill
+    bool orphaned;                                   // owning thread exited
+    struct log_ring_t *next;
+    log_record_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
 static FILE *log_file;
+static unsigned long log_dropped = 0;
 
-static void internal_logger(const char *code, const char *source_file, const char *calling_function, int line_number, const char *format, ...)
+static log_ring_t *log_rings;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; // guards log_rings and the flusher's sleep
+static pthread_cond_t log_flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log_flusher;
+static bool log_flusher_running = false;
+static bool log_flusher_stop = false;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread log_ring_t *thread_log_ring;
+static __thread time_t cached_log_second = -1;
+static __thread char cached_log_timestamp[32];
+
+static void wake_log_flusher()
 {
-    time_t t = time(NULL);
-    struct tm *lt = localtime(&t);
-    char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", lt);
+    pthread_mutex_lock(&log_mutex);
+    pthread_cond_signal(&log_flush_cond);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static void orphan_log_ring(void *ring)
+{
+    __atomic_store_n(&((log_ring_t *)ring)->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void create_log_ring_key()
+{
+    pthread_key_create(&log_ring_key, orphan_log_ring);
+}
+
+static log_ring_t *get_thread_log_ring()
+{
+    if (thread_log_ring != NULL)
+        return thread_log_ring;
+
+    log_ring_t *ring = (log_ring_t *)aligned_alloc(64, sizeof(log_ring_t));
+    if (ring == NULL)
+        return NULL;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->orphaned = false;
+
+    pthread_once(&log_ring_key_once, create_log_ring_key);
+    pthread_setspecific(log_ring_key, ring);
+
+    pthread_mutex_lock(&log_mutex);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_mutex);
+
+    thread_log_ring = ring;
+    return ring;
+}
+
+// Formats the timestamp at most once per second per thread.
+static const char *log_timestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != cached_log_second)
+    {
+        struct tm lt;
+        localtime_r(&now.tv_sec, &lt);
+        strftime(cached_log_timestamp, sizeof(cached_log_timestamp), "%Y-%m-%d %H:%M:%S", &lt);
+        cached_log_second = now.tv_sec;
+    }
+
+    return cached_log_timestamp;
+}
+
+static void internal_logger(int level, const char *code, const char *source_file, const char *calling_function, int line_number, const char *format, ...)
+{
+    log_ring_t *ring = get_thread_log_ring();
+    if (ring == NULL)
+        return;
+
+    unsigned long tail = ring->tail;
+    for (int retries = 0; tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS; ++retries)
+    {
+        if (retries == LOG_FULL_RETRIES || !__atomic_load_n(&log_flusher_running, __ATOMIC_RELAXED))
+        {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        wake_log_flusher();
+        sched_yield();
+    }
+
+    log_record_t *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
 
     pid_t pid = getpid();
     unsigned int tid = (unsigned long)pthread_self();
 
-    va_list args;
-    va_start(args, format);
-    char log_msg[MAX_LOG_MSG_SIZE];
-    vsnprintf(log_msg, MAX_LOG_MSG_SIZE, format, args);
-    va_end(args);
+    int len = snprintf(record->text, MAX_LOG_MSG_SIZE, "%s %s (%s:%d) [%d:%08x] %s \"", code, log_timestamp(), source_file, line_number, pid, tid, calling_function);
+    if (len < MAX_LOG_MSG_SIZE - 3)
+    {
+        va_list args;
+        va_start(args, format);
+        int msg_len = vsnprintf(record->text + len, MAX_LOG_MSG_SIZE - 2 - len, format, args);
+        va_end(args);
+        len += msg_len < MAX_LOG_MSG_SIZE - 3 - len ? msg_len : MAX_LOG_MSG_SIZE - 3 - len;
+    }
+    else
+        len = MAX_LOG_MSG_SIZE - 3;
+    record->text[len++] = '"';
+    record->text[len++] = '\n';
+    record->len = len;
 
-    char final_msg[MAX_LOG_MSG_SIZE];
-    snprintf(final_msg, MAX_LOG_MSG_SIZE, "%s %s (%s:%d) [%d:%08x] %s \"%s\"\n", code, timestamp, source_file, line_number, pid, tid, calling_function, log_msg);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Errors are flushed right away, everything else within one interval
+    // unless the ring is filling up.
+    if (level >= LOG_LEVEL_ERROR || tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED) >= LOG_RING_RECORDS / 2)
+        wake_log_flusher();
+}
+
+#define logger(code, format, ...)                                                                                 \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (LOG_LEVEL_OF(code) >= LOG_MIN_LEVEL && LOG_LEVEL_OF(code) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+            internal_logger(LOG_LEVEL_OF(code), code, __FILE__, __func__, __LINE__, format, ##__VA_ARGS__);         \
+    } while (0)
+
+// Writes out everything buffered so far. Returns the number of records.
+static size_t drain_log_rings()
+{
+    size_t drained = 0;
 
     pthread_mutex_lock(&log_mutex);
-    fputs(final_msg, log_file);
-    fflush(log_file);
+    log_ring_t **link = &log_rings;
+    while (*link != NULL)
+    {
+        log_ring_t *ring = *link;
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++drained)
+        {
+            log_record_t *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+            if (log_file != NULL)
+                fwrite(record->text, 1, record->len, log_file);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
     pthread_mutex_unlock(&log_mutex);
+
+    if (drained > 0 && log_file != NULL)
+        fflush(log_file);
+
+    return drained;
 }
 
-#define logger(code, format, ...)                                                  \
-    do                                                                             \
-    {                                                                              \
-        internal_logger(code, __FILE__, __func__, __LINE__, format, ##__VA_ARGS__); \
-    } while (0)
+static void *log_flusher_function(void *_args)
+{
+    (void)_args;
+    while (true)
+    {
+        drain_log_rings();
+
+        pthread_mutex_lock(&log_mutex);
+        if (log_flusher_stop)
+        {
+            pthread_mutex_unlock(&log_mutex);
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log_flush_cond, &log_mutex, &deadline);
+        pthread_mutex_unlock(&log_mutex);
+    }
+
+    drain_log_rings();
+    return NULL;
+}
 
 int close_logger()
 {
-    return fclose(log_file);
+    if (__atomic_load_n(&log_flusher_running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&log_mutex);
+        log_flusher_stop = true;
+        pthread_cond_signal(&log_flush_cond);
+        pthread_mutex_unlock(&log_mutex);
+
+        pthread_join(log_flusher, NULL);
+        __atomic_store_n(&log_flusher_running, false, __ATOMIC_RELEASE);
+    }
+
+    if (log_file == NULL)
+        return 0;
+
+    unsigned long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        fprintf(log_file, "WARN logger dropped %lu messages because a thread's log buffer was full\n", dropped);
+
+    int res = fclose(log_file);
+    log_file = NULL;
+    return res;
+}
+
+static void close_logger_at_exit()
+{
+    close_logger();
 }
 
 int init_logger(const char *log_name)
@@ -66,7 +348,30 @@ int init_logger(const char *log_name)
         return EXIT_FAILURE;
     }
 
+    int level = parse_log_level(getenv("CCS_LOG_LEVEL"));
+    if (level >= 0)
+        set_log_level(level);
+
+    log_flusher_stop = false;
+    if (pthread_create(&log_flusher, NULL, log_flusher_function, NULL) != 0)
+    {
+        fprintf(stderr, "ERROR: Failed to start the log flusher.\n");
+        fclose(log_file);
+        log_file = NULL;
+        return EXIT_FAILURE;
+    }
+    __atomic_store_n(&log_flusher_running, true, __ATOMIC_RELEASE);
+
+    static bool registered_at_exit = false;
+    if (!registered_at_exit)
+    {
+        atexit(close_logger_at_exit);
+        registered_at_exit = true;
+    }
+
     return EXIT_SUCCESS;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+#endif
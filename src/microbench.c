@@ -0,0 +1,703 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Large enough for the 1M client index runs at a load factor of one half.
+#define CLIENT_INDEX_CAPACITY (1 << 21)
+
+#include "logger.h"
+#include "utils.h"
+#include "common_structs.h"
+#include "conn_chanel.h"
+#include "client_tree.h"
+#include "worker.h"
+
+// Microbenchmarks of the server's building blocks, each run in isolation and
+// at several thread counts. Results are printed as JSON so that builds can be
+// compared. Needs no running server; the queue benchmark refuses to run next
+// to one since it would take over the connection channel's name.
+
+#define MAX_THREAD_COUNTS (8)
+
+typedef struct microbench_config_t
+{
+    int threads[MAX_THREAD_COUNTS];
+    int num_thread_counts;
+    const char *filter;
+    bool quick;
+} microbench_config_t;
+
+static microbench_config_t config;
+static FILE *out;
+static bool first_result = true;
+static volatile uint64_t sink;
+
+static uint64_t scaled(uint64_t iterations)
+{
+    return config.quick ? iterations / 10 : iterations;
+}
+
+static bool selected(const char *name)
+{
+    return config.filter == NULL || strstr(name, config.filter) != NULL;
+}
+
+static void emit_result(const char *name, const char *params, int threads, uint64_t ops, uint64_t elapsed_ns)
+{
+    double ns_per_op = ops ? (double)elapsed_ns / ops : 0;
+    fprintf(out, "%s\n    {\"benchmark\": \"%s\", \"params\": {%s}, \"threads\": %d, \"ops\": %lu, \"elapsed_ns\": %lu, \"ns_per_op\": %.2f, \"mops_per_s\": %.3f}",
+            first_result ? "" : ",", name, params, threads, (unsigned long)ops, (unsigned long)elapsed_ns, ns_per_op,
+            elapsed_ns ? ops * 1e3 / elapsed_ns : 0);
+    first_result = false;
+    fflush(out);
+
+    fprintf(stderr, "%-24s %-36s threads %2d  %10.2f ns/op\n", name, params, threads, ns_per_op);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Parallel runner                                                           */
+/* ------------------------------------------------------------------------- */
+
+typedef void (*bench_fn_t)(void *ctx, int thread, int num_threads);
+
+typedef struct runner_arg_t
+{
+    bench_fn_t fn;
+    void *ctx;
+    int thread;
+    int num_threads;
+    pthread_barrier_t *barrier;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} runner_arg_t;
+
+static void *runner_thread(void *arg)
+{
+    runner_arg_t *a = (runner_arg_t *)arg;
+    pthread_barrier_wait(a->barrier);
+    a->start_ns = monotonic_ns();
+    a->fn(a->ctx, a->thread, a->num_threads);
+    a->end_ns = monotonic_ns();
+    return NULL;
+}
+
+// Runs fn on num_threads threads released together and returns the time from
+// the first one starting to the last one finishing. The threads time
+// themselves, since the caller may not be scheduled while they run.
+static uint64_t run_parallel(bench_fn_t fn, void *ctx, int num_threads)
+{
+    pthread_t tids[num_threads];
+    runner_arg_t args[num_threads];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, num_threads);
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        args[t] = (runner_arg_t){fn, ctx, t, num_threads, &barrier, 0, 0};
+        pthread_create(&tids[t], NULL, runner_thread, &args[t]);
+    }
+
+    uint64_t start = UINT64_MAX, end = 0;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        pthread_join(tids[t], NULL);
+        if (args[t].start_ns < start)
+            start = args[t].start_ns;
+        if (args[t].end_ns > end)
+            end = args[t].end_ns;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    return end - start;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Registration queue: post / dequeue                                        */
+/* ------------------------------------------------------------------------- */
+
+typedef struct queue_ctx_t
+{
+    queue_t *q;
+    uint64_t per_producer;
+    int producers;
+} queue_ctx_t;
+
+// Thread 0 drains the queue, the others post to it.
+static void queue_worker(void *arg, int thread, int num_threads)
+{
+    queue_ctx_t *ctx = (queue_ctx_t *)arg;
+    (void)num_threads;
+
+    if (thread == 0)
+    {
+        uint64_t expected = ctx->per_producer * ctx->producers;
+        for (uint64_t done = 0; done < expected;)
+        {
+            RequestOrResponse *reqres = dequeue(ctx->q);
+            if (reqres == NULL)
+            {
+                cpu_relax();
+                continue;
+            }
+            release_node(ctx->q, reqres);
+            done++;
+        }
+        return;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "producer_%d", thread);
+    for (uint64_t i = 0; i < ctx->per_producer; ++i)
+        post(ctx->q, name, 0);
+}
+
+static void bench_queue()
+{
+    if (!selected("queue_post_dequeue"))
+        return;
+
+    if (memory_block_exists(CONNECT_CHANNEL_FNAME) == 1)
+    {
+        fprintf(stderr, "Skipping queue_post_dequeue: a server seems to be running in this directory.\n");
+        return;
+    }
+
+    queue_t *q = create_queue(DEFAULT_QUEUE_CAPACITY);
+    if (q == NULL)
+    {
+        fprintf(stderr, "Skipping queue_post_dequeue: could not create the queue.\n");
+        return;
+    }
+
+    for (int i = 0; i < config.num_thread_counts; ++i)
+    {
+        queue_ctx_t ctx = {q, scaled(1000000) / config.threads[i], config.threads[i]};
+        uint64_t elapsed = run_parallel(queue_worker, &ctx, config.threads[i] + 1);
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"producers\": %d, \"capacity\": %d", config.threads[i], DEFAULT_QUEUE_CAPACITY);
+        emit_result("queue_post_dequeue", params, config.threads[i], ctx.per_producer * ctx.producers, elapsed);
+    }
+
+    destroy_queue(q);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Client index: insert / validate                                           */
+/* ------------------------------------------------------------------------- */
+
+typedef struct index_ctx_t
+{
+    size_t num_clients;
+    char (*names)[32];
+    uint64_t lookups_per_thread;
+} index_ctx_t;
+
+// Odd multiplier modulo 2^31 is a bijection, so keys are distinct.
+static inline int client_key(size_t i)
+{
+    return (int)((i * 2654435761UL) & 0x7fffffff);
+}
+
+static void index_insert_worker(void *arg, int thread, int num_threads)
+{
+    index_ctx_t *ctx = (index_ctx_t *)arg;
+    for (size_t i = thread; i < ctx->num_clients; i += num_threads)
+        insert_to_client_tree(client_key(i), ctx->names[i]);
+}
+
+static void index_validate_worker(void *arg, int thread, int num_threads)
+{
+    index_ctx_t *ctx = (index_ctx_t *)arg;
+    (void)num_threads;
+
+    uint64_t rng = 88172645463325252ULL + thread;
+    uint64_t ok = 0;
+    for (uint64_t n = 0; n < ctx->lookups_per_thread; ++n)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t i = rng % ctx->num_clients;
+        ok += validate_key_client(client_key(i), ctx->names[i]) == 0;
+    }
+    sink += ok;
+}
+
+static void bench_client_index()
+{
+    static const size_t sizes[] = {1000, 100000, 1000000};
+    bool inserts = selected("index_insert");
+    bool lookups = selected("index_validate");
+    if (!inserts && !lookups)
+        return;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        index_ctx_t ctx = {sizes[s], malloc(sizes[s] * sizeof(*ctx.names)), scaled(2000000)};
+        if (ctx.names == NULL)
+            return;
+        for (size_t i = 0; i < ctx.num_clients; ++i)
+            snprintf(ctx.names[i], sizeof(ctx.names[i]), "client_%zu", i);
+
+        for (int t = 0; t < config.num_thread_counts; ++t)
+        {
+            int threads = config.threads[t];
+            char params[64];
+            snprintf(params, sizeof(params), "\"clients\": %zu", ctx.num_clients);
+
+            init_client_tree();
+            uint64_t elapsed = run_parallel(index_insert_worker, &ctx, threads);
+            if (inserts)
+                emit_result("index_insert", params, threads, ctx.num_clients, elapsed);
+
+            if (get_num_connected_clients() != ctx.num_clients)
+                fprintf(stderr, "WARN: only %zu of %zu clients were indexed.\n", get_num_connected_clients(), ctx.num_clients);
+
+            if (lookups)
+            {
+                elapsed = run_parallel(index_validate_worker, &ctx, threads);
+                emit_result("index_validate", params, threads, ctx.lookups_per_thread * threads, elapsed);
+            }
+
+            destroy_client_tree();
+        }
+
+        free(ctx.names);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* handle_is_prime                                                           */
+/* ------------------------------------------------------------------------- */
+
+typedef struct prime_ctx_t
+{
+    int from;
+    int span;
+    uint64_t calls_per_thread;
+} prime_ctx_t;
+
+static void prime_worker(void *arg, int thread, int num_threads)
+{
+    prime_ctx_t *ctx = (prime_ctx_t *)arg;
+    (void)thread;
+    (void)num_threads;
+
+    Request req = {0};
+    req.request_type = IS_PRIME;
+    uint64_t primes = 0;
+    for (uint64_t n = 0; n < ctx->calls_per_thread; ++n)
+    {
+        req.n1 = ctx->from + (int)(n % ctx->span);
+        primes += handle_is_prime(&no_payload, req).result;
+    }
+    sink += primes;
+}
+
+// Same candidates as prime_worker, through is_prime_batch() a batch chunk
+// at a time.
+static void prime_batch_worker(void *arg, int thread, int num_threads)
+{
+    prime_ctx_t *ctx = (prime_ctx_t *)arg;
+    (void)thread;
+    (void)num_threads;
+
+    uint32_t candidates[BATCH_CHUNK_LEN];
+    bool is_prime[BATCH_CHUNK_LEN];
+    uint64_t primes = 0;
+    for (uint64_t n = 0; n < ctx->calls_per_thread; n += BATCH_CHUNK_LEN)
+    {
+        for (int i = 0; i < BATCH_CHUNK_LEN; ++i)
+            candidates[i] = ctx->from + (int)((n + i) % ctx->span);
+        is_prime_batch(candidates, is_prime, BATCH_CHUNK_LEN);
+        for (int i = 0; i < BATCH_CHUNK_LEN; ++i)
+            primes += is_prime[i];
+    }
+    sink += primes;
+}
+
+static void bench_is_prime()
+{
+    bool single = selected("handle_is_prime");
+    bool batched = selected("is_prime_batch");
+    if (!single && !batched)
+        return;
+
+    static const struct
+    {
+        const char *label;
+        int from;
+        int span;
+        uint64_t calls;
+    } ranges[] = {
+        {"small", 2, 1000, 2000000},
+        {"medium", 1000000, 1000, 500000},
+        {"large", 1000000000, 1000, 50000},
+        {"near_int_max", 2147482647, 1000, 500000},
+    };
+
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r)
+    {
+        for (int t = 0; t < config.num_thread_counts; ++t)
+        {
+            prime_ctx_t ctx = {ranges[r].from, ranges[r].span, scaled(ranges[r].calls)};
+            char params[96];
+            snprintf(params, sizeof(params), "\"range\": \"%s\", \"from\": %d, \"span\": %d", ranges[r].label, ranges[r].from, ranges[r].span);
+
+            if (single)
+            {
+                uint64_t elapsed = run_parallel(prime_worker, &ctx, config.threads[t]);
+                emit_result("handle_is_prime", params, config.threads[t], ctx.calls_per_thread * config.threads[t], elapsed);
+            }
+            if (batched)
+            {
+                uint64_t elapsed = run_parallel(prime_batch_worker, &ctx, config.threads[t]);
+                emit_result("is_prime_batch", params, config.threads[t], ctx.calls_per_thread * config.threads[t], elapsed);
+            }
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* vector_arithmetic()                                                       */
+/* ------------------------------------------------------------------------- */
+
+// About what fits in a default payload region.
+#define VECTOR_BENCH_LANES (4096)
+
+typedef struct vector_ctx_t
+{
+    vector_kernel_t kernel;
+    char op;
+    uint64_t calls_per_thread;
+} vector_ctx_t;
+
+// Each thread works on its own arrays.
+static void vector_worker(void *arg, int thread, int num_threads)
+{
+    vector_ctx_t *ctx = (vector_ctx_t *)arg;
+    (void)thread;
+    (void)num_threads;
+
+    int *a = malloc(3 * VECTOR_BENCH_LANES * sizeof(int));
+    uint8_t errors[VECTOR_BENCH_LANES / 8];
+    if (a == NULL)
+        return;
+    int *b = a + VECTOR_BENCH_LANES, *res = b + VECTOR_BENCH_LANES;
+    for (int i = 0; i < VECTOR_BENCH_LANES; ++i)
+    {
+        a[i] = i * 7919 - 1000000;
+        b[i] = i % 64 - 32;
+    }
+
+    uint64_t failed = 0;
+    for (uint64_t n = 0; n < ctx->calls_per_thread; ++n)
+        failed += ctx->kernel(ctx->op, a, b, res, errors, VECTOR_BENCH_LANES);
+    sink += failed + res[VECTOR_BENCH_LANES - 1];
+    free(a);
+}
+
+static void bench_vector()
+{
+    if (!selected("vector_arithmetic"))
+        return;
+
+    static const char ops[] = {'+', '*', '/'};
+    for (size_t k = 0; k < NUM_VECTOR_KERNELS; ++k)
+    {
+        if (!vector_kernel_supported(vector_kernels[k].name))
+            continue;
+
+        for (size_t o = 0; o < sizeof(ops); ++o)
+        {
+            for (int t = 0; t < config.num_thread_counts; ++t)
+            {
+                vector_ctx_t ctx = {vector_kernels[k].kernel, ops[o], scaled(20000)};
+                uint64_t elapsed = run_parallel(vector_worker, &ctx, config.threads[t]);
+
+                char params[96];
+                snprintf(params, sizeof(params), "\"kernel\": \"%s\", \"op\": \"%c\", \"lanes\": %d", vector_kernels[k].name, ops[o], VECTOR_BENCH_LANES);
+                emit_result("vector_arithmetic", params, config.threads[t], ctx.calls_per_thread * VECTOR_BENCH_LANES * config.threads[t], elapsed);
+            }
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Result cache                                                              */
+/* ------------------------------------------------------------------------- */
+
+typedef struct cache_ctx_t
+{
+    int keys; // distinct IS_PRIME operands cycled through
+    uint64_t calls_per_thread;
+} cache_ctx_t;
+
+static void cache_worker(void *arg, int thread, int num_threads)
+{
+    cache_ctx_t *ctx = (cache_ctx_t *)arg;
+    (void)num_threads;
+
+    Request req = {0};
+    req.request_type = IS_PRIME;
+    uint64_t primes = 0;
+    for (uint64_t n = 0; n < ctx->calls_per_thread; ++n)
+    {
+        req.n1 = 1000000000 + (int)((n * 7919 + thread) % ctx->keys);
+        primes += dispatch_request(&no_payload, req).result;
+    }
+    sink += primes;
+}
+
+// IS_PRIME through the cache with a working set that fits it ("hit") and one
+// that is far larger ("miss"). Compare with handle_is_prime on "large".
+static void bench_result_cache()
+{
+    if (!selected("result_cache"))
+        return;
+
+    static const size_t cache_bytes = 1 << 20;
+    static const struct
+    {
+        const char *path;
+        int keys;
+    } sets[] = {{"hit", 1000}, {"miss", 10000000}};
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); ++s)
+    {
+        for (int t = 0; t < config.num_thread_counts; ++t)
+        {
+            if (init_result_cache(cache_bytes, 1U << IS_PRIME) < 0)
+                return;
+
+            cache_ctx_t ctx = {sets[s].keys, scaled(1000000)};
+            run_parallel(cache_worker, &ctx, config.threads[t]); // warms the cache
+            uint64_t elapsed = run_parallel(cache_worker, &ctx, config.threads[t]);
+            destroy_result_cache();
+
+            char params[96];
+            snprintf(params, sizeof(params), "\"path\": \"%s\", \"keys\": %d, \"cache_bytes\": %zu", sets[s].path, sets[s].keys, cache_bytes);
+            emit_result("result_cache", params, config.threads[t], ctx.calls_per_thread * config.threads[t], elapsed);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* logger()                                                                  */
+/* ------------------------------------------------------------------------- */
+
+typedef struct logger_ctx_t
+{
+    bool enabled;
+    uint64_t calls_per_thread;
+} logger_ctx_t;
+
+static void logger_worker(void *arg, int thread, int num_threads)
+{
+    logger_ctx_t *ctx = (logger_ctx_t *)arg;
+    (void)num_threads;
+
+    if (ctx->enabled)
+        for (uint64_t n = 0; n < ctx->calls_per_thread; ++n)
+            logger("INFO", "microbench message %lu from thread %d with key %d", (unsigned long)n, thread, 42);
+    else
+        for (uint64_t n = 0; n < ctx->calls_per_thread; ++n)
+            logger("DEBUG", "microbench message %lu from thread %d with key %d", (unsigned long)n, thread, 42);
+}
+
+static void bench_logger()
+{
+    if (!selected("logger"))
+        return;
+
+    set_log_level(LOG_LEVEL_INFO);
+    for (int enabled = 1; enabled >= 0; --enabled)
+    {
+        for (int t = 0; t < config.num_thread_counts; ++t)
+        {
+            logger_ctx_t ctx = {enabled, scaled(enabled ? 200000 : 10000000)};
+            uint64_t elapsed = run_parallel(logger_worker, &ctx, config.threads[t]);
+            emit_result("logger", enabled ? "\"level\": \"enabled\"" : "\"level\": \"filtered\"", config.threads[t],
+                        ctx.calls_per_thread * config.threads[t], elapsed);
+        }
+    }
+    set_log_level(LOG_LEVEL_WARN);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Stage handoff ping-pong between two processes                             */
+/* ------------------------------------------------------------------------- */
+
+typedef struct pingpong_ctx_t
+{
+    RequestOrResponse *channels;
+    uint64_t round_trips;
+} pingpong_ctx_t;
+
+// The parent side of each pair: 0 -> 1 here, 1 -> 2 in the child, 2 -> 0 here.
+static void pingpong_worker(void *arg, int thread, int num_threads)
+{
+    pingpong_ctx_t *ctx = (pingpong_ctx_t *)arg;
+    (void)num_threads;
+
+    RequestOrResponse *channel = &ctx->channels[thread];
+    for (uint64_t n = 0; n < ctx->round_trips; ++n)
+    {
+        next_stage(channel);
+        wait_until_stage(channel, 2);
+        next_stage(channel);
+    }
+}
+
+static void bench_pingpong()
+{
+    if (!selected("stage_pingpong"))
+        return;
+
+    int max_pairs = 0;
+    for (int t = 0; t < config.num_thread_counts; ++t)
+        if (config.threads[t] > max_pairs)
+            max_pairs = config.threads[t];
+
+    RequestOrResponse *channels = mmap(NULL, sizeof(RequestOrResponse) * max_pairs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (channels == MAP_FAILED)
+        return;
+
+    for (int spin = 1; spin >= 0; --spin)
+    {
+        set_stage_spin_count(spin ? STAGE_SPIN_COUNT : 0);
+        for (int t = 0; t < config.num_thread_counts; ++t)
+        {
+            int pairs = config.threads[t];
+            pingpong_ctx_t ctx = {channels, scaled(spin ? 200000 : 50000)};
+
+            pid_t children[pairs];
+            for (int p = 0; p < pairs; ++p)
+            {
+                init_comm_channel(&channels[p], "pingpong", p);
+                children[p] = fork();
+                if (children[p] == 0)
+                {
+                    for (uint64_t n = 0; n < ctx.round_trips; ++n)
+                    {
+                        wait_until_stage(&channels[p], 1);
+                        next_stage(&channels[p]);
+                    }
+                    _exit(EXIT_SUCCESS);
+                }
+            }
+
+            uint64_t elapsed = run_parallel(pingpong_worker, &ctx, pairs);
+            for (int p = 0; p < pairs; ++p)
+                waitpid(children[p], NULL, 0);
+
+            char params[64];
+            snprintf(params, sizeof(params), "\"handoff\": \"%s\", \"pairs\": %d", spin ? "spin_then_futex" : "futex", pairs);
+            emit_result("stage_pingpong", params, pairs, ctx.round_trips * pairs, elapsed);
+        }
+    }
+    set_stage_spin_count(STAGE_SPIN_COUNT);
+
+    munmap(channels, sizeof(RequestOrResponse) * max_pairs);
+}
+
+/* ------------------------------------------------------------------------- */
+
+int parse_thread_counts(const char *list)
+{
+    config.num_thread_counts = 0;
+    char buf[128];
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (char *save = NULL, *item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        int n = atoi(item);
+        if (n <= 0 || config.num_thread_counts == MAX_THREAD_COUNTS)
+            return -1;
+        config.threads[config.num_thread_counts++] = n;
+    }
+
+    return config.num_thread_counts > 0 ? 0 : -1;
+}
+
+void usage(const char *prog)
+{
+    printf("Usage: %s [-t <threads,...>] [-f <filter>] [-q] [-o <file>]\n", prog);
+    printf("  -t  thread counts to run each benchmark at (default 1,2,4)\n");
+    printf("  -f  only run benchmarks whose name contains <filter>\n");
+    printf("  -q  quick run with a tenth of the iterations\n");
+    printf("  -o  write the JSON results to <file> instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    parse_thread_counts("1,2,4");
+    const char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:qo:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            if (parse_thread_counts(optarg) < 0)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            config.filter = optarg;
+            break;
+        case 'q':
+            config.quick = true;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Cannot open %s for writing.\n", output);
+        return EXIT_FAILURE;
+    }
+
+    // Only the logger benchmark should pay for logging.
+    if (init_logger("microbench") == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    set_log_level(LOG_LEVEL_WARN);
+    register_builtin_handlers();
+
+    fprintf(out, "{\n  \"compiler\": \"%s\",\n  \"timestamp\": %ld,\n  \"online_cpus\": %ld,\n  \"quick\": %s,\n  \"results\": [",
+            __VERSION__, (long)time(NULL), sysconf(_SC_NPROCESSORS_ONLN), config.quick ? "true" : "false");
+
+    bench_queue();
+    bench_client_index();
+    bench_is_prime();
+    bench_vector();
+    bench_result_cache();
+    bench_logger();
+    bench_pingpong();
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+
+    close_logger();
+    remove_file("microbench.log");
+    return EXIT_SUCCESS;
+}
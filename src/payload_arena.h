@@ -0,0 +1,117 @@
+#ifndef PAYLOAD_ARENA_H
+#define PAYLOAD_ARENA_H
+
+#include <stddef.h>
+
+#include "shared_memory.h"
+#include "logger.h"
+
+#define PAYLOAD_ARENA_FNAME "srv_payload_arena"
+
+// Upper bound on a channel's payload region unless the server is started
+// with another one.
+#define DEFAULT_PAYLOAD_REGION_SIZE (64 * 1024)
+
+// Payload offsets and lengths are kept aligned to this, so that handlers can
+// read ints and doubles in place.
+#define PAYLOAD_ALIGNMENT (64)
+
+// One shared block holding a payload region per channel slot, for request
+// and response data that does not fit in Request and Response. Clients write
+// input in place and pass its offset and length in the Request; handlers
+// read it and write their output in place, so nothing is copied.
+//
+// Regions have a fixed stride and belong to the channel slot with the same
+// index. Like the channel arena, pages are only touched once a client writes
+// to them, so the stride costs address space rather than memory.
+typedef struct payload_arena_t
+{
+    size_t num_regions;
+    size_t region_size;
+    size_t regions_offset;
+} payload_arena_t;
+
+static inline size_t payload_region_offset(payload_arena_t *arena, int slot)
+{
+    return arena->regions_offset + slot * arena->region_size;
+}
+
+static inline void *payload_region(payload_arena_t *arena, int slot)
+{
+    return (char *)arena + payload_region_offset(arena, slot);
+}
+
+// What a client asking for `requested` bytes is granted: the request rounded
+// up to PAYLOAD_ALIGNMENT, capped at the region size.
+static inline size_t payload_grant(payload_arena_t *arena, size_t requested)
+{
+    if (arena == NULL || requested == 0)
+        return 0;
+
+    size_t granted = (requested + PAYLOAD_ALIGNMENT - 1) & ~(size_t)(PAYLOAD_ALIGNMENT - 1);
+    return granted < arena->region_size ? granted : arena->region_size;
+}
+
+payload_arena_t *create_payload_arena(size_t num_regions, size_t region_size)
+{
+    logger("DEBUG", "Initialising payload arena");
+    region_size = (region_size + 4095) & ~(size_t)4095;
+
+    size_t regions_offset = (sizeof(payload_arena_t) + 4095) & ~(size_t)4095;
+    size_t size = regions_offset + num_regions * region_size;
+
+    prepare_memory_block_name(PAYLOAD_ARENA_FNAME);
+    payload_arena_t *arena = (payload_arena_t *)attach_memory_block(PAYLOAD_ARENA_FNAME, size);
+    if (arena == NULL)
+    {
+        logger("ERROR", "Could not create shared memory block for the payload arena.");
+        return NULL;
+    }
+
+    arena->num_regions = num_regions;
+    arena->region_size = region_size;
+    arena->regions_offset = regions_offset;
+
+    logger("INFO", "Payload arena creation succesful with %zu regions of %zu bytes", num_regions, region_size);
+    return arena;
+}
+
+payload_arena_t *get_payload_arena()
+{
+    // The whole block is mapped, so the header size is enough to find it.
+    payload_arena_t *arena = (payload_arena_t *)attach_memory_block(PAYLOAD_ARENA_FNAME, sizeof(payload_arena_t));
+    if (arena == NULL)
+    {
+        logger("ERROR", "Could not attach the payload arena.");
+        return NULL;
+    }
+
+    return arena;
+}
+
+// Client side: locates the region handed out at registration.
+void *get_payload(payload_arena_t *arena, size_t payload_offset, size_t payload_size)
+{
+    size_t end = arena->regions_offset + arena->num_regions * arena->region_size;
+    if (payload_offset < arena->regions_offset || payload_offset + payload_size > end)
+    {
+        logger("ERROR", "Payload region at %zu lies outside the payload arena.", payload_offset);
+        return NULL;
+    }
+
+    return (char *)arena + payload_offset;
+}
+
+int destroy_payload_arena(payload_arena_t *arena)
+{
+    logger("INFO", "Starting payload arena cleanup");
+
+    detach_memory_block(arena);
+    destroy_memory_block(PAYLOAD_ARENA_FNAME);
+    release_memory_block_name(PAYLOAD_ARENA_FNAME);
+
+    logger("INFO", "Completed payload arena cleanup");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef PRIMALITY_H
+#define PRIMALITY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "prime_sieve.h"
+
+// Primality tests behind IS_PRIME. Small numbers are looked up in a bitset,
+// and so is anything below the limit of a loaded sieve file. Everything else
+// is screened by trial division by a few small primes and then settled with
+// deterministic Miller-Rabin.
+
+// Odd numbers below this are answered from prime_bitset.
+#define PRIME_BITSET_LIMIT (1U << 16)
+
+// Candidates are trial-divided by the small primes below this before running
+// Miller-Rabin, which rejects about 85% of composites for a few divisions.
+#define PRIME_TRIAL_LIMIT (64)
+
+// Candidates whose exponentiations are interleaved by is_prime_batch().
+#define PRIME_BATCH_LANES (4)
+
+// Every prime below 2^8, enough to sieve the bitset up to 2^16.
+static const uint16_t small_primes[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71,
+    73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151,
+    157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233,
+    239, 241, 251};
+#define NUM_SMALL_PRIMES (sizeof(small_primes) / sizeof(small_primes[0]))
+
+// Bit i is set if 2i + 1 is prime.
+static uint64_t prime_bitset[PRIME_BITSET_LIMIT / 128];
+
+// Sieves the bitset when the program is loaded, so lookups need no
+// initialisation check.
+__attribute__((constructor)) static void init_prime_bitset()
+{
+    for (uint32_t i = 0; i < PRIME_BITSET_LIMIT / 128; ++i)
+        prime_bitset[i] = ~0ULL;
+    prime_bitset[0] &= ~1ULL; // 1 is not prime
+
+    for (uint32_t k = 1; k < NUM_SMALL_PRIMES; ++k)
+    {
+        uint32_t p = small_primes[k];
+        for (uint32_t m = p * p; m < PRIME_BITSET_LIMIT; m += 2 * p)
+            prime_bitset[m >> 7] &= ~(1ULL << ((m >> 1) & 63));
+    }
+}
+
+static inline bool bitset_is_prime(uint32_t n)
+{
+    if ((n & 1) == 0)
+        return n == 2;
+    return (prime_bitset[n >> 7] >> ((n >> 1) & 63)) & 1;
+}
+
+// Whether odd n has a factor below PRIME_TRIAL_LIMIT. Only meant for n above
+// the bitset, which cannot be one of those factors itself.
+static inline bool has_small_factor(uint64_t n)
+{
+    for (uint32_t k = 1; small_primes[k] < PRIME_TRIAL_LIMIT; ++k)
+        if (n % small_primes[k] == 0)
+            return true;
+    return false;
+}
+
+/* 32-bit Montgomery arithmetic, for the Miller-Rabin rounds on odd n. */
+
+typedef struct mont32_t
+{
+    uint32_t n;
+    uint32_t n_inv; // n^-1 mod 2^32
+    uint32_t r2;    // 2^64 mod n
+    uint32_t one;   // 1 in Montgomery form
+} mont32_t;
+
+static inline mont32_t mont32_init(uint32_t n)
+{
+    mont32_t m;
+    m.n = n;
+
+    // Newton's iteration doubles the correct low bits: 3, 6, 12, 24, 48.
+    uint32_t inv = n;
+    for (int i = 0; i < 4; ++i)
+        inv *= 2 - n * inv;
+    m.n_inv = inv;
+
+    uint64_t r = (1ULL << 32) % n;
+    m.one = (uint32_t)r;
+    m.r2 = (uint32_t)(r * r % n);
+    return m;
+}
+
+// a * b * 2^-32 mod n, for a, b < n. Subtracts instead of adding m * n so
+// that nothing overflows for n up to 2^32.
+static inline uint32_t mont32_mul(const mont32_t *m, uint32_t a, uint32_t b)
+{
+    uint64_t t = (uint64_t)a * b;
+    uint32_t q = (uint32_t)t * m->n_inv;
+    uint32_t hi = (uint32_t)(t >> 32);
+    uint32_t qn_hi = (uint32_t)(((uint64_t)q * m->n) >> 32);
+    uint32_t r = hi - qn_hi;
+    return hi < qn_hi ? r + m->n : r;
+}
+
+static inline uint32_t mont32_from(const mont32_t *m, uint32_t a)
+{
+    return mont32_mul(m, a % m->n, m->r2);
+}
+
+// Witnesses that make Miller-Rabin exact below 4,759,123,141 (Jaeschke).
+static const uint32_t mr_witnesses_32[] = {2, 7, 61};
+#define NUM_MR_WITNESSES_32 (sizeof(mr_witnesses_32) / sizeof(mr_witnesses_32[0]))
+
+// One Miller-Rabin round: false if `a` proves n composite.
+static inline bool mr_round_32(const mont32_t *m, uint32_t a, uint32_t d, int s)
+{
+    uint32_t minus_one = m->n - m->one;
+    uint32_t base = mont32_from(m, a);
+    uint32_t x = m->one;
+
+    for (int bit = 31 - __builtin_clz(d); bit >= 0; --bit)
+    {
+        x = mont32_mul(m, x, x);
+        if ((d >> bit) & 1)
+            x = mont32_mul(m, x, base);
+    }
+
+    if (x == m->one || x == minus_one)
+        return true;
+    for (int r = 1; r < s; ++r)
+    {
+        x = mont32_mul(m, x, x);
+        if (x == minus_one)
+            return true;
+    }
+    return false;
+}
+
+bool is_prime_u32(uint32_t n)
+{
+    if (n < PRIME_BITSET_LIMIT)
+        return bitset_is_prime(n);
+    if (sieve_covers(n))
+        return sieve_is_prime(n);
+    if ((n & 1) == 0)
+        return false;
+
+    if (has_small_factor(n))
+        return false;
+
+    int s = __builtin_ctz(n - 1);
+    uint32_t d = (n - 1) >> s;
+    mont32_t m = mont32_init(n);
+    for (uint32_t w = 0; w < NUM_MR_WITNESSES_32; ++w)
+        if (!mr_round_32(&m, mr_witnesses_32[w], d, s))
+            return false;
+    return true;
+}
+
+/* 64-bit inputs. Not reachable from the protocol yet, whose operands are
+ * ints, but the witness set below keeps the test exact over the full range. */
+
+static inline uint64_t mulmod_u64(uint64_t a, uint64_t b, uint64_t n)
+{
+    return (uint64_t)((unsigned __int128)a * b % n);
+}
+
+// Witnesses that make Miller-Rabin exact below 2^64 (Sinclair).
+static const uint64_t mr_witnesses_64[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+#define NUM_MR_WITNESSES_64 (sizeof(mr_witnesses_64) / sizeof(mr_witnesses_64[0]))
+
+bool is_prime_u64(uint64_t n)
+{
+    if (n <= UINT32_MAX)
+        return is_prime_u32((uint32_t)n);
+    if ((n & 1) == 0)
+        return false;
+
+    if (has_small_factor(n))
+        return false;
+
+    int s = __builtin_ctzll(n - 1);
+    uint64_t d = (n - 1) >> s;
+    for (uint32_t w = 0; w < NUM_MR_WITNESSES_64; ++w)
+    {
+        uint64_t a = mr_witnesses_64[w] % n;
+        if (a == 0)
+            continue;
+
+        uint64_t x = 1, base = a;
+        for (uint64_t e = d; e; e >>= 1)
+        {
+            if (e & 1)
+                x = mulmod_u64(x, base, n);
+            base = mulmod_u64(base, base, n);
+        }
+
+        if (x == 1 || x == n - 1)
+            continue;
+        int r = 1;
+        for (; r < s; ++r)
+        {
+            x = mulmod_u64(x, x, n);
+            if (x == n - 1)
+                break;
+        }
+        if (r == s)
+            return false;
+    }
+    return true;
+}
+
+/* Batched test. A single exponentiation is a chain of dependent multiplies,
+ * so most of its time is multiply latency; running PRIME_BATCH_LANES
+ * independent chains in lockstep lets them overlap. A lane holds one
+ * (candidate, witness) round and is refilled as soon as it finishes, so a
+ * composite rejected by its first witness does not hold a lane for the
+ * rounds its neighbours still need. */
+
+typedef struct mr_lane_t
+{
+    mont32_t m;
+    uint32_t d;
+    int s;
+    int candidate; // index into the batch, or -1 if the lane is idle
+    uint32_t witness;
+} mr_lane_t;
+
+// Runs the current witness of every lane. Idle lanes compute on whatever
+// they held last; their results are ignored. Returns a bit per lane that
+// survived its round.
+static unsigned mr_round_32_lanes(const mr_lane_t *lane)
+{
+    uint32_t x[PRIME_BATCH_LANES], base[PRIME_BATCH_LANES], minus_one[PRIME_BATCH_LANES];
+    bool done[PRIME_BATCH_LANES];
+    uint32_t all_d = 0;
+    int max_s = 0;
+
+    for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+    {
+        x[i] = lane[i].m.one;
+        base[i] = mont32_from(&lane[i].m, mr_witnesses_32[lane[i].witness]);
+        minus_one[i] = lane[i].m.n - lane[i].m.one;
+        all_d |= lane[i].d;
+        if (lane[i].s > max_s)
+            max_s = lane[i].s;
+    }
+
+    // Leading zero bits of a shorter exponent only square the 1 the lane
+    // started from, so all lanes can walk the longest exponent.
+    for (int bit = 31 - __builtin_clz(all_d); bit >= 0; --bit)
+        for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        {
+            x[i] = mont32_mul(&lane[i].m, x[i], x[i]);
+            uint32_t y = mont32_mul(&lane[i].m, x[i], base[i]);
+            x[i] = (lane[i].d >> bit) & 1 ? y : x[i];
+        }
+
+    for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        done[i] = x[i] == lane[i].m.one || x[i] == minus_one[i];
+
+    for (int r = 1; r < max_s; ++r)
+        for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        {
+            if (done[i] || r >= lane[i].s)
+                continue;
+            x[i] = mont32_mul(&lane[i].m, x[i], x[i]);
+            done[i] = x[i] == minus_one[i];
+        }
+
+    unsigned passed = 0;
+    for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        passed |= (unsigned)done[i] << i;
+    return passed;
+}
+
+// Sets is_prime[i] for each of the `count` candidates.
+void is_prime_batch(const uint32_t *n, bool *is_prime, int count)
+{
+    mr_lane_t lane[PRIME_BATCH_LANES];
+    int active = 0;
+    int next = 0;
+
+    for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        lane[i] = (mr_lane_t){.candidate = -1};
+
+    for (;;)
+    {
+        // Refill idle lanes with the next candidates that need Miller-Rabin.
+        for (int i = 0; i < PRIME_BATCH_LANES && next < count; ++i)
+        {
+            if (lane[i].candidate >= 0)
+                continue;
+
+            for (; next < count; ++next)
+            {
+                uint32_t c = n[next];
+                if (c < PRIME_BITSET_LIMIT)
+                    is_prime[next] = bitset_is_prime(c);
+                else if (sieve_covers(c))
+                    is_prime[next] = sieve_is_prime(c);
+                else if ((c & 1) == 0 || has_small_factor(c))
+                    is_prime[next] = false;
+                else
+                    break;
+            }
+            if (next == count)
+                break;
+
+            uint32_t c = n[next];
+            lane[i].m = mont32_init(c);
+            lane[i].s = __builtin_ctz(c - 1);
+            lane[i].d = (c - 1) >> lane[i].s;
+            lane[i].candidate = next++;
+            lane[i].witness = 0;
+            active++;
+        }
+
+        if (active == 0)
+            return;
+
+        // Nothing to overlap with: finish the last candidate on its own.
+        if (active == 1 && next == count)
+        {
+            for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+            {
+                mr_lane_t *l = &lane[i];
+                if (l->candidate < 0)
+                    continue;
+
+                bool survived = true;
+                for (; survived && l->witness < NUM_MR_WITNESSES_32; ++l->witness)
+                    survived = mr_round_32(&l->m, mr_witnesses_32[l->witness], l->d, l->s);
+                is_prime[l->candidate] = survived;
+            }
+            return;
+        }
+
+        // Idle lanes must still hold a valid modulus for the round.
+        for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+            if (lane[i].candidate < 0 && lane[i].m.n == 0)
+            {
+                for (int j = 0; j < PRIME_BATCH_LANES; ++j)
+                    if (lane[j].candidate >= 0)
+                    {
+                        lane[i] = lane[j];
+                        lane[i].candidate = -1;
+                        break;
+                    }
+            }
+
+        unsigned passed = mr_round_32_lanes(lane);
+        for (int i = 0; i < PRIME_BATCH_LANES; ++i)
+        {
+            if (lane[i].candidate < 0)
+                continue;
+
+            bool survived = (passed >> i) & 1;
+            if (survived && ++lane[i].witness < NUM_MR_WITNESSES_32)
+                continue;
+
+            // Idle lanes still load their witness next round.
+            is_prime[lane[i].candidate] = survived;
+            lane[i].candidate = -1;
+            lane[i].witness = 0;
+            active--;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef PRIME_SIEVE_H
+#define PRIME_SIEVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+// Precomputed primality of every n below a limit, as a file of one bit per
+// odd number. The server maps it read-only, so IS_PRIME below the limit is a
+// single bit test and every process using the file shares its page cache.
+
+#define SIEVE_MAGIC "CCSSIEVE"
+#define SIEVE_VERSION (1)
+#define SIEVE_MAX_LIMIT (1ULL << 32)
+#define SIEVE_DEFAULT_LIMIT (1ULL << 31) // covers every int operand
+#define SIEVE_DEFAULT_FNAME "primes.sieve"
+
+// Odd numbers covered by one segment: 32 KiB of bits, so that a segment
+// stays in cache while every base prime crosses it off.
+#define SIEVE_SEGMENT_WORDS (4096)
+#define SIEVE_SEGMENT_BITS (SIEVE_SEGMENT_WORDS * 64)
+
+// The bits start one page in, so that they can be mapped page aligned.
+#define SIEVE_HEADER_SIZE (4096)
+
+typedef struct sieve_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t limit;     // numbers below this are covered
+    uint64_t num_words; // bit i of the bitset is set if 2i + 1 is prime
+} sieve_header_t;
+
+// The loaded sieve, if any. sieve_limit is 0 until one is loaded.
+static const uint64_t *sieve_bits;
+static uint64_t sieve_limit;
+
+static inline bool sieve_covers(uint64_t n)
+{
+    return n < sieve_limit;
+}
+
+static inline bool sieve_is_prime(uint64_t n)
+{
+    if ((n & 1) == 0)
+        return n == 2;
+    return (sieve_bits[n >> 7] >> ((n >> 1) & 63)) & 1;
+}
+
+// Maps the sieve file read-only and makes is_prime_u32() use it. Pages are
+// read on first use, so loading costs nothing up front.
+int load_sieve_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        logger("ERROR", "Could not open sieve file %s.", path);
+        return -1;
+    }
+
+    struct stat st;
+    sieve_header_t header;
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, SIEVE_MAGIC, sizeof(header.magic)) != 0 || header.version != SIEVE_VERSION ||
+        header.limit > SIEVE_MAX_LIMIT || header.num_words < (header.limit + 127) / 128 ||
+        (uint64_t)st.st_size < SIEVE_HEADER_SIZE + header.num_words * sizeof(uint64_t))
+    {
+        logger("ERROR", "%s is not a valid sieve file.", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = SIEVE_HEADER_SIZE + header.num_words * sizeof(uint64_t);
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        logger("ERROR", "Could not map sieve file %s.", path);
+        return -1;
+    }
+    madvise(map, size, MADV_RANDOM);
+
+    sieve_bits = (const uint64_t *)((char *)map + SIEVE_HEADER_SIZE);
+    __atomic_store_n(&sieve_limit, header.limit, __ATOMIC_RELEASE);
+    logger("INFO", "Loaded sieve file %s covering n < %lu", path, (unsigned long)header.limit);
+    return 0;
+}
+
+/* Generation */
+
+typedef struct sieve_build_t
+{
+    uint64_t *bits;
+    uint64_t num_words;
+    uint64_t limit;
+    const uint32_t *base_primes; // odd primes up to sqrt(limit)
+    size_t num_base_primes;
+    uint64_t next_segment; // handed out to threads
+    uint64_t num_segments;
+} sieve_build_t;
+
+// Crosses off the odd composites in segment `seg`, which covers the odd
+// numbers from 2 * seg * SIEVE_SEGMENT_BITS + 1 on.
+static void sieve_segment(sieve_build_t *b, uint64_t seg)
+{
+    uint64_t first_word = seg * SIEVE_SEGMENT_WORDS;
+    uint64_t words = b->num_words - first_word < SIEVE_SEGMENT_WORDS ? b->num_words - first_word : SIEVE_SEGMENT_WORDS;
+    uint64_t *w = b->bits + first_word;
+    memset(w, 0xff, words * sizeof(uint64_t));
+
+    uint64_t lo = 2 * first_word * 64 + 1;    // first odd number of the segment
+    uint64_t hi = lo + 2 * words * 64;        // past its last one
+    for (size_t k = 0; k < b->num_base_primes; ++k)
+    {
+        uint64_t p = b->base_primes[k];
+        if (p * p >= hi)
+            break;
+
+        uint64_t m = p * p;
+        if (m < lo)
+        {
+            m = (lo + p - 1) / p * p;
+            if ((m & 1) == 0)
+                m += p;
+        }
+        for (uint64_t i = (m - lo) >> 1; i < words * 64; i += p)
+            w[i >> 6] &= ~(1ULL << (i & 63));
+    }
+
+    if (seg == 0)
+        w[0] &= ~1ULL; // 1 is not prime
+
+    // Clear what lies past the limit in the last word.
+    if (first_word + words == b->num_words)
+    {
+        uint64_t valid = (b->limit + 1) / 2 - (b->num_words - 1) * 64; // odd numbers below limit in the last word
+        if (valid < 64)
+            w[words - 1] &= (1ULL << valid) - 1;
+    }
+}
+
+static void *sieve_thread(void *arg)
+{
+    sieve_build_t *b = (sieve_build_t *)arg;
+    uint64_t seg;
+    while ((seg = __atomic_fetch_add(&b->next_segment, 1, __ATOMIC_RELAXED)) < b->num_segments)
+        sieve_segment(b, seg);
+    return NULL;
+}
+
+// Writes a sieve of every n below `limit` to `path`, sieving segments on
+// `num_threads` threads. The file is built under a temporary name and renamed
+// into place, so readers never see a partial one.
+int build_sieve_file(const char *path, uint64_t limit, int num_threads)
+{
+    if (limit < 3 || limit > SIEVE_MAX_LIMIT)
+    {
+        logger("ERROR", "Sieve limit must be between 3 and 2^32.");
+        return -1;
+    }
+    if (num_threads < 1)
+        num_threads = 1;
+
+    // Base primes with a plain sieve up to sqrt(limit).
+    uint32_t root = 1;
+    while ((uint64_t)root * root < limit)
+        ++root;
+    char *composite = calloc(root + 1, 1);
+    uint32_t *base_primes = malloc((root / 2 + 1) * sizeof(uint32_t));
+    if (composite == NULL || base_primes == NULL)
+    {
+        free(composite);
+        free(base_primes);
+        return -1;
+    }
+    size_t num_base_primes = 0;
+    for (uint32_t i = 3; i <= root; i += 2)
+    {
+        if (composite[i])
+            continue;
+        base_primes[num_base_primes++] = i;
+        for (uint64_t j = (uint64_t)i * i; j <= root; j += 2 * i)
+            composite[j] = 1;
+    }
+    free(composite);
+
+    uint64_t num_words = (limit + 127) / 128;
+    size_t size = SIEVE_HEADER_SIZE + num_words * sizeof(uint64_t);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, getpid());
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1)
+    {
+        logger("ERROR", "Could not create %s.", tmp_path);
+        if (fd != -1)
+            close(fd);
+        free(base_primes);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        logger("ERROR", "Could not map %s.", tmp_path);
+        unlink(tmp_path);
+        free(base_primes);
+        return -1;
+    }
+
+    sieve_build_t build = {(uint64_t *)((char *)map + SIEVE_HEADER_SIZE), num_words, limit, base_primes, num_base_primes,
+                           0, (num_words + SIEVE_SEGMENT_WORDS - 1) / SIEVE_SEGMENT_WORDS};
+    // The caller is one of the threads, and finishes alone if no other started.
+    pthread_t tids[num_threads];
+    int started = 0;
+    for (; started < num_threads - 1; ++started)
+        if (pthread_create(&tids[started], NULL, sieve_thread, &build) != 0)
+            break;
+    sieve_thread(&build);
+    for (int t = 0; t < started; ++t)
+        pthread_join(tids[t], NULL);
+    free(base_primes);
+
+    sieve_header_t *header = (sieve_header_t *)map;
+    memcpy(header->magic, SIEVE_MAGIC, sizeof(header->magic));
+    header->version = SIEVE_VERSION;
+    header->limit = limit;
+    header->num_words = num_words;
+
+    int res = msync(map, size, MS_SYNC);
+    munmap(map, size);
+    if (res == -1 || rename(tmp_path, path) == -1)
+    {
+        logger("ERROR", "Could not write %s.", path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
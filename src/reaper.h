@@ -0,0 +1,186 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "logger.h"
+#include "common_structs.h"
+#include "conn_chanel.h"
+#include "client_tree.h"
+#include "worker_pool.h"
+#include "stats.h"
+
+// Reclaims what a client that exited without unregistering held: its channel
+// slot (and with it its payload region), its client index entry and, if it
+// died before releasing it, its registration slot.
+//
+// Every registered client is watched through a pidfd, which becomes readable
+// when the process exits. The reaper thread waits on all of them in one epoll
+// set. A channel whose request is still being served (stage 1, or claimed off
+// its request ring) is retried until the worker has answered it.
+
+#define REAPER_RETRY_MS (100)
+#define REAPER_MAX_EVENTS (64)
+
+static int reaper_epoll = -1;
+static queue_t *reaper_queue;
+
+// Slots of dead clients that could not be reclaimed yet. Only the reaper
+// thread touches it.
+static unsigned long reaper_retry[READY_SET_WORDS];
+
+// Returns a pidfd for `pid`, or -1 with errno set: ESRCH if the process has
+// already exited, ENOSYS if the kernel has no pidfds.
+int open_client_pidfd(int pid)
+{
+    if (pid <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static inline bool pidfd_exited(int pidfd)
+{
+    struct pollfd pfd = {pidfd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Starts reporting the exit of the client published on `slot` with `pidfd`.
+// One-shot, so that a client that is being retried does not wake the reaper
+// again.
+void watch_channel(int slot, int pidfd)
+{
+    if (reaper_epoll < 0 || pidfd < 0)
+        return;
+
+    // Under the lock the pidfd cannot be closed by an unregistration racing
+    // with us. If the client unregistered already, the slot holds another
+    // pidfd or none; one with the same number belongs to the slot's new
+    // client, which watches it itself.
+    pthread_mutex_lock(&channel_owner_lock);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.u32 = (uint32_t)slot};
+    if (channel_table[slot].pidfd == pidfd && epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, pidfd, &ev) == -1 && errno != EEXIST)
+        logger("WARN", "Could not watch the client on slot %d.", slot);
+    pthread_mutex_unlock(&channel_owner_lock);
+}
+
+// Reclaims the slot if its client has exited. Returns false if the client is
+// dead but its last request is still being served.
+static bool reap_channel(int slot)
+{
+    ChannelEntry *entry = &channel_table[slot];
+    bool done = true;
+
+    pthread_mutex_lock(&channel_owner_lock);
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+
+    // The pidfd identifies the current owner: if the slot changed hands since
+    // the event, the new client is alive and this is a no-op.
+    if (comm_reqres == NULL || entry->pidfd < 0 || !pidfd_exited(entry->pidfd))
+        goto out;
+
+    // Requests the dead client left unclaimed are dropped, but those a worker
+    // claimed still have to be answered. Its pipelined requests are closed
+    // first, so that we never wait with its single request claimed by us.
+    if (load_stage(comm_reqres) == STAGE_CLAIMED || close_request_ring(entry) > 0 ||
+        (load_stage(comm_reqres) == 1 && !claim_stage(comm_reqres)))
+    {
+        done = false;
+        goto out;
+    }
+
+    logger("INFO", "Reclaiming the channel of client %s (pid %d), which exited without unregistering",
+           entry->client_name, entry->client_pid);
+
+    remove_from_client_tree(entry->key);
+    pthread_mutex_destroy(&comm_reqres->lock);
+
+    RequestOrResponse *conn_reqres = registration_slot(reaper_queue, entry->registration_slot);
+    if (__atomic_load_n(&conn_reqres->client_pid, __ATOMIC_SEQ_CST) == entry->client_pid)
+        release_node(reaper_queue, conn_reqres);
+
+    release_channel_slot_locked(slot);
+    stats_add(reaped, 1);
+
+out:
+    pthread_mutex_unlock(&channel_owner_lock);
+    return done;
+}
+
+static void *reaper_function(void *args)
+{
+    (void)args;
+    struct epoll_event events[REAPER_MAX_EVENTS];
+    bool retrying = false;
+
+    while (true)
+    {
+        int n = epoll_wait(reaper_epoll, events, REAPER_MAX_EVENTS, retrying ? REAPER_RETRY_MS : -1);
+        if (n < 0 && errno != EINTR)
+        {
+            logger("ERROR", "Reaper could not wait for clients. Dead clients are no longer reclaimed.");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            int slot = (int)events[i].data.u32;
+            reaper_retry[slot / 64] |= 1UL << (slot % 64);
+        }
+
+        retrying = false;
+        for (int word = 0; word < READY_SET_WORDS; ++word)
+        {
+            for (unsigned long bits = reaper_retry[word]; bits; bits &= bits - 1)
+            {
+                int slot = word * 64 + __builtin_ctzl(bits);
+                if (reap_channel(slot))
+                    reaper_retry[word] &= ~(1UL << (slot % 64));
+                else
+                    retrying = true;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Starts the reaper thread. Without it the server still runs, but slots of
+// clients that die without unregistering stay taken.
+int start_reaper(queue_t *q)
+{
+    reaper_queue = q;
+    reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper_epoll == -1)
+    {
+        logger("ERROR", "Could not create the reaper's epoll set.");
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reaper_function, NULL) != 0)
+    {
+        logger("ERROR", "Could not start the reaper thread.");
+        close(reaper_epoll);
+        reaper_epoll = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    logger("INFO", "Started the reaper");
+    return 0;
+}
+
+#endif
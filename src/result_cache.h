@@ -0,0 +1,378 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common_structs.h"
+#include "logger.h"
+#include "stats.h"
+#include "handler_registry.h"
+
+// Server-wide cache of responses to pure request types, keyed on
+// (request_type, n1, n2, op). Split into shards with a lock each; within a
+// shard entries are evicted with CLOCK. A request that misses while an
+// identical one is being computed waits for that answer instead of
+// computing it again (single-flight).
+
+#define RESULT_CACHE_SHARDS (64)
+#define RESULT_CACHE_DEFAULT_BYTES (8 * 1024 * 1024)
+
+#define CACHE_NO_ENTRY (-1)
+
+typedef enum CacheEntryState
+{
+    CACHE_EMPTY,
+    CACHE_PENDING, // being computed by the worker that inserted it
+    CACHE_READY
+} CacheEntryState;
+
+typedef struct cache_entry_t
+{
+    RequestType type;
+    int n1, n2;
+    char op;
+    unsigned char state;
+    unsigned char referenced; // CLOCK bit, set on every hit
+    int next;                 // next entry in the same bucket
+    Response res;
+} cache_entry_t;
+
+typedef struct cache_shard_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // broadcast when a pending entry is filled in
+    cache_entry_t *entries;
+    int *buckets;
+    unsigned int bucket_mask;
+    int capacity;
+    int used;
+    int hand;
+} __attribute__((aligned(64))) cache_shard_t;
+
+typedef Response (*compute_fn_t)(Request req);
+
+static cache_shard_t *cache_shards;
+static unsigned int cached_types; // 1 << type of the types cached
+_Static_assert(MAX_REQUEST_TYPES <= sizeof(unsigned int) * 8, "cached_types has a bit per request type");
+
+// The builtins known to read n1 only are keyed on it, so that stray values in
+// the unused fields still hit. Any other handler may read n1, n2 and op.
+static inline Request cache_key(Request req)
+{
+    Request key = {0};
+    key.request_type = req.request_type;
+    key.n1 = req.n1;
+    if (req.request_type != EVEN_OR_ODD && req.request_type != IS_PRIME && req.request_type != IS_NEGATIVE)
+    {
+        key.n2 = req.n2;
+        key.op = req.op;
+    }
+    return key;
+}
+
+static inline uint64_t cache_hash(const Request *key)
+{
+    uint64_t h = ((uint64_t)(uint32_t)key->n1 << 32) | (uint32_t)key->n2;
+    h ^= ((uint64_t)key->request_type << 8 | (unsigned char)key->op) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline bool cache_entry_matches(const cache_entry_t *e, const Request *key)
+{
+    return e->type == key->request_type && e->n1 == key->n1 && e->n2 == key->n2 && e->op == key->op;
+}
+
+static inline cache_shard_t *cache_shard_of(uint64_t hash)
+{
+    return &cache_shards[hash % RESULT_CACHE_SHARDS];
+}
+
+static inline int *cache_bucket_of(cache_shard_t *shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / RESULT_CACHE_SHARDS) & shard->bucket_mask];
+}
+
+// Parses a comma-separated list of arith, even, prime, negative, names of
+// registered handlers or request type numbers into `types`, a mask of
+// 1 << request type. "none" caches nothing. Returns -1 on unknown names.
+// Handlers must be registered first.
+//
+// Caching costs a lock round trip, more than cheap handlers themselves, so
+// without a list only expensive handlers are cached (default_cached_types()).
+int parse_cached_types(const char *list, unsigned int *types)
+{
+    static const struct
+    {
+        const char *name;
+        RequestType type;
+    } names[] = {{"arith", ARITHMETIC}, {"even", EVEN_OR_ODD}, {"prime", IS_PRIME}, {"negative", IS_NEGATIVE}};
+
+    *types = 0;
+    if (strcmp(list, "none") == 0)
+        return 0;
+
+    char buf[256];
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    unsigned int mask = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        size_t i = 0;
+        while (i < sizeof(names) / sizeof(names[0]) && strcmp(names[i].name, item) != 0)
+            ++i;
+        if (i < sizeof(names) / sizeof(names[0]))
+        {
+            mask |= 1U << names[i].type;
+            continue;
+        }
+
+        const request_handler_t *handler = find_handler_by_name(item);
+        char *end;
+        long type = handler != NULL ? handler->type : strtol(item, &end, 10);
+        if ((handler == NULL && *end != '\0') || find_handler(type) == NULL)
+            return -1;
+        mask |= 1U << type;
+    }
+    *types = mask;
+    return 0;
+}
+
+// Sizes the cache to about `max_bytes` and caches the types in `types`, a
+// mask of 1 << RequestType. A zero size or mask leaves it disabled.
+int init_result_cache(size_t max_bytes, unsigned int types)
+{
+    size_t per_entry = sizeof(cache_entry_t) + 2 * sizeof(int); // the entry and its share of buckets
+    size_t per_shard = max_bytes / RESULT_CACHE_SHARDS / per_entry;
+    if (per_shard == 0 || types == 0)
+    {
+        logger("INFO", "Result cache disabled");
+        return 0;
+    }
+
+    unsigned int num_buckets = 1;
+    while (num_buckets < per_shard)
+        num_buckets <<= 1;
+
+    cache_shard_t *shards = aligned_alloc(64, sizeof(cache_shard_t) * RESULT_CACHE_SHARDS);
+    if (shards == NULL)
+    {
+        logger("ERROR", "Could not allocate the result cache.");
+        return -1;
+    }
+
+    for (int s = 0; s < RESULT_CACHE_SHARDS; ++s)
+    {
+        cache_shard_t *shard = &shards[s];
+        shard->entries = calloc(per_shard, sizeof(cache_entry_t));
+        shard->buckets = malloc(num_buckets * sizeof(int));
+        if (shard->entries == NULL || shard->buckets == NULL)
+        {
+            logger("ERROR", "Could not allocate the result cache.");
+            for (int i = 0; i <= s; ++i)
+            {
+                free(shards[i].entries);
+                free(shards[i].buckets);
+            }
+            free(shards);
+            return -1;
+        }
+
+        for (unsigned int b = 0; b < num_buckets; ++b)
+            shard->buckets[b] = CACHE_NO_ENTRY;
+        shard->bucket_mask = num_buckets - 1;
+        shard->capacity = (int)per_shard;
+        shard->used = 0;
+        shard->hand = 0;
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->ready, NULL);
+    }
+
+    cached_types = types;
+    cache_shards = shards;
+    logger("INFO", "Result cache holds %zu entries in %d shards", per_shard * RESULT_CACHE_SHARDS, RESULT_CACHE_SHARDS);
+    return 0;
+}
+
+void destroy_result_cache()
+{
+    if (cache_shards == NULL)
+        return;
+
+    cached_types = 0;
+    for (int s = 0; s < RESULT_CACHE_SHARDS; ++s)
+    {
+        pthread_mutex_destroy(&cache_shards[s].lock);
+        pthread_cond_destroy(&cache_shards[s].ready);
+        free(cache_shards[s].entries);
+        free(cache_shards[s].buckets);
+    }
+    free(cache_shards);
+    cache_shards = NULL;
+}
+
+static inline bool result_cache_enabled(RequestType type)
+{
+    return (unsigned)type < MAX_REQUEST_TYPES && (cached_types >> type) & 1;
+}
+
+// Must be called with the shard locked.
+static int cache_find(cache_shard_t *shard, uint64_t hash, const Request *key)
+{
+    for (int i = *cache_bucket_of(shard, hash); i != CACHE_NO_ENTRY; i = shard->entries[i].next)
+        if (cache_entry_matches(&shard->entries[i], key))
+            return i;
+    return CACHE_NO_ENTRY;
+}
+
+// Takes a free entry, evicting with CLOCK once the shard is full, and links
+// it under `key`. Returns CACHE_NO_ENTRY if every entry is pending. Must be
+// called with the shard locked.
+static int cache_insert(cache_shard_t *shard, uint64_t hash, const Request *key, CacheEntryState state)
+{
+    int victim = CACHE_NO_ENTRY;
+    if (shard->used < shard->capacity)
+        victim = shard->used++;
+    else
+    {
+        // One sweep clears every reference bit, so a second finds a victim
+        // unless everything is pending.
+        for (int step = 0; step < 2 * shard->capacity; ++step)
+        {
+            cache_entry_t *e = &shard->entries[shard->hand];
+            int at = shard->hand;
+            shard->hand = shard->hand + 1 < shard->capacity ? shard->hand + 1 : 0;
+
+            if (e->state == CACHE_PENDING)
+                continue;
+            if (e->referenced)
+            {
+                e->referenced = 0;
+                continue;
+            }
+            victim = at;
+            break;
+        }
+        if (victim == CACHE_NO_ENTRY)
+            return CACHE_NO_ENTRY;
+
+        // Unlink the victim from its bucket.
+        cache_entry_t *old = &shard->entries[victim];
+        Request old_key = {.request_type = old->type, .n1 = old->n1, .n2 = old->n2, .op = old->op};
+        int *link = cache_bucket_of(shard, cache_hash(&old_key));
+        while (*link != victim)
+            link = &shard->entries[*link].next;
+        *link = old->next;
+    }
+
+    cache_entry_t *e = &shard->entries[victim];
+    e->type = key->request_type;
+    e->n1 = key->n1;
+    e->n2 = key->n2;
+    e->op = key->op;
+    e->state = state;
+    e->referenced = 0;
+
+    int *bucket = cache_bucket_of(shard, hash);
+    e->next = *bucket;
+    *bucket = victim;
+    return victim;
+}
+
+// Looks the request up without waiting on pending entries. Returns true and
+// fills `res` on a hit.
+bool result_cache_get(Request req, Response *res)
+{
+    Request key = cache_key(req);
+    uint64_t hash = cache_hash(&key);
+    cache_shard_t *shard = cache_shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int i = cache_find(shard, hash, &key);
+    bool hit = i != CACHE_NO_ENTRY && shard->entries[i].state == CACHE_READY;
+    if (hit)
+    {
+        shard->entries[i].referenced = 1;
+        *res = shard->entries[i].res;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (hit)
+        stats_add(cache_hits, 1);
+    else
+        stats_add(cache_misses, 1);
+    return hit;
+}
+
+// Stores a response computed outside result_cache_compute().
+void result_cache_put(Request req, Response res)
+{
+    Request key = cache_key(req);
+    uint64_t hash = cache_hash(&key);
+    cache_shard_t *shard = cache_shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int i = cache_find(shard, hash, &key);
+    if (i == CACHE_NO_ENTRY)
+        i = cache_insert(shard, hash, &key, CACHE_READY);
+    else if (shard->entries[i].state == CACHE_PENDING)
+        i = CACHE_NO_ENTRY; // its owner will fill it in
+    if (i != CACHE_NO_ENTRY)
+        shard->entries[i].res = res;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Answers the request from the cache, waits for an identical request in
+// flight, or computes it with `compute` and caches the answer.
+Response result_cache_compute(Request req, compute_fn_t compute)
+{
+    Request key = cache_key(req);
+    uint64_t hash = cache_hash(&key);
+    cache_shard_t *shard = cache_shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int i = cache_find(shard, hash, &key);
+    if (i != CACHE_NO_ENTRY)
+    {
+        cache_entry_t *e = &shard->entries[i];
+        if (e->state == CACHE_PENDING)
+        {
+            stats_add(cache_coalesced, 1);
+            // Pending entries are never evicted, so e still holds our key.
+            while (e->state == CACHE_PENDING)
+                pthread_cond_wait(&shard->ready, &shard->lock);
+        }
+        else
+            stats_add(cache_hits, 1);
+
+        e->referenced = 1;
+        Response res = e->res;
+        pthread_mutex_unlock(&shard->lock);
+        return res;
+    }
+
+    stats_add(cache_misses, 1);
+    i = cache_insert(shard, hash, &key, CACHE_PENDING);
+    pthread_mutex_unlock(&shard->lock);
+
+    Response res = compute(req);
+    if (i == CACHE_NO_ENTRY)
+        return res;
+
+    pthread_mutex_lock(&shard->lock);
+    shard->entries[i].res = res;
+    shard->entries[i].state = CACHE_READY;
+    pthread_cond_broadcast(&shard->ready);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+#endif
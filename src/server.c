@@ -3,37 +3,87 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/random.h>
 
 #include "shared_memory.h"
 #include "utils.h"
 #include "common_structs.h"
 #include "worker.h"
+#include "worker_pool.h"
 #include "logger.h"
 #include "conn_chanel.h"
+#include "channel_arena.h"
+#include "payload_arena.h"
 #include "client_tree.h"
+#include "stats.h"
+#include "result_cache.h"
+#include "reaper.h"
+
+// Registrations are served by this many threads unless told otherwise.
+#define DEFAULT_ACCEPTORS (2)
+#define MAX_ACCEPTORS (64)
+
+// Registrations an acceptor takes off the queue per wakeup.
+#define ACCEPT_BATCH (16)
+
+// How often the main thread refreshes the gauges in the stats segment.
+#define GAUGE_INTERVAL_MS (400)
 
 static queue_t *conn_q;
+static channel_arena_t *channel_arena;
+static payload_arena_t *payload_arena;
+static stats_segment_t *stats;
 
 void cleanup()
 {
     logger("INFO", "Starting cleanup.");
     destroy_queue(conn_q);
+    destroy_channel_arena(channel_arena);
+    if (payload_arena != NULL)
+        destroy_payload_arena(payload_arena);
+    if (stats != NULL)
+        destroy_stats_segment(stats);
 
     logger("INFO", "Closing logger");
     close_logger();
 }
 
+// Set by SIGINT. cleanup() is not async-signal-safe, e.g. it takes the
+// logger's lock, so the main loop runs it once it sees the flag.
+static volatile sig_atomic_t stop_requested = 0;
+
 void handle_sigint(int sig)
 {
-    cleanup();
-    exit(sig);
+    (void)sig;
+    stop_requested = 1;
+}
+
+int generate_client_key()
+{
+    unsigned int key;
+    if (getrandom(&key, sizeof(key), 0) != sizeof(key))
+        key = (unsigned int)rand();
+
+    // Keep it positive, negative values signal errors to the client.
+    return (int)(key & 0x7fffffff);
+}
+
+// Session tokens are never 0, so a zeroed request is always rejected.
+unsigned long generate_session_token()
+{
+    unsigned long token = 0;
+    while (token == 0)
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token))
+            token = ((unsigned long)rand() << 32) ^ (unsigned long)rand();
+
+    return token;
 }
 
 int register_client(RequestOrResponse *conn_reqres)
 {
     wait_until_stage(conn_reqres, 0);
-    int comm_channel_exists = does_file_exist(conn_reqres->client_name);
-    if (comm_channel_exists == 1)
+    if (is_client_registered(conn_reqres->client_name))
     {
         logger("ERROR", "The client %s already exists. Please try a new client_name", conn_reqres->client_name);
         conn_reqres->res.response_code = RESPONSE_FAILURE;
@@ -41,89 +91,297 @@ int register_client(RequestOrResponse *conn_reqres)
 
         return -1;
     }
-    else if (comm_channel_exists != 0)
+
+    int slot = acquire_channel_slot();
+    if (slot < 0)
     {
-        logger("ERROR", "Something went wrong when verify client name (%s) validity. Please debug with other messages.", conn_reqres->client_name);
+        logger("ERROR", "No free channel slot for client %s.", conn_reqres->client_name);
         conn_reqres->res.response_code = RESPONSE_FAILURE;
         set_stage(conn_reqres, 1);
-
         return -1;
     }
 
-    WorkerArgs *args = malloc(sizeof(WorkerArgs));
-    strncpy(args->client_name, conn_reqres->client_name, MAX_CLIENT_NAME_LEN);
+    // Keys are random so that they can not be guessed from the client name.
+    int key, res;
+    do
+    {
+        key = generate_client_key();
+        res = insert_to_client_tree(key, conn_reqres->client_name);
+    } while (res == -1);
 
-    args->comm_channel_block_id = create_comm_channel(args->client_name);
-    if (args->comm_channel_block_id == IPC_RESULT_ERROR)
+    if (res < 0)
     {
-        logger("ERROR", "Could not get shared block id for client %s.", args->client_name);
+        logger("ERROR", "Could not index client %s.", conn_reqres->client_name);
+        release_channel_slot(slot);
         conn_reqres->res.response_code = RESPONSE_FAILURE;
         set_stage(conn_reqres, 1);
         return -1;
     }
 
-    pthread_t client_tid;
-    pthread_create(&client_tid, NULL, worker_function, args);
+    // A client that is already gone would never release its registration
+    // slot, so it is released here and nothing is published.
+    int pidfd = open_client_pidfd(conn_reqres->client_pid);
+    if (pidfd < 0 && errno == ESRCH)
+    {
+        logger("WARN", "Client %s (pid %d) exited before it was registered.", conn_reqres->client_name, conn_reqres->client_pid);
+        remove_from_client_tree(key);
+        release_channel_slot(slot);
+        release_node(conn_q, conn_reqres);
+        return -1;
+    }
+    if (pidfd < 0)
+        logger("WARN", "Cannot watch client %s, its channel will not be reclaimed if it dies.", conn_reqres->client_name);
+
+    RequestOrResponse *comm_reqres = arena_channel(channel_arena, slot);
+    init_comm_channel(comm_reqres, conn_reqres->client_name, slot);
 
-    int key = ftok(args->client_name, 0);
+    // The region keeps whatever the slot's previous client left in it.
+    size_t payload_size = payload_grant(payload_arena, conn_reqres->payload_size);
+    void *payload = payload_size > 0 ? payload_region(payload_arena, slot) : NULL;
 
-    // TODO: Error handling
-    insert_to_client_tree(key, conn_reqres->client_name); 
+    unsigned long session_token = generate_session_token();
+    publish_channel(slot, conn_reqres, comm_reqres, key, session_token, payload, payload_size, pidfd);
 
+    conn_reqres->channel_offset = arena_channel_offset(channel_arena, slot);
+    conn_reqres->payload_offset = payload_size > 0 ? payload_region_offset(payload_arena, slot) : 0;
+    conn_reqres->payload_size = payload_size;
+    conn_reqres->session_token = session_token;
     conn_reqres->res.response_code = RESPONSE_SUCCESS;
     conn_reqres->res.result = key;
     logger("INFO", "Client registered succesfully with key: %d", conn_reqres->res.result);
+    stats_add(registrations, 1);
 
     set_stage(conn_reqres, 1);
+
+    // Only now, since reaping a dead client releases its registration slot,
+    // which must no longer be written to here.
+    watch_channel(slot, pidfd);
+    return 0;
+}
+
+// Parks on the pending ring until clients post registrations, and serves
+// them in batches. Several acceptors run at once; register_client() only
+// touches thread-safe state.
+void *acceptor_function(void *args)
+{
+    (void)args;
+    RequestOrResponse *batch[ACCEPT_BATCH];
+
+    while (true)
+    {
+        // ? Both the client and server have references to the particular request after this dequee.
+        // ? Consequently, we don't need to keep the request on the queue.
+        // ? Any updates required can be done directly on the shared memory buffer.
+        int n = dequeue_batch(conn_q, batch, ACCEPT_BATCH);
+        for (int i = 0; i < n; ++i)
+        {
+            logger("INFO", "Request received to register new client: %s", batch[i]->client_name);
+            if (register_client(batch[i]) < 0)
+            {
+                logger("ERROR", "Could not register client %s", batch[i]->client_name);
+            }
+        }
+
+        set_stats_gauges(queue_depth(conn_q), get_num_connected_clients());
+    }
+
+    return NULL;
+}
+
+// Returns -1 if none started; fewer than asked for still serve.
+int start_acceptors(int num_acceptors)
+{
+    int started = 0;
+    for (; started < num_acceptors; ++started)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, acceptor_function, NULL) != 0)
+        {
+            logger("ERROR", "Could not start acceptor %d of %d.", started, num_acceptors);
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    if (started == 0)
+        return -1;
+    if (started < num_acceptors)
+        logger("WARN", "Started only %d of %d registration acceptors", started, num_acceptors);
+    else
+        logger("INFO", "Started %d registration acceptors", started);
     return 0;
 }
 
-int main(int _argc, char **_argv)
+void usage(const char *progname)
+{
+    printf("Usage: %s [-w <num_workers>] [-q <queue_capacity>] [-c <max_clients>] [-p <payload_bytes>] [-m <cache_bytes>] [-k <types>] [-s <sieve_file>] [-l <module.so>]... [-a <acceptors>]\n", progname);
+    printf("  -p  largest payload region a client can get, 0 disables payloads (default %d)\n", DEFAULT_PAYLOAD_REGION_SIZE);
+    printf("  -m  memory for the result cache, 0 disables it (default %d)\n", RESULT_CACHE_DEFAULT_BYTES);
+    printf("  -k  request types to cache: none or a list of arith, even, prime, negative, handler names or type numbers\n");
+    printf("      (default: the expensive cacheable handlers)\n");
+    printf("  -s  prime sieve file built by ccs-sieve, answers IS_PRIME below its limit\n");
+    printf("  -l  handler module to load, can be repeated\n");
+    printf("  -a  threads serving registrations (default %d)\n", DEFAULT_ACCEPTORS);
+}
+
+int main(int argc, char **argv)
 {
+    int num_workers = 0; // 0 sizes the pool to the number of online cores
+    size_t queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    size_t max_clients = MAX_CLIENTS;
+    size_t payload_region_size = DEFAULT_PAYLOAD_REGION_SIZE;
+    size_t cache_bytes = RESULT_CACHE_DEFAULT_BYTES;
+    const char *cache_list = NULL; // NULL caches default_cached_types()
+    const char *sieve_path = NULL;
+    const char *modules[MAX_HANDLER_MODULES];
+    int num_modules = 0;
+    int num_acceptors = DEFAULT_ACCEPTORS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:q:c:p:m:k:s:l:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'q':
+            queue_capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            max_clients = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            payload_region_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            cache_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            cache_list = optarg; // parsed once the handlers are registered
+            break;
+        case 's':
+            sieve_path = optarg;
+            break;
+        case 'l':
+            if (num_modules == MAX_HANDLER_MODULES)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            modules[num_modules++] = optarg;
+            break;
+        case 'a':
+            num_acceptors = atoi(optarg);
+            if (num_acceptors < 1 || num_acceptors > MAX_ACCEPTORS)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     signal(SIGINT, handle_sigint);
 
     if (init_logger("server") == EXIT_FAILURE)
         return EXIT_FAILURE;
 
-    conn_q = create_queue();
+    conn_q = create_queue(queue_capacity);
     if (conn_q == NULL)
     {
         logger("ERROR", "Could not create connection queue.");
         exit(EXIT_FAILURE);
     }
 
+    channel_arena = create_channel_arena(max_clients);
+    if (channel_arena == NULL)
+    {
+        logger("ERROR", "Could not create channel arena.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Clients without a payload region can still use every other request.
+    if (payload_region_size > 0)
+    {
+        payload_arena = create_payload_arena(channel_arena->num_slots, payload_region_size);
+        if (payload_arena == NULL)
+            logger("WARN", "Could not create payload arena. Continuing without payloads.");
+    }
+
+    // Statistics are best effort: the server runs without them.
+    stats = create_stats_segment();
+    if (stats == NULL)
+        logger("WARN", "Could not create stats segment. Continuing without statistics.");
+
+    if (register_builtin_handlers() < 0)
+    {
+        logger("ERROR", "Could not register the built-in handlers.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_modules; ++i)
+    {
+        if (load_handler_module(modules[i]) < 0)
+        {
+            logger("ERROR", "Could not load handler module %s.", modules[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unsigned int cache_types = default_cached_types();
+    if (cache_list != NULL && parse_cached_types(cache_list, &cache_types) < 0)
+    {
+        logger("ERROR", "Unknown request type in -k %s.", cache_list);
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Lives until exit, since workers may still be using it during cleanup.
+    if (init_result_cache(cache_bytes, cache_types) < 0)
+        logger("WARN", "Continuing without the result cache.");
+
+    // Without the sieve, IS_PRIME falls back to Miller-Rabin.
+    if (sieve_path != NULL && load_sieve_file(sieve_path) < 0)
+        logger("WARN", "Continuing without the prime sieve.");
+
     init_client_tree();
+    init_channel_table(channel_arena);
+    logger("INFO", "Vector arithmetic uses the %s kernel", vector_kernel_name());
+
+    if (start_reaper(conn_q) < 0)
+        logger("WARN", "Continuing without reclaiming the channels of dead clients.");
+
+    if (start_worker_pool(&conn_q->ready, num_workers) < 0)
+    {
+        logger("ERROR", "Could not start worker pool.");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Started server. Waiting for requests...\n");
     fflush(stdout);
 
-    while (true)
+    if (start_acceptors(num_acceptors) < 0)
     {
+        logger("ERROR", "Could not start the registration acceptors.");
+        exit(EXIT_FAILURE);
+    }
 
-        // ? Both the client and server have references to the particular request after this dequee.
-        // ? Consequently, we don't need to keep the request on the queue.
-        // ? Any updates required can be done directly on the shared memory buffer.
-        RequestOrResponse *conn_reqres = dequeue(conn_q);
-        if (conn_reqres == (void *)-1)
-        {
-            logger("ERROR", "Failed to dequeue. System has probably run out of resources to create more shared memory blocks. Closing server...");
-            printf("System might have run out of resources. Closing the server...");
-            break;
-        }
-
-        // RequestOrResponse *conn_reqres = fetch(conn_q);
-        if (conn_reqres)
+    // Registrations no longer go through here; the main thread only keeps the
+    // gauges fresh while no one registers, until told to stop.
+    size_t logged_clients = 0;
+    while (!stop_requested)
+    {
+        size_t connected_clients = get_num_connected_clients();
+        set_stats_gauges(queue_depth(conn_q), connected_clients);
+        if (connected_clients != logged_clients)
         {
-
-            logger("INFO", "Request received to register new client: %s", conn_reqres->client_name);
-            if (register_client(conn_reqres) < 0)
-            {
-                logger("ERROR", "Could not register client %s", conn_reqres->client_name);
-            }
+            logger("INFO", "Number of connected clients: %zu", connected_clients);
+            logged_clients = connected_clients;
         }
-
-        logger("INFO", "Number of connected clients: %d", get_num_connected_clients());
-        msleep(400);
+        msleep(GAUGE_INTERVAL_MS);
     }
 
     cleanup();
@@ -9,17 +9,350 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "logger.h"
+#include "utils.h"
 
 #define IPC_RESULT_ERROR (-1)
 
-int create_key(const char *filename)
+// Shared blocks are backed either by SysV segments (ftok/shmget/shmat), which
+// need a file on disk per block, or by POSIX shared memory objects
+// (shm_open/mmap), which are looked up by name only. The default is picked at
+// build time with -DSHM_BACKEND_POSIX and can be overridden at run time with
+// CCS_SHM_BACKEND=sysv|posix. The server and its clients must agree on it.
+//
+// Further run-time knobs (build-time defaults in parentheses):
+//   CCS_SHM_POPULATE=1   prefault mappings with MAP_POPULATE (-DSHM_POPULATE)
+//   CCS_SHM_HUGEPAGES=1  back blocks with huge pages (-DSHM_HUGEPAGES): THP via
+//                        MADV_HUGEPAGE for POSIX objects, SHM_HUGETLB for SysV
+//   CCS_SHM_HUGETLBFS=<dir>  with the POSIX backend, place blocks on a
+//                        hugetlbfs mount for explicit huge pages
+typedef enum ShmBackend
+{
+    SHM_BACKEND_KIND_SYSV,
+    SHM_BACKEND_KIND_POSIX
+} ShmBackend;
+
+typedef struct shm_config_t
+{
+    ShmBackend backend;
+    bool populate;
+    bool hugepages;
+    const char *hugetlbfs_dir;
+} shm_config_t;
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define POSIX_SHM_PREFIX "/ccs."
+
+static shm_config_t shm_config;
+static pthread_once_t shm_config_once = PTHREAD_ONCE_INIT;
+
+static bool env_flag(const char *name, bool default_value)
 {
-    return ftok(filename, 0);
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return default_value;
+    return strcmp(value, "0") != 0;
 }
 
-static int get_shared_block(const char *filename, size_t size)
+static void load_shm_config()
+{
+#ifdef SHM_BACKEND_POSIX
+    shm_config.backend = SHM_BACKEND_KIND_POSIX;
+#else
+    shm_config.backend = SHM_BACKEND_KIND_SYSV;
+#endif
+    const char *backend = getenv("CCS_SHM_BACKEND");
+    if (backend != NULL && strcmp(backend, "posix") == 0)
+        shm_config.backend = SHM_BACKEND_KIND_POSIX;
+    else if (backend != NULL && strcmp(backend, "sysv") == 0)
+        shm_config.backend = SHM_BACKEND_KIND_SYSV;
+
+#ifdef SHM_POPULATE
+    shm_config.populate = env_flag("CCS_SHM_POPULATE", true);
+#else
+    shm_config.populate = env_flag("CCS_SHM_POPULATE", false);
+#endif
+#ifdef SHM_HUGEPAGES
+    shm_config.hugepages = env_flag("CCS_SHM_HUGEPAGES", true);
+#else
+    shm_config.hugepages = env_flag("CCS_SHM_HUGEPAGES", false);
+#endif
+    shm_config.hugetlbfs_dir = getenv("CCS_SHM_HUGETLBFS");
+}
+
+const shm_config_t *get_shm_config()
+{
+    pthread_once(&shm_config_once, load_shm_config);
+    return &shm_config;
+}
+
+static inline bool use_posix_shm()
+{
+    return get_shm_config()->backend == SHM_BACKEND_KIND_POSIX;
+}
+
+static size_t round_up_to_huge_page(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+/* ------------------------------------------------------------------------- */
+/* POSIX backend                                                             */
+/* ------------------------------------------------------------------------- */
+
+// Block ids handed out by the POSIX backend are indices into this
+// process-local table of open shared memory objects.
+typedef struct posix_block_t
+{
+    char name[NAME_MAX + 1];
+    int fd; // -1 when the entry is free
+} posix_block_t;
+
+// Live mappings, so that detach_memory_block can munmap with the right length.
+typedef struct posix_mapping_t
+{
+    void *addr;
+    size_t len;
+} posix_mapping_t;
+
+static posix_block_t *posix_blocks;
+static size_t num_posix_blocks = 0;
+static posix_mapping_t *posix_mappings;
+static size_t num_posix_mappings = 0;
+static pthread_mutex_t posix_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void posix_object_name(const char *filename, char *name, size_t len)
+{
+    snprintf(name, len, POSIX_SHM_PREFIX "%s", filename);
+    for (char *c = name + 1; *c; ++c)
+        if (*c == '/')
+            *c = '_';
+}
+
+static bool use_hugetlbfs()
+{
+    const shm_config_t *config = get_shm_config();
+    return config->hugepages && config->hugetlbfs_dir != NULL;
+}
+
+static int open_posix_object(const char *name, int flags)
+{
+    if (use_hugetlbfs())
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", get_shm_config()->hugetlbfs_dir, name + 1);
+        return open(path, flags, 0644);
+    }
+
+    return shm_open(name, flags, 0644);
+}
+
+static int unlink_posix_object(const char *name)
+{
+    if (use_hugetlbfs())
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", get_shm_config()->hugetlbfs_dir, name + 1);
+        return unlink(path);
+    }
+
+    return shm_unlink(name);
+}
+
+static int posix_get_shared_block(const char *filename, size_t size)
+{
+    char name[NAME_MAX + 1];
+    posix_object_name(filename, name, sizeof(name));
+
+    pthread_mutex_lock(&posix_shm_mutex);
+
+    int block_id = -1;
+    for (size_t i = 0; i < num_posix_blocks; ++i)
+    {
+        if (posix_blocks[i].fd >= 0 && strcmp(posix_blocks[i].name, name) == 0)
+        {
+            block_id = i;
+            break;
+        }
+        if (posix_blocks[i].fd < 0 && block_id < 0)
+            block_id = i;
+    }
+
+    if (block_id >= 0 && posix_blocks[block_id].fd >= 0)
+    {
+        int fd = posix_blocks[block_id].fd;
+        pthread_mutex_unlock(&posix_shm_mutex);
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size < size && ftruncate(fd, size) == -1)
+        {
+            logger("ERROR", "Could not grow shared memory object %s to %zu bytes.", name, size);
+            return IPC_RESULT_ERROR;
+        }
+        return block_id;
+    }
+
+    int fd = open_posix_object(name, O_RDWR | O_CREAT);
+    if (fd == -1)
+    {
+        if (errno == EACCES)
+            logger("ERROR", "EACCES: shm_open of %s failed with code EACCESS.", name);
+        else if (errno == EMFILE || errno == ENFILE)
+            logger("ERROR", "EMFILE: shm_open of %s failed. Too many open files.", name);
+        else if (errno == ENAMETOOLONG)
+            logger("ERROR", "ENAMETOOLONG: shm_open of %s failed. Name is too long.", name);
+        else
+            logger("ERROR", "shm_open of %s failed. Unknown error occured.", name);
+
+        pthread_mutex_unlock(&posix_shm_mutex);
+        return IPC_RESULT_ERROR;
+    }
+
+    struct stat st;
+    size_t target = use_hugetlbfs() ? round_up_to_huge_page(size) : size;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size < target && ftruncate(fd, target) == -1)
+    {
+        logger("ERROR", "Could not size shared memory object %s to %zu bytes.", name, target);
+        close(fd);
+        pthread_mutex_unlock(&posix_shm_mutex);
+        return IPC_RESULT_ERROR;
+    }
+
+    if (block_id < 0)
+    {
+        posix_block_t *blocks = (posix_block_t *)realloc(posix_blocks, sizeof(posix_block_t) * (num_posix_blocks * 2 + 16));
+        if (blocks == NULL)
+        {
+            logger("ERROR", "Could not grow the shared memory object table.");
+            close(fd);
+            pthread_mutex_unlock(&posix_shm_mutex);
+            return IPC_RESULT_ERROR;
+        }
+        posix_blocks = blocks;
+        for (size_t i = num_posix_blocks; i < num_posix_blocks * 2 + 16; ++i)
+            posix_blocks[i].fd = -1;
+        block_id = num_posix_blocks;
+        num_posix_blocks = num_posix_blocks * 2 + 16;
+    }
+
+    strncpy(posix_blocks[block_id].name, name, NAME_MAX);
+    posix_blocks[block_id].name[NAME_MAX] = '\0';
+    posix_blocks[block_id].fd = fd;
+
+    pthread_mutex_unlock(&posix_shm_mutex);
+    return block_id;
+}
+
+static void *posix_attach_with_shared_block_id(int shared_block_id)
+{
+    pthread_mutex_lock(&posix_shm_mutex);
+    int fd = (shared_block_id >= 0 && (size_t)shared_block_id < num_posix_blocks) ? posix_blocks[shared_block_id].fd : -1;
+    pthread_mutex_unlock(&posix_shm_mutex);
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1)
+    {
+        logger("ERROR", "EINVAL: Could not attach to shared memory block with block_id: %d. Not a valid block id.", shared_block_id);
+        return NULL;
+    }
+
+    const shm_config_t *config = get_shm_config();
+    int flags = MAP_SHARED | (config->populate ? MAP_POPULATE : 0);
+    void *block = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (block == MAP_FAILED)
+    {
+        if (errno == ENOMEM)
+            logger("ERROR", "ENOMEM: Could not attach to shared memory block with block_id: %d. There is not enough available memory to map it.", shared_block_id);
+        else
+            logger("ERROR", "Could not attach to shared memory block with block_id: %d. Unknown error occured.", shared_block_id);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (config->hugepages && !use_hugetlbfs())
+        madvise(block, st.st_size, MADV_HUGEPAGE);
+#endif
+
+    pthread_mutex_lock(&posix_shm_mutex);
+    posix_mapping_t *mappings = (posix_mapping_t *)realloc(posix_mappings, sizeof(posix_mapping_t) * (num_posix_mappings + 1));
+    if (mappings == NULL)
+    {
+        pthread_mutex_unlock(&posix_shm_mutex);
+        munmap(block, st.st_size);
+        logger("ERROR", "Could not record mapping of block_id: %d.", shared_block_id);
+        return NULL;
+    }
+    posix_mappings = mappings;
+    posix_mappings[num_posix_mappings++] = (posix_mapping_t){block, (size_t)st.st_size};
+    pthread_mutex_unlock(&posix_shm_mutex);
+
+    return block;
+}
+
+static int posix_detach_memory_block(const void *block)
+{
+    size_t len = 0;
+    pthread_mutex_lock(&posix_shm_mutex);
+    for (size_t i = 0; i < num_posix_mappings; ++i)
+    {
+        if (posix_mappings[i].addr == block)
+        {
+            len = posix_mappings[i].len;
+            posix_mappings[i] = posix_mappings[--num_posix_mappings];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&posix_shm_mutex);
+
+    if (len == 0 || munmap((void *)block, len) == -1)
+    {
+        logger("ERROR", "EINVAL: Failed to detach connection memory block. The address passed is not the start address of a mapped shared memory block.");
+        return IPC_RESULT_ERROR;
+    }
+
+    return 0;
+}
+
+static int posix_destroy_memory_block(const char *filename)
+{
+    char name[NAME_MAX + 1];
+    posix_object_name(filename, name, sizeof(name));
+
+    pthread_mutex_lock(&posix_shm_mutex);
+    for (size_t i = 0; i < num_posix_blocks; ++i)
+    {
+        if (posix_blocks[i].fd >= 0 && strcmp(posix_blocks[i].name, name) == 0)
+        {
+            close(posix_blocks[i].fd);
+            posix_blocks[i].fd = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&posix_shm_mutex);
+
+    if (unlink_posix_object(name) == -1)
+    {
+        if (errno == EACCES)
+            logger("ERROR", "EACCES: Failed to destroy connection memory block %s. User does not have permission to unlink it.", filename);
+        else if (errno == ENOENT)
+            logger("ERROR", "ENOENT: Failed to destroy connection memory block %s. It does not exist.", filename);
+        else
+            logger("ERROR", "Failed to destroy connection memory block %s. Unknown error occured.", filename);
+        return IPC_RESULT_ERROR;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* SysV backend                                                              */
+/* ------------------------------------------------------------------------- */
+
+static int sysv_get_shared_block(const char *filename, size_t size)
 {
     // Request a key
     // key is linked to a filename so that other programs can access it
@@ -31,7 +364,15 @@ static int get_shared_block(const char *filename, size_t size)
     }
 
     // get shared block -- create if it does not exist
-    int shared_block_id = shmget(key, size, 0644 | IPC_CREAT);
+    int shared_block_id = -1;
+    if (get_shm_config()->hugepages && size > 0)
+    {
+        shared_block_id = shmget(key, round_up_to_huge_page(size), 0644 | IPC_CREAT | SHM_HUGETLB);
+        if (shared_block_id == IPC_RESULT_ERROR)
+            logger("WARN", "Could not get a huge page backed block for %s. Falling back to regular pages.", filename);
+    }
+    if (shared_block_id == IPC_RESULT_ERROR)
+        shared_block_id = shmget(key, size, 0644 | IPC_CREAT);
     if (shared_block_id == IPC_RESULT_ERROR)
     {
         if (errno == EACCES)
@@ -55,7 +396,7 @@ static int get_shared_block(const char *filename, size_t size)
     return shared_block_id;
 }
 
-void *attach_with_shared_block_id(int shared_block_id)
+static void *sysv_attach_with_shared_block_id(int shared_block_id)
 {
     // map the shared block into this process's memory
     // and return a pointer to it
@@ -80,19 +421,7 @@ void *attach_with_shared_block_id(int shared_block_id)
     return block;
 }
 
-void *attach_memory_block(const char *filename, size_t size)
-{
-    int shared_block_id = get_shared_block(filename, size);
-    if (shared_block_id == IPC_RESULT_ERROR)
-    {
-        logger("ERROR", "get_shared_block failed. Could not get shared_block_id.");
-        return NULL;
-    }
-
-    return attach_with_shared_block_id(shared_block_id);
-}
-
-int detach_memory_block(const void *block)
+static int sysv_detach_memory_block(const void *block)
 {
     int result = shmdt(block);
     if (result == IPC_RESULT_ERROR)
@@ -107,9 +436,9 @@ int detach_memory_block(const void *block)
     return result;
 }
 
-int destroy_memory_block(const char *filename)
+static int sysv_destroy_memory_block(const char *filename)
 {
-    int shared_block_id = get_shared_block(filename, 0);
+    int shared_block_id = sysv_get_shared_block(filename, 0);
     if (shared_block_id == IPC_RESULT_ERROR)
         return IPC_RESULT_ERROR;
 
@@ -132,6 +461,135 @@ int destroy_memory_block(const char *filename)
     return result;
 }
 
+/* ------------------------------------------------------------------------- */
+/* Public API                                                                */
+/* ------------------------------------------------------------------------- */
+
+// Derives the integer key of a named block, e.g. to authenticate its owner.
+int create_key(const char *filename)
+{
+    if (!use_posix_shm())
+        return ftok(filename, 0);
+
+    // FNV-1a of the name, kept positive so that it can not be mistaken for an
+    // error.
+    unsigned int hash = 2166136261U;
+    for (const char *c = filename; *c; ++c)
+        hash = (hash ^ (unsigned char)*c) * 16777619U;
+    return (int)(hash & 0x7fffffff);
+}
+
+static int get_shared_block(const char *filename, size_t size)
+{
+    return use_posix_shm() ? posix_get_shared_block(filename, size) : sysv_get_shared_block(filename, size);
+}
+
+void *attach_with_shared_block_id(int shared_block_id)
+{
+    return use_posix_shm() ? posix_attach_with_shared_block_id(shared_block_id) : sysv_attach_with_shared_block_id(shared_block_id);
+}
+
+void *attach_memory_block(const char *filename, size_t size)
+{
+    int shared_block_id = get_shared_block(filename, size);
+    if (shared_block_id == IPC_RESULT_ERROR)
+    {
+        logger("ERROR", "get_shared_block failed. Could not get shared_block_id.");
+        return NULL;
+    }
+
+    return attach_with_shared_block_id(shared_block_id);
+}
+
+// Maps an existing block without write access, e.g. for monitoring tools.
+// Returns NULL if the block does not exist.
+const void *attach_memory_block_readonly(const char *filename)
+{
+    if (!use_posix_shm())
+    {
+        key_t key = ftok(filename, 0);
+        int shared_block_id = key == IPC_RESULT_ERROR ? IPC_RESULT_ERROR : shmget(key, 0, 0);
+        if (shared_block_id == IPC_RESULT_ERROR)
+            return NULL;
+
+        void *block = shmat(shared_block_id, NULL, SHM_RDONLY);
+        return block == (void *)IPC_RESULT_ERROR ? NULL : block;
+    }
+
+    char name[NAME_MAX + 1];
+    posix_object_name(filename, name, sizeof(name));
+    int fd = open_posix_object(name, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    void *block = fstat(fd, &st) == -1 ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED)
+        return NULL;
+
+    pthread_mutex_lock(&posix_shm_mutex);
+    posix_mapping_t *mappings = (posix_mapping_t *)realloc(posix_mappings, sizeof(posix_mapping_t) * (num_posix_mappings + 1));
+    if (mappings == NULL)
+    {
+        pthread_mutex_unlock(&posix_shm_mutex);
+        munmap(block, st.st_size);
+        return NULL;
+    }
+    posix_mappings = mappings;
+    posix_mappings[num_posix_mappings++] = (posix_mapping_t){block, (size_t)st.st_size};
+    pthread_mutex_unlock(&posix_shm_mutex);
+
+    return block;
+}
+
+int detach_memory_block(const void *block)
+{
+    return use_posix_shm() ? posix_detach_memory_block(block) : sysv_detach_memory_block(block);
+}
+
+int destroy_memory_block(const char *filename)
+{
+    return use_posix_shm() ? posix_destroy_memory_block(filename) : sysv_destroy_memory_block(filename);
+}
+
+// Makes `filename` usable as a block name. The SysV backend derives keys from
+// files on disk, so it creates the file; the POSIX backend needs nothing.
+void prepare_memory_block_name(const char *filename)
+{
+    if (use_posix_shm())
+        return;
+
+    int fd = create_file_if_does_not_exist(filename);
+    if (fd >= 0)
+        close(fd);
+}
+
+// Returns 1 if a block named `filename` exists, 0 if not and -1 on error.
+int memory_block_exists(const char *filename)
+{
+    if (!use_posix_shm())
+        return does_file_exist(filename);
+
+    char name[NAME_MAX + 1];
+    posix_object_name(filename, name, sizeof(name));
+    int fd = open_posix_object(name, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    close(fd);
+    return 1;
+}
+
+// Undoes prepare_memory_block_name once the block has been destroyed.
+int release_memory_block_name(const char *filename)
+{
+    if (use_posix_shm())
+        return 0;
+
+    return remove_file(filename);
+}
+
 void clear_memory_block(void *block, size_t size)
 {
     memset(block, '\0', size);
@@ -0,0 +1,246 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common_structs.h"
+#include "shared_memory.h"
+#include "logger.h"
+#include "utils.h"
+
+#define STATS_FNAME "srv_stats"
+#define STATS_MAGIC (0x43435353U) // "CCSS"
+#define STATS_VERSION (5)
+
+// Shard 0 takes the threads that are not pool workers (registration, main).
+// Workers beyond STATS_WORKER_SHARDS share shards, which is why counters are
+// bumped with atomic adds even though a shard usually has a single writer.
+#define STATS_WORKER_SHARDS (64)
+#define STATS_NUM_SHARDS (STATS_WORKER_SHARDS + 1)
+
+// Every request type a handler can be registered under, module types included.
+#define NUM_REQUEST_TYPES (MAX_REQUEST_TYPES)
+#define STATS_TYPE_NAME_LEN (24)
+
+// Log-linear latency buckets in nanoseconds: 2^HIST_SUB_BUCKET_BITS buckets
+// per power of two, so every bucket is within 12.5% of its values. Values
+// above 2^HIST_MAX_EXPONENT ns (about 18 minutes) land in the last bucket.
+#define HIST_SUB_BUCKET_BITS (3)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_MAX_EXPONENT (40)
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - HIST_SUB_BUCKET_BITS + 2) << HIST_SUB_BUCKET_BITS)
+
+typedef enum LatencyKind
+{
+    LATENCY_QUEUE_WAIT, // client published the request -> a worker picked it up
+    LATENCY_HANDLER,    // a worker picked it up -> the response was published
+    LATENCY_PICKUP,     // the response was published -> the client saw it
+    NUM_LATENCY_KINDS
+} LatencyKind;
+
+typedef struct stats_shard_t
+{
+    uint64_t serviced;
+    uint64_t requests[NUM_REQUEST_TYPES];
+    uint64_t batch_entries;
+    uint64_t tasks;
+    uint64_t steals;
+    uint64_t auth_failures;
+    uint64_t registrations;
+    uint64_t unregistrations;
+    uint64_t reaped; // clients that exited without unregistering
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_coalesced; // misses that waited for an identical request in flight
+
+    // Per handler, batch entries included: calls, and time spent inside the
+    // handler. Batch entry points count every entry they answer as a call.
+    uint64_t handler_calls[NUM_REQUEST_TYPES];
+    uint64_t handler_ns[NUM_REQUEST_TYPES];
+
+    uint64_t latency[NUM_REQUEST_TYPES][NUM_LATENCY_KINDS][HIST_BUCKETS] __attribute__((aligned(64)));
+} __attribute__((aligned(64))) stats_shard_t;
+
+// The segment the server publishes under STATS_FNAME. Readers map it
+// read-only and never synchronise with the server; counters only grow, so a
+// torn snapshot is at worst off by the updates made while it was copied.
+typedef struct stats_segment_t
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t server_pid;
+    int32_t pool_size;
+    uint64_t start_ns;
+
+    // Gauges, refreshed by the server's main loop.
+    uint64_t queue_depth __attribute__((aligned(64)));
+    uint64_t connected_clients;
+
+    // Names of the registered handlers, empty for unused types.
+    char type_names[NUM_REQUEST_TYPES][STATS_TYPE_NAME_LEN];
+
+    stats_shard_t shards[STATS_NUM_SHARDS];
+} stats_segment_t;
+
+static stats_segment_t *server_stats;
+static __thread stats_shard_t *thread_stats;
+
+static inline int latency_bucket(uint64_t ns)
+{
+    if (ns < HIST_SUB_BUCKETS)
+        return (int)ns;
+
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > HIST_MAX_EXPONENT)
+        return HIST_BUCKETS - 1;
+
+    int sub = (ns >> (exponent - HIST_SUB_BUCKET_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return ((exponent - HIST_SUB_BUCKET_BITS + 1) << HIST_SUB_BUCKET_BITS) | sub;
+}
+
+// Largest value that falls in the bucket.
+static inline uint64_t latency_bucket_limit(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+
+    int exponent = (bucket >> HIST_SUB_BUCKET_BITS) + HIST_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket & (HIST_SUB_BUCKETS - 1);
+    uint64_t width = 1ULL << (exponent - HIST_SUB_BUCKET_BITS);
+    return ((HIST_SUB_BUCKETS + sub) << (exponent - HIST_SUB_BUCKET_BITS)) + width - 1;
+}
+
+// Returns the smallest bucket limit covering `quantile` of the samples, or 0
+// if there are none.
+uint64_t latency_quantile(const uint64_t hist[HIST_BUCKETS], double quantile)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        total += hist[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(quantile * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += hist[i];
+        if (seen > rank)
+            return latency_bucket_limit(i);
+    }
+
+    return latency_bucket_limit(HIST_BUCKETS - 1);
+}
+
+stats_segment_t *create_stats_segment()
+{
+    logger("DEBUG", "Initialising stats segment");
+
+    prepare_memory_block_name(STATS_FNAME);
+    stats_segment_t *stats = (stats_segment_t *)attach_memory_block(STATS_FNAME, sizeof(stats_segment_t));
+    if (stats == NULL)
+    {
+        logger("ERROR", "Could not create shared memory block for the stats segment.");
+        return NULL;
+    }
+
+    clear_memory_block(stats, sizeof(stats_segment_t));
+    stats->server_pid = getpid();
+    stats->start_ns = monotonic_ns();
+    stats->version = STATS_VERSION;
+    __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    server_stats = stats;
+    logger("INFO", "Stats segment creation succesful");
+    return stats;
+}
+
+int destroy_stats_segment(stats_segment_t *stats)
+{
+    logger("INFO", "Starting stats segment cleanup");
+
+    // Workers may still be recording, so the mapping stays until exit and
+    // only the name is removed.
+    (void)stats;
+    destroy_memory_block(STATS_FNAME);
+    release_memory_block_name(STATS_FNAME);
+
+    logger("INFO", "Completed stats segment cleanup");
+    return 0;
+}
+
+// Reader side. Returns NULL if no server has published its stats.
+const stats_segment_t *attach_stats_segment()
+{
+    const stats_segment_t *stats = (const stats_segment_t *)attach_memory_block_readonly(STATS_FNAME);
+    if (stats == NULL)
+        return NULL;
+
+    if (stats->magic != STATS_MAGIC || stats->version != STATS_VERSION)
+    {
+        detach_memory_block(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+// Worker `id` records into its own shard from now on.
+void bind_stats_shard(int worker_id)
+{
+    if (server_stats != NULL)
+        thread_stats = &server_stats->shards[1 + worker_id % STATS_WORKER_SHARDS];
+}
+
+static inline stats_shard_t *stats_shard()
+{
+    if (thread_stats == NULL && server_stats != NULL)
+        thread_stats = &server_stats->shards[0];
+    return thread_stats;
+}
+
+#define stats_add(field, n)                                                   \
+    do                                                                        \
+    {                                                                         \
+        stats_shard_t *_shard = stats_shard();                                \
+        if (_shard != NULL)                                                   \
+            __atomic_fetch_add(&_shard->field, (n), __ATOMIC_RELAXED);        \
+    } while (0)
+
+static inline void record_latency(RequestType type, LatencyKind kind, uint64_t ns)
+{
+    if ((unsigned)type < NUM_REQUEST_TYPES)
+        stats_add(latency[type][kind][latency_bucket(ns)], 1);
+}
+
+static inline void record_handler_call(int type, int calls, uint64_t ns)
+{
+    if ((unsigned)type < NUM_REQUEST_TYPES)
+    {
+        stats_add(handler_calls[type], calls);
+        stats_add(handler_ns[type], ns);
+    }
+}
+
+void set_stats_type_name(int type, const char *name)
+{
+    if (server_stats == NULL || (unsigned)type >= NUM_REQUEST_TYPES)
+        return;
+    strncpy(server_stats->type_names[type], name, STATS_TYPE_NAME_LEN - 1);
+}
+
+static inline void set_stats_gauges(size_t queue_depth, size_t connected_clients)
+{
+    if (server_stats == NULL)
+        return;
+    __atomic_store_n(&server_stats->queue_depth, queue_depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&server_stats->connected_clients, connected_clients, __ATOMIC_RELAXED);
+}
+
+#endif
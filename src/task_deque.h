@@ -0,0 +1,93 @@
+#ifndef TASK_DEQUE_H
+#define TASK_DEQUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Capacity of each worker's deque. Must be a power of two.
+#define TASK_DEQUE_CAPACITY (1024)
+
+#define TASK_DEQUE_EMPTY ((void *)0)
+#define TASK_DEQUE_ABORT ((void *)1)
+
+// Chase-Lev work-stealing deque with a fixed-size buffer.
+// The owning worker pushes and takes at the bottom; any other worker may
+// steal from the top. Follows the C11 formulation of Le et al. (PPoPP'13).
+typedef struct task_deque_t
+{
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    void *buffer[TASK_DEQUE_CAPACITY] __attribute__((aligned(64)));
+} task_deque_t;
+
+void init_task_deque(task_deque_t *dq)
+{
+    dq->top = 0;
+    dq->bottom = 0;
+}
+
+// Owner only. Returns -1 if the deque is full.
+int push_task(task_deque_t *dq, void *task)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    if (b - t >= TASK_DEQUE_CAPACITY)
+        return -1;
+
+    __atomic_store_n(&dq->buffer[b & (TASK_DEQUE_CAPACITY - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Owner only. Returns TASK_DEQUE_EMPTY if there is nothing left.
+void *take_task(task_deque_t *dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b)
+    {
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return TASK_DEQUE_EMPTY;
+    }
+
+    void *task = __atomic_load_n(&dq->buffer[b & (TASK_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        // Last element: race against thieves for it.
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = TASK_DEQUE_EMPTY;
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return task;
+}
+
+// Any thread. Returns TASK_DEQUE_ABORT if it lost a race and should retry.
+void *steal_task(task_deque_t *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return TASK_DEQUE_EMPTY;
+
+    void *task = __atomic_load_n(&dq->buffer[t & (TASK_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return TASK_DEQUE_ABORT;
+
+    return task;
+}
+
+long task_deque_size(task_deque_t *dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+    return b > t ? b - t : 0;
+}
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Binary trace format. Every logger() call site owns a static trace_site_t
+// placed in the ccs_trace_sites section, so its index in that section is a
+// link-time site ID. At runtime a call stores only a timestamp counter, the
+// site ID and the raw argument values into a fixed-size record in the calling
+// thread's memory-mapped ring file. ccs-tracedump rebuilds the text log from
+// the site table and the rings.
+//
+// A trace directory holds one "sites" file and one "<tid>.ring" file per
+// thread. Rings wrap, keeping the most recent records.
+
+#define TRACE_MAGIC "CCSTRACE"
+#define TRACE_SITES_MAGIC "CCSSITES"
+#define TRACE_VERSION (1)
+#define TRACE_HEADER_SIZE (4096)
+#define TRACE_RECORD_SIZE (128)
+#define TRACE_PAYLOAD_SIZE (TRACE_RECORD_SIZE - 16)
+#define TRACE_MAX_STRING_ARG (63)
+// Records per thread ring unless CCS_TRACE_RECORDS says otherwise. Must be a power of two.
+#define DEFAULT_TRACE_RECORDS (1 << 15)
+
+typedef struct trace_site_t
+{
+    const char *code;
+    const char *file;
+    const char *func;
+    const char *format;
+    int line;
+    int level;
+} __attribute__((aligned(64))) trace_site_t; // a full line, so the compiler cannot pad sites apart in the section
+
+typedef struct trace_record_t
+{
+    uint64_t tsc;
+    uint32_t site;
+    uint16_t len;       // payload bytes used
+    uint16_t truncated; // arguments did not fit in the payload
+    unsigned char payload[TRACE_PAYLOAD_SIZE];
+} trace_record_t;
+
+typedef struct trace_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    int32_t pid;
+    uint32_t thread_tag; // what the text logger prints as the thread id
+    uint64_t base_tsc;
+    uint64_t base_realtime_ns;
+    double tsc_per_ns;
+    uint64_t written; // records ever written; the ring holds the last capacity of them
+} trace_header_t;
+
+typedef enum
+{
+    TRACE_ARG_INT,
+    TRACE_ARG_LONG,
+    TRACE_ARG_LLONG,
+    TRACE_ARG_SIZE,
+    TRACE_ARG_DOUBLE,
+    TRACE_ARG_STRING,
+    TRACE_ARG_POINTER,
+} trace_arg_kind_t;
+
+// Finds the next argument-consuming conversion in fmt. Returns a pointer to
+// its '%' (or NULL when there is none) and sets *end just past it.
+const char *next_trace_conversion(const char *fmt, const char **end, trace_arg_kind_t *kind)
+{
+    for (const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%'))
+    {
+        const char *q = p + 1;
+        if (*q == '%')
+        {
+            p = q + 1;
+            continue;
+        }
+
+        while (*q != '\0' && strchr("-+ #0123456789.", *q) != NULL)
+            q++;
+
+        trace_arg_kind_t length = TRACE_ARG_INT;
+        if (q[0] == 'l' && q[1] == 'l')
+            length = TRACE_ARG_LLONG, q += 2;
+        else if (*q == 'l' || *q == 't')
+            length = TRACE_ARG_LONG, q++;
+        else if (*q == 'j')
+            length = TRACE_ARG_LLONG, q++;
+        else if (*q == 'z')
+            length = TRACE_ARG_SIZE, q++;
+        else
+            while (*q == 'h')
+                q++;
+
+        if (*q == '\0')
+            return NULL;
+
+        if (strchr("diuxXoc", *q) != NULL)
+            *kind = length;
+        else if (strchr("eEfFgGaA", *q) != NULL)
+            *kind = TRACE_ARG_DOUBLE;
+        else if (*q == 's')
+            *kind = TRACE_ARG_STRING;
+        else if (*q == 'p')
+            *kind = TRACE_ARG_POINTER;
+        else
+        {
+            p = q + 1;
+            continue;
+        }
+
+        *end = q + 1;
+        return p;
+    }
+
+    return NULL;
+}
+
+#ifndef TRACE_DECODER_ONLY
+
+extern const trace_site_t __start_ccs_trace_sites[] __attribute__((weak));
+extern const trace_site_t __stop_ccs_trace_sites[] __attribute__((weak));
+
+#define TRACE_SITE(name, code, level, format)                                                 \
+    static const trace_site_t name __attribute__((section("ccs_trace_sites"), used)) = {      \
+        code, __FILE__, __func__, format, __LINE__, level}
+
+static char trace_dir[512];
+static uint64_t trace_records = DEFAULT_TRACE_RECORDS;
+static uint64_t trace_base_tsc;
+static uint64_t trace_base_realtime_ns;
+static double trace_tsc_per_ns = 1.0;
+static bool trace_ready = false;
+static pthread_key_t trace_ring_key;
+static pthread_once_t trace_ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread trace_header_t *thread_trace_header;
+
+static inline uint64_t trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Pairs the trace clock with wall time and measures its rate over a few ms.
+static void calibrate_trace_clock()
+{
+    trace_base_realtime_ns = clock_ns(CLOCK_REALTIME);
+    trace_base_tsc = trace_clock();
+
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    uint64_t start_tsc = trace_clock();
+    struct timespec pause = {0, 5000000};
+    nanosleep(&pause, NULL);
+    uint64_t elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    uint64_t elapsed_tsc = trace_clock() - start_tsc;
+    if (elapsed_ns > 0 && elapsed_tsc > 0)
+        trace_tsc_per_ns = (double)elapsed_tsc / elapsed_ns;
+#endif
+}
+
+static void unmap_trace_ring(void *header)
+{
+    trace_header_t *hdr = (trace_header_t *)header;
+    munmap(hdr, TRACE_HEADER_SIZE + hdr->capacity * TRACE_RECORD_SIZE);
+}
+
+static void create_trace_ring_key()
+{
+    pthread_key_create(&trace_ring_key, unmap_trace_ring);
+}
+
+static trace_header_t *open_thread_trace_ring()
+{
+    pid_t tid = syscall(SYS_gettid);
+    char path[sizeof(trace_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%d.ring", trace_dir, tid);
+
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1)
+        return NULL;
+
+    size_t size = TRACE_HEADER_SIZE + trace_records * TRACE_RECORD_SIZE;
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    trace_header_t *hdr = (trace_header_t *)mem;
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TRACE_VERSION;
+    hdr->record_size = TRACE_RECORD_SIZE;
+    hdr->capacity = trace_records;
+    hdr->pid = getpid();
+    hdr->thread_tag = (unsigned long)pthread_self();
+    hdr->base_tsc = trace_base_tsc;
+    hdr->base_realtime_ns = trace_base_realtime_ns;
+    hdr->tsc_per_ns = trace_tsc_per_ns;
+    hdr->written = 0;
+
+    pthread_once(&trace_ring_key_once, create_trace_ring_key);
+    pthread_setspecific(trace_ring_key, hdr);
+
+    thread_trace_header = hdr;
+    return hdr;
+}
+
+static void trace_record(const trace_site_t *site, ...)
+{
+    trace_header_t *hdr = thread_trace_header;
+    if (hdr == NULL)
+    {
+        if (!__atomic_load_n(&trace_ready, __ATOMIC_ACQUIRE) || (hdr = open_thread_trace_ring()) == NULL)
+            return;
+    }
+
+    uint64_t n = hdr->written;
+    trace_record_t *rec = (trace_record_t *)((char *)hdr + TRACE_HEADER_SIZE) + (n & (hdr->capacity - 1));
+    rec->tsc = trace_clock();
+    rec->site = site - __start_ccs_trace_sites;
+    rec->truncated = 0;
+
+    size_t pos = 0;
+    va_list args;
+    va_start(args, site);
+    const char *end;
+    trace_arg_kind_t kind;
+    for (const char *conv = next_trace_conversion(site->format, &end, &kind); conv != NULL; conv = next_trace_conversion(end, &end, &kind))
+    {
+        if (kind == TRACE_ARG_STRING)
+        {
+            const char *s = va_arg(args, const char *);
+            size_t len = s == NULL ? 0 : strnlen(s, TRACE_MAX_STRING_ARG);
+            if (pos + 1 + len > TRACE_PAYLOAD_SIZE)
+            {
+                rec->truncated = 1;
+                break;
+            }
+            rec->payload[pos++] = len;
+            memcpy(rec->payload + pos, s, len);
+            pos += len;
+            continue;
+        }
+
+        uint64_t value;
+        switch (kind)
+        {
+        case TRACE_ARG_LONG:
+            value = va_arg(args, long);
+            break;
+        case TRACE_ARG_LLONG:
+            value = va_arg(args, long long);
+            break;
+        case TRACE_ARG_SIZE:
+            value = va_arg(args, size_t);
+            break;
+        case TRACE_ARG_DOUBLE:
+        {
+            double d = va_arg(args, double);
+            memcpy(&value, &d, sizeof(value));
+            break;
+        }
+        case TRACE_ARG_POINTER:
+            value = (uintptr_t)va_arg(args, void *);
+            break;
+        default:
+            value = va_arg(args, int);
+            break;
+        }
+        if (pos + sizeof(value) > TRACE_PAYLOAD_SIZE)
+        {
+            rec->truncated = 1;
+            break;
+        }
+        memcpy(rec->payload + pos, &value, sizeof(value));
+        pos += sizeof(value);
+    }
+    va_end(args);
+
+    rec->len = pos;
+    __atomic_store_n(&hdr->written, n + 1, __ATOMIC_RELEASE);
+}
+
+static int write_trace_sites()
+{
+    char path[sizeof(trace_dir) + 16];
+    snprintf(path, sizeof(path), "%s/sites", trace_dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+
+    uint32_t count = __stop_ccs_trace_sites - __start_ccs_trace_sites;
+    fwrite(TRACE_SITES_MAGIC, 1, 8, f);
+    fwrite(&count, sizeof(count), 1, f);
+    for (const trace_site_t *site = __start_ccs_trace_sites; site < __stop_ccs_trace_sites; ++site)
+    {
+        int32_t line = site->line;
+        fwrite(&line, sizeof(line), 1, f);
+        fwrite(site->code, 1, strlen(site->code) + 1, f);
+        fwrite(site->file, 1, strlen(site->file) + 1, f);
+        fwrite(site->func, 1, strlen(site->func) + 1, f);
+        fwrite(site->format, 1, strlen(site->format) + 1, f);
+    }
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Traces go to "<name>.<pid>.trace/". CCS_TRACE_RECORDS sets the per-thread ring size.
+int init_trace(const char *name)
+{
+    snprintf(trace_dir, sizeof(trace_dir), "%s.%d.trace", name, getpid());
+    if (mkdir(trace_dir, 0755) == -1 && access(trace_dir, W_OK) == -1)
+    {
+        fprintf(stderr, "ERROR: Failed to create trace directory %s.\n", trace_dir);
+        return EXIT_FAILURE;
+    }
+
+    const char *records = getenv("CCS_TRACE_RECORDS");
+    if (records != NULL)
+    {
+        unsigned long n = strtoul(records, NULL, 10);
+        if (n >= 2 && (n & (n - 1)) == 0)
+            trace_records = n;
+        else
+            fprintf(stderr, "WARN: CCS_TRACE_RECORDS must be a power of two, using %lu.\n", (unsigned long)trace_records);
+    }
+
+    if (write_trace_sites() == -1)
+    {
+        fprintf(stderr, "ERROR: Failed to write the trace site table.\n");
+        return EXIT_FAILURE;
+    }
+
+    calibrate_trace_clock();
+    __atomic_store_n(&trace_ready, true, __ATOMIC_RELEASE);
+
+    return EXIT_SUCCESS;
+}
+
+// Rings are shared file mappings, so there is nothing to flush. Threads that
+// have not traced yet stop here; open rings keep recording until exit.
+int close_trace()
+{
+    __atomic_store_n(&trace_ready, false, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif
+
+#endif
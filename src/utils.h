@@ -6,6 +6,9 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "logger.h"
 
@@ -102,4 +105,44 @@ int msleep(long msec)
     return res;
 }
 
+// CLOCK_MONOTONIC is system-wide, so these timestamps can be compared across processes.
+unsigned long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// The futex words live in segments shared between processes, so the
+// non-private futex operations must be used here.
+long futex_wait(int *addr, int expected)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+// As futex_wait(), but gives up with ETIMEDOUT after `timeout_ns`. A negative
+// timeout waits forever.
+long futex_wait_timed(int *addr, int expected, long timeout_ns)
+{
+    if (timeout_ns < 0)
+        return futex_wait(addr, expected);
+
+    struct timespec ts = {timeout_ns / 1000000000L, timeout_ns % 1000000000L};
+    return syscall(SYS_futex, addr, FUTEX_WAIT, expected, &ts, NULL, 0);
+}
+
+long futex_wake(int *addr, int count)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+#ifndef VECTOR_ARITHMETIC_H
+#define VECTOR_ARITHMETIC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_X86 (1)
+#endif
+
+// Element-wise kernels behind VECTOR_ARITHMETIC: out[i] = a[i] op b[i].
+// Lanes that cannot be computed (division by zero, INT_MIN / -1) are set to 0
+// and flagged in `errors`, one bit per lane. Every kernel returns the number
+// of flagged lanes, or -1 for an unsupported operator.
+//
+// The widest kernel the CPU supports is picked once at load time. Setting
+// CCS_SIMD to scalar, sse4.1, avx2 or avx512 caps it, e.g. for comparisons.
+//
+// + - * wrap on overflow in every kernel. Division goes through doubles,
+// which represent every int quotient exactly.
+
+typedef int (*vector_kernel_t)(char op, const int *a, const int *b, int *out, uint8_t *errors, int len);
+
+static inline int scalar_lane(char op, int a, int b, int *out)
+{
+    switch (op)
+    {
+    case '+':
+        *out = (int)((unsigned)a + (unsigned)b);
+        return 0;
+    case '-':
+        *out = (int)((unsigned)a - (unsigned)b);
+        return 0;
+    case '*':
+        *out = (int)((unsigned)a * (unsigned)b);
+        return 0;
+    default: // '/'
+        if (b == 0 || (a == INT_MIN && b == -1))
+        {
+            *out = 0;
+            return 1;
+        }
+        *out = a / b;
+        return 0;
+    }
+}
+
+// Also finishes the tails of the SIMD kernels, which always stop at a
+// multiple of 8 lanes so that `errors` stays byte aligned.
+static int vector_kernel_scalar(char op, const int *a, const int *b, int *out, uint8_t *errors, int len)
+{
+    int failed = 0;
+    for (int i = 0; i < len; i += 8)
+    {
+        uint8_t mask = 0;
+        for (int j = i; j < len && j < i + 8; ++j)
+            mask |= scalar_lane(op, a[j], b[j], &out[j]) << (j - i);
+        errors[i / 8] = mask;
+        failed += __builtin_popcount(mask);
+    }
+    return failed;
+}
+
+#ifdef VECTOR_X86
+
+__attribute__((target("sse4.1"))) static int vector_kernel_sse41(char op, const int *a, const int *b, int *out, uint8_t *errors, int len)
+{
+    int i = 0, failed = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(1);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i int_min = _mm_set1_epi32(INT_MIN);
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint8_t mask = 0;
+        for (int h = 0; h < 8; h += 4)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i + h));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i + h));
+            __m128i r;
+
+            if (op == '+')
+                r = _mm_add_epi32(va, vb);
+            else if (op == '-')
+                r = _mm_sub_epi32(va, vb);
+            else if (op == '*')
+                r = _mm_mullo_epi32(va, vb);
+            else
+            {
+                __m128i bad = _mm_or_si128(_mm_cmpeq_epi32(vb, zero),
+                                           _mm_and_si128(_mm_cmpeq_epi32(va, int_min), _mm_cmpeq_epi32(vb, minus_one)));
+                vb = _mm_blendv_epi8(vb, ones, bad);
+                __m128i lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(va), _mm_cvtepi32_pd(vb)));
+                __m128i hi = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(va, 0xee)),
+                                                         _mm_cvtepi32_pd(_mm_shuffle_epi32(vb, 0xee))));
+                r = _mm_andnot_si128(bad, _mm_unpacklo_epi64(lo, hi));
+                mask |= _mm_movemask_ps(_mm_castsi128_ps(bad)) << h;
+            }
+            _mm_storeu_si128((__m128i *)(out + i + h), r);
+        }
+        errors[i / 8] = mask;
+        failed += __builtin_popcount(mask);
+    }
+
+    return failed + vector_kernel_scalar(op, a + i, b + i, out + i, errors + i / 8, len - i);
+}
+
+__attribute__((target("avx2"))) static int vector_kernel_avx2(char op, const int *a, const int *b, int *out, uint8_t *errors, int len)
+{
+    int i = 0, failed = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(1);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i int_min = _mm256_set1_epi32(INT_MIN);
+
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i r;
+        uint8_t mask = 0;
+
+        if (op == '+')
+            r = _mm256_add_epi32(va, vb);
+        else if (op == '-')
+            r = _mm256_sub_epi32(va, vb);
+        else if (op == '*')
+            r = _mm256_mullo_epi32(va, vb);
+        else
+        {
+            __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi32(vb, zero),
+                                          _mm256_and_si256(_mm256_cmpeq_epi32(va, int_min), _mm256_cmpeq_epi32(vb, minus_one)));
+            vb = _mm256_blendv_epi8(vb, ones, bad);
+            __m128i lo = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(va)),
+                                                           _mm256_cvtepi32_pd(_mm256_castsi256_si128(vb))));
+            __m128i hi = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(va, 1)),
+                                                           _mm256_cvtepi32_pd(_mm256_extracti128_si256(vb, 1))));
+            r = _mm256_andnot_si256(bad, _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1));
+            mask = _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), r);
+        errors[i / 8] = mask;
+        failed += __builtin_popcount(mask);
+    }
+
+    return failed + vector_kernel_scalar(op, a + i, b + i, out + i, errors + i / 8, len - i);
+}
+
+__attribute__((target("avx512f"))) static int vector_kernel_avx512(char op, const int *a, const int *b, int *out, uint8_t *errors, int len)
+{
+    int i = 0, failed = 0;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ones = _mm512_set1_epi32(1);
+    const __m512i minus_one = _mm512_set1_epi32(-1);
+    const __m512i int_min = _mm512_set1_epi32(INT_MIN);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m512i va = _mm512_loadu_si512((const void *)(a + i));
+        __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+        __m512i r;
+        __mmask16 bad = 0;
+
+        if (op == '+')
+            r = _mm512_add_epi32(va, vb);
+        else if (op == '-')
+            r = _mm512_sub_epi32(va, vb);
+        else if (op == '*')
+            r = _mm512_mullo_epi32(va, vb);
+        else
+        {
+            bad = _mm512_cmpeq_epi32_mask(vb, zero) |
+                  (_mm512_cmpeq_epi32_mask(va, int_min) & _mm512_cmpeq_epi32_mask(vb, minus_one));
+            vb = _mm512_mask_blend_epi32(bad, vb, ones);
+            __m256i lo = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(va)),
+                                                           _mm512_cvtepi32_pd(_mm512_castsi512_si256(vb))));
+            __m256i hi = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(va, 1)),
+                                                           _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(vb, 1))));
+            r = _mm512_maskz_mov_epi32(~bad, _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1));
+        }
+        _mm512_storeu_si512((void *)(out + i), r);
+        errors[i / 8] = bad & 0xff;
+        errors[i / 8 + 1] = bad >> 8;
+        failed += __builtin_popcount(bad);
+    }
+
+    return failed + vector_kernel_scalar(op, a + i, b + i, out + i, errors + i / 8, len - i);
+}
+
+#endif
+
+typedef struct vector_kernel_info_t
+{
+    const char *name;
+    vector_kernel_t kernel;
+} vector_kernel_info_t;
+
+// Narrowest first.
+static vector_kernel_info_t vector_kernels[] = {
+    {"scalar", vector_kernel_scalar},
+#ifdef VECTOR_X86
+    {"sse4.1", vector_kernel_sse41},
+    {"avx2", vector_kernel_avx2},
+    {"avx512", vector_kernel_avx512},
+#endif
+};
+#define NUM_VECTOR_KERNELS (sizeof(vector_kernels) / sizeof(vector_kernels[0]))
+
+static const vector_kernel_info_t *vector_kernel = &vector_kernels[0];
+
+static bool vector_kernel_supported(const char *name)
+{
+#ifdef VECTOR_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse4.1") == 0)
+        return __builtin_cpu_supports("sse4.1");
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f");
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+__attribute__((constructor)) static void select_vector_kernel()
+{
+    const char *cap = getenv("CCS_SIMD");
+    for (size_t k = 0; k < NUM_VECTOR_KERNELS; ++k)
+    {
+        if (!vector_kernel_supported(vector_kernels[k].name))
+            break;
+        vector_kernel = &vector_kernels[k];
+        if (cap != NULL && strcmp(cap, vector_kernels[k].name) == 0)
+            break;
+    }
+}
+
+const char *vector_kernel_name()
+{
+    return vector_kernel->name;
+}
+
+// Computes out = a op b over `len` lanes with the selected kernel.
+int vector_arithmetic(char op, const int *a, const int *b, int *out, uint8_t *errors, int len)
+{
+    if (op != '+' && op != '-' && op != '*' && op != '/')
+        return -1;
+    return vector_kernel->kernel(op, a, b, out, errors, len);
+}
+
+#endif
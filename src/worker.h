@@ -9,7 +9,13 @@
 
 #include "logger.h"
 #include "common_structs.h"
+#include "channel_ring.h"
 #include "client_tree.h"
+#include "stats.h"
+#include "primality.h"
+#include "vector_arithmetic.h"
+#include "result_cache.h"
+#include "handler_registry.h"
 
 #define CONNECT_CHANNEL_FNAME "srv_conn_channel"
 #define CONNECT_CHANNEL_SIZE (1024)
@@ -21,32 +27,58 @@
 
 #define TEMP_CLIENT_SIZE (1024)
 
-static unsigned long total_serviced_requests = 0;
-static pthread_mutex_t tsr_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Batches are split into tasks of this many requests so that idle workers
+// can steal parts of a large batch.
+#define BATCH_CHUNK_LEN (16)
+#define MAX_TASKS_PER_REQUEST ((MAX_BATCH_LEN + BATCH_CHUNK_LEN - 1) / BATCH_CHUNK_LEN)
 
-int increment_service_requests()
-{
-    pthread_mutex_lock(&tsr_mutex);
-    total_serviced_requests++;
-    pthread_mutex_unlock(&tsr_mutex);
+typedef struct ChannelEntry ChannelEntry;
 
-    return total_serviced_requests;
-}
+// task_t.begin of a request taken off the channel's request ring; end holds
+// its sequence number.
+#define TASK_RING (-2)
 
-int get_total_serviced_requests()
+// A unit of schedulable work: either the channel's single request
+// (begin == -1), the batch entries in [begin, end), or a pipelined request
+// (begin == TASK_RING).
+typedef struct task_t
 {
-    return total_serviced_requests;
-}
+    ChannelEntry *entry;
+    int begin;
+    int end;
+} task_t;
 
-typedef struct WorkerArgs
+struct ChannelEntry
 {
     char client_name[MAX_CLIENT_NAME_LEN];
-    int comm_channel_block_id;
-} WorkerArgs;
+    RequestOrResponse *comm_reqres;
+    unsigned long session_token;
+    int key;
+
+    int client_pid;        // 0 if the client did not say
+    int pidfd;             // readable once the client exits, -1 if not watched
+    int registration_slot; // what the client registered through, until it releases it
+
+    void *payload;       // the channel's payload region, NULL if it has none
+    size_t payload_size; // bytes granted at registration
+
+    unsigned long started_ns; // when a worker picked up the request in flight
+    RequestType last_type;    // type of the last answered request, for its pickup latency
+
+    /* Tasks of the request in flight. A channel has at most one. */
+    int pending_tasks;
+    task_t tasks[MAX_TASKS_PER_REQUEST];
 
-Response handle_arithmetic(Request req)
+    /* Pipelined requests claimed off the request ring and not answered yet,
+       plus workers about to claim one. Their tasks, by sequence number. */
+    int ring_inflight;
+    task_t ring_tasks[CHANNEL_RING_SLOTS];
+};
+
+Response handle_arithmetic(const handler_ctx_t *ctx, Request req)
 {
-    Response res;
+    (void)ctx;
+    Response res = {0};
     switch (req.op)
     {
     case '+':
@@ -78,140 +110,421 @@ Response handle_arithmetic(Request req)
     return res;
 }
 
-Response handle_even_or_odd(Request req)
+Response handle_even_or_odd(const handler_ctx_t *ctx, Request req)
 {
-    Response res;
+    (void)ctx;
+    Response res = {0};
     res.result = req.n1 % 2;
     res.response_code = RESPONSE_SUCCESS;
     return res;
 }
 
-Response handle_is_prime(Request req)
+Response handle_is_prime(const handler_ctx_t *ctx, Request req)
 {
-    Response res;
+    (void)ctx;
+    Response res = {0};
     if (req.n1 < 0)
     {
         res.response_code = RESPONSE_FAILURE;
         return res;
     }
 
-    // 0 and 1 are not prime numbers.
-    if (req.n1 == 0 || req.n1 == 1)
-    {
-        res.result = 0;
-        res.response_code = RESPONSE_SUCCESS;
-        return res;
-    }
+    res.result = is_prime_u32(req.n1);
+    res.response_code = RESPONSE_SUCCESS;
+    return res;
+}
+
+// Runs the candidates through is_prime_batch() together so that their
+// exponentiations overlap.
+void handle_is_prime_batch(const Request *req, Response *res, int count)
+{
+    uint32_t candidates[BATCH_CHUNK_LEN];
+    bool is_prime[BATCH_CHUNK_LEN];
+    int at[BATCH_CHUNK_LEN];
+    int num_candidates = 0;
 
-    res.result = 1;
-    for (int i = 2; i * i <= req.n1; ++i)
+    for (int i = 0; i < count; ++i)
     {
-        if (req.n1 % i == 0)
+        if (req[i].n1 < 0)
+        {
+            res[i].result = 0;
+            res[i].response_code = RESPONSE_FAILURE;
+        }
+        else
+        {
+            candidates[num_candidates] = req[i].n1;
+            at[num_candidates++] = i;
+        }
+
+        if (num_candidates == BATCH_CHUNK_LEN || (i == count - 1 && num_candidates > 0))
         {
-            res.result = 0;
-            break;
+            is_prime_batch(candidates, is_prime, num_candidates);
+            for (int k = 0; k < num_candidates; ++k)
+            {
+                res[at[k]].result = is_prime[k];
+                res[at[k]].response_code = RESPONSE_SUCCESS;
+            }
+            num_candidates = 0;
         }
     }
+}
 
-    res.response_code = RESPONSE_SUCCESS;
+Response handle_is_negative(const handler_ctx_t *ctx, Request _req)
+{
+    (void)ctx;
+    Response res = {0};
+    res.response_code = RESPONSE_UNSUPPORTED;
     return res;
 }
 
-Response handle_is_negative(Request _req)
+// Bounds-checks [offset, offset + len) against the channel's payload region
+// and returns a pointer to it, or NULL if it does not fit or is not aligned
+// to `align`.
+static inline void *payload_at(const handler_ctx_t *ctx, unsigned int offset, unsigned int len, unsigned int align)
+{
+    if (ctx->payload == NULL || (size_t)offset + len > ctx->payload_size || offset % align != 0)
+        return NULL;
+    return (char *)ctx->payload + offset;
+}
+
+// Works on the channel's payload region in place. The input is the two
+// operand arrays back to back; the output is the result array followed by a
+// bitmap with a bit per lane that could not be computed. result is the
+// number of such lanes.
+Response handle_vector_arithmetic(const handler_ctx_t *ctx, Request req)
 {
-    Response res;
+    Response res = {0};
     res.response_code = RESPONSE_UNSUPPORTED;
+
+    size_t lanes = req.payload_len / (2 * sizeof(int));
+    size_t reply_len = lanes * sizeof(int) + (lanes + 7) / 8;
+    if (req.payload_len % (2 * sizeof(int)) != 0 || reply_len > req.reply_capacity)
+        return res;
+
+    const int *a = (const int *)payload_at(ctx, req.payload_offset, req.payload_len, sizeof(int));
+    int *out = (int *)payload_at(ctx, req.reply_offset, reply_len, sizeof(int));
+    if (a == NULL || out == NULL)
+        return res;
+
+    res.result = vector_arithmetic(req.op, a, a + lanes, out, (uint8_t *)(out + lanes), (int)lanes);
+    if (res.result < 0)
+        return res;
+
+    res.payload_offset = req.reply_offset;
+    res.payload_len = reply_len;
+    res.response_code = RESPONSE_SUCCESS;
     return res;
 }
 
-void *worker_function(void *args)
+// UNREGISTER and BATCH act on the channel rather than on the request, so
+// they are handled by the worker itself.
+static const request_handler_t builtin_handlers[] = {
+    {ARITHMETIC, "ARITHMETIC", HANDLER_COST_CHEAP, true, handle_arithmetic, NULL},
+    {EVEN_OR_ODD, "EVEN_OR_ODD", HANDLER_COST_CHEAP, true, handle_even_or_odd, NULL},
+    {IS_PRIME, "IS_PRIME", HANDLER_COST_EXPENSIVE, true, handle_is_prime, handle_is_prime_batch},
+    {IS_NEGATIVE, "IS_NEGATIVE", HANDLER_COST_CHEAP, true, handle_is_negative, NULL},
+    {VECTOR_ARITHMETIC, "VECTOR", HANDLER_COST_MODERATE, false, handle_vector_arithmetic, NULL},
+};
+
+int register_builtin_handlers()
 {
-    logger("DEBUG", "Setting up communication channel for client %s",  ((WorkerArgs *)args)->client_name);
-    int comm_channel_block_id = ((WorkerArgs *)args)->comm_channel_block_id;
+    for (size_t i = 0; i < sizeof(builtin_handlers) / sizeof(builtin_handlers[0]); ++i)
+        if (register_handler(&builtin_handlers[i]) < 0)
+            return -1;
+    return 0;
+}
 
-    RequestOrResponse *comm_reqres = get_comm_channel(comm_channel_block_id);
-    if (comm_reqres == NULL)
-    {
-        logger("ERROR", "Invalid comm channel block id provided. Could not get communication channel block.", pthread_self());
+static const handler_ctx_t no_payload = {NULL, 0};
+
+static inline Response call_handler(const request_handler_t *handler, const handler_ctx_t *ctx, Request req)
+{
+    unsigned long start = monotonic_ns();
+    Response res = handler->handle(ctx, req);
+    record_handler_call(handler->type, 1, monotonic_ns() - start);
+    return res;
+}
 
-        free(args);
-        args = NULL;
+// Cacheable handlers always run without the payload, so that their answer
+// is the same whether or not it came from the cache.
+static Response call_cacheable_handler(Request req)
+{
+    return call_handler(find_handler(req.request_type), &no_payload, req);
+}
 
-        pthread_exit(NULL);
+// Runs a single non-control request, through the result cache if its type is
+// cached.
+Response dispatch_request(const handler_ctx_t *ctx, Request req)
+{
+    const request_handler_t *handler = find_handler(req.request_type);
+    if (handler == NULL)
+    {
+        Response res = {0};
+        res.response_code = RESPONSE_UNSUPPORTED;
+        return res;
     }
-    logger("INFO", "Communication channel setup succesful for client %s",  ((WorkerArgs *)args)->client_name);
 
-    unsigned long thread_tsr = 0;
-    while (true)
+    if (!handler->cacheable)
+        return call_handler(handler, ctx, req);
+    if (result_cache_enabled(req.request_type))
+        return result_cache_compute(req, call_cacheable_handler);
+    return call_handler(handler, &no_payload, req);
+}
+
+// Runs `count` batch entries. Entries whose handler has a batch entry point
+// and that miss the cache are handed to it together, one call per type; they
+// are not coalesced with identical requests in flight.
+void dispatch_batch(const Request *req, Response *res, int count)
+{
+    Request in[BATCH_CHUNK_LEN];
+    Response out[BATCH_CHUNK_LEN];
+    int at[BATCH_CHUNK_LEN];
+
+    for (int begin = 0; begin < count; begin += BATCH_CHUNK_LEN)
     {
-        wait_until_stage(comm_reqres, 1);
-        logger("INFO", "Received request of type %d",  comm_reqres->req.request_type);
+        int end = begin + BATCH_CHUNK_LEN < count ? begin + BATCH_CHUNK_LEN : count;
+        bool deferred[BATCH_CHUNK_LEN] = {false};
 
-        // TODO: Error handling and logging
-        if (validate_key_client(comm_reqres->req.key, ((WorkerArgs *)args)->client_name) < 0)
+        for (int i = begin; i < end; ++i)
         {
-            // TODO: Test this somehow?
-            logger("INFO", "Authentication failed for client %s",  ((WorkerArgs *)args)->client_name);
-            Response res;
-            res.response_code = RESPONSE_UNAUTHORIZED;
-            comm_reqres->res = res;
+            const request_handler_t *handler = find_handler(req[i].request_type);
+            if (handler == NULL || handler->handle_batch == NULL)
+                res[i] = dispatch_request(&no_payload, req[i]);
+            else if (!handler->cacheable || !result_cache_enabled(handler->type) || !result_cache_get(req[i], &res[i]))
+                deferred[i - begin] = true;
         }
 
-        else if (comm_reqres->req.request_type == ARITHMETIC)
-        {
-            Response res = handle_arithmetic(comm_reqres->req);
-            comm_reqres->res = res;
-        }
-        else if (comm_reqres->req.request_type == EVEN_OR_ODD)
+        for (int i = begin; i < end; ++i)
         {
-            Response res = handle_even_or_odd(comm_reqres->req);
-            comm_reqres->res = res;
+            if (!deferred[i - begin])
+                continue;
+
+            const request_handler_t *handler = find_handler(req[i].request_type);
+            int n = 0;
+            for (int j = i; j < end; ++j)
+            {
+                if (deferred[j - begin] && req[j].request_type == req[i].request_type)
+                {
+                    deferred[j - begin] = false;
+                    in[n] = req[j];
+                    at[n++] = j;
+                }
+            }
+
+            unsigned long start = monotonic_ns();
+            handler->handle_batch(in, out, n);
+            record_handler_call(handler->type, n, monotonic_ns() - start);
+
+            bool cache = handler->cacheable && result_cache_enabled(handler->type);
+            for (int k = 0; k < n; ++k)
+            {
+                res[at[k]] = out[k];
+                if (cache)
+                    result_cache_put(in[k], out[k]);
+            }
         }
-        else if (comm_reqres->req.request_type == IS_PRIME)
-        {
-            Response res = handle_is_prime(comm_reqres->req);
-            comm_reqres->res = res;
-        }
-        else if (comm_reqres->req.request_type == IS_NEGATIVE)
-        {
-            Response res = handle_is_negative(comm_reqres->req);
-            comm_reqres->res = res;
-        }
-        else if (comm_reqres->req.request_type == UNREGISTER)
-        {
-            logger("INFO", "Initiating deregister of client %s",  ((WorkerArgs *)args)->client_name);
-            printf("Deregistering client %s\n", ((WorkerArgs *)args)->client_name);
+    }
+}
 
-            // TODO: Error handling and logging
-            remove_from_client_tree(comm_reqres->req.key);
+void unregister_client(ChannelEntry *entry)
+{
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+    logger("INFO", "Initiating deregister of client %s",  entry->client_name);
+    printf("Deregistering client %s\n", entry->client_name);
 
-            char *filename = strdup(comm_reqres->filename);
+    // TODO: Error handling and logging
+    remove_from_client_tree(comm_reqres->req.key);
 
-            // ? Do you need to clear mutex?.
-            pthread_mutex_destroy(&comm_reqres->lock);
+    // ? Do you need to clear mutex?.
+    pthread_mutex_destroy(&comm_reqres->lock);
+    entry->comm_reqres = NULL;
 
-            detach_memory_block(comm_reqres);
-            destroy_memory_block(filename);
+    logger("INFO", "Deregistration of client %s succesful",  entry->client_name);
+}
 
-            logger("DEBUG", "Removing file %s as a part of deregistration",  filename);
-            remove_file(filename);
+// Publishes the response of the request in flight on the channel.
+void finish_request(ChannelEntry *entry)
+{
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+    RequestType type = comm_reqres->req.request_type;
 
-            logger("INFO", "Deregistration of client %s succesful",  ((WorkerArgs *)args)->client_name);
-            break;
-        }
+    unsigned long now = monotonic_ns();
+    record_latency(type, LATENCY_HANDLER, now - entry->started_ns);
+    stats_add(serviced, 1);
+    entry->last_type = type;
+    comm_reqres->completed_ns = now;
+    set_stage(comm_reqres, 2);
+
+    logger("INFO", "Response sent to client for request with response code %d",  comm_reqres->res.response_code);
+}
+
+// Validates the request pending on the client's channel and splits it into
+// tasks stored in entry->tasks. Returns the number of tasks to schedule, 0 if
+// the request was answered without running any handler, or -1 if the client
+// asked to unregister; the caller then tears the channel down with
+// unregister_client() once no pipelined request is in flight.
+int prepare_request(ChannelEntry *entry)
+{
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+    RequestType type = comm_reqres->req.request_type;
+    logger("INFO", "Received request of type %d",  type);
+
+    entry->started_ns = monotonic_ns();
+    if (comm_reqres->submit_ns != 0)
+        record_latency(type, LATENCY_QUEUE_WAIT, entry->started_ns - comm_reqres->submit_ns);
+    if (comm_reqres->pickup_ns != 0)
+    {
+        record_latency(entry->last_type, LATENCY_PICKUP, comm_reqres->pickup_ns);
+        comm_reqres->pickup_ns = 0;
+    }
+    if ((unsigned)type < NUM_REQUEST_TYPES)
+        stats_add(requests[type], 1);
+
+    // The session token bound to the channel at registration authenticates
+    // every request. The client index is only consulted to unregister.
+    // TODO: Error handling and logging
+    if (comm_reqres->req.token != entry->session_token ||
+        (comm_reqres->req.request_type == UNREGISTER && validate_key_client(comm_reqres->req.key, entry->client_name) < 0))
+    {
+        // TODO: Test this somehow?
+        logger("INFO", "Authentication failed for client %s",  entry->client_name);
+        stats_add(auth_failures, 1);
+        comm_reqres->res.response_code = RESPONSE_UNAUTHORIZED;
+        finish_request(entry);
+        return 0;
+    }
+
+    if (comm_reqres->req.request_type == UNREGISTER)
+    {
+        stats_add(unregistrations, 1);
+        return -1;
+    }
+
+    if (comm_reqres->req.request_type != BATCH)
+    {
+        entry->tasks[0] = (task_t){entry, -1, -1};
+        entry->pending_tasks = 1;
+        return 1;
+    }
+
+    // The batch is authenticated once through the key of the enclosing
+    // request, so per-entry keys are ignored.
+    int batch_len = comm_reqres->batch_len;
+    if (batch_len <= 0 || batch_len > MAX_BATCH_LEN)
+    {
+        logger("ERROR", "Invalid batch length %d", batch_len);
+        comm_reqres->res.response_code = batch_len == 0 ? RESPONSE_SUCCESS : RESPONSE_UNSUPPORTED;
+        comm_reqres->res.result = 0;
+        finish_request(entry);
+        return 0;
+    }
 
-        logger("INFO", "Thread Total serviced requests: %d",  ++thread_tsr);
-        logger("INFO", "Total serviced requests: %d",  increment_service_requests());
-        next_stage(comm_reqres);
+    comm_reqres->res.response_code = RESPONSE_SUCCESS;
+    comm_reqres->res.result = batch_len;
+    stats_add(batch_entries, batch_len);
 
-        logger("INFO", "Response sent to client for request with response code %d",  comm_reqres->res.response_code);
-        msleep(600);
+    int num_tasks = 0;
+    for (int begin = 0; begin < batch_len; begin += BATCH_CHUNK_LEN)
+    {
+        int end = begin + BATCH_CHUNK_LEN < batch_len ? begin + BATCH_CHUNK_LEN : batch_len;
+        entry->tasks[num_tasks++] = (task_t){entry, begin, end};
+    }
+    entry->pending_tasks = num_tasks;
+
+    return num_tasks;
+}
+
+// Claims the next request published on the channel's request ring and
+// returns its task, or NULL if there is none.
+task_t *claim_ring_task(ChannelEntry *entry)
+{
+    // Counted before the claim, so that close_request_ring() cannot miss a
+    // request being claimed.
+    __atomic_add_fetch(&entry->ring_inflight, 1, __ATOMIC_SEQ_CST);
+
+    unsigned int seq;
+    if (!ring_claim_request(entry->comm_reqres, &seq))
+    {
+        __atomic_sub_fetch(&entry->ring_inflight, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+
+    task_t *task = &entry->ring_tasks[seq & RING_MASK];
+    *task = (task_t){entry, TASK_RING, (int)seq};
+    return task;
+}
+
+// Stops further requests from being claimed off the ring of a channel that
+// is going away; those still unclaimed are dropped. Returns how many claimed
+// requests are still being served.
+int close_request_ring(ChannelEntry *entry)
+{
+    unsigned int seq;
+    while (ring_claim_request(entry->comm_reqres, &seq))
+        ;
+    return __atomic_load_n(&entry->ring_inflight, __ATOMIC_SEQ_CST);
+}
+
+// Serves one pipelined request and posts its answer on the completion ring.
+// Each one carries the session token, so each one is authenticated.
+void run_ring_task(ChannelEntry *entry, unsigned int seq)
+{
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+    ring_request_t *slot = &comm_reqres->sq[seq & RING_MASK];
+    Request req = slot->req;
+    RequestType type = req.request_type;
+
+    unsigned long started_ns = monotonic_ns();
+    if (slot->submit_ns != 0)
+        record_latency(type, LATENCY_QUEUE_WAIT, started_ns - slot->submit_ns);
+    if ((unsigned)type < NUM_REQUEST_TYPES)
+        stats_add(requests[type], 1);
+
+    Response res = {0};
+    if (req.token != entry->session_token)
+    {
+        logger("INFO", "Authentication failed for client %s", entry->client_name);
+        stats_add(auth_failures, 1);
+        res.response_code = RESPONSE_UNAUTHORIZED;
+    }
+    else
+    {
+        // UNREGISTER and BATCH have no handler, so they are refused here.
+        handler_ctx_t ctx = {entry->payload, entry->payload_size};
+        res = dispatch_request(&ctx, req);
+    }
+    res.client_seq_num = req.client_seq_num;
+
+    record_latency(type, LATENCY_HANDLER, monotonic_ns() - started_ns);
+    stats_add(serviced, 1);
+    ring_post_completion(comm_reqres, res);
+    __atomic_sub_fetch(&entry->ring_inflight, 1, __ATOMIC_SEQ_CST);
+}
+
+// Runs the handlers of one task. The worker completing the last task of a
+// request publishes its response.
+void run_task(task_t *task)
+{
+    ChannelEntry *entry = task->entry;
+    RequestOrResponse *comm_reqres = entry->comm_reqres;
+
+    if (task->begin == TASK_RING)
+    {
+        run_ring_task(entry, (unsigned int)task->end);
+        stats_add(tasks, 1);
+        return;
     }
 
-    free(args);
-    args = NULL;
+    if (task->begin < 0)
+    {
+        handler_ctx_t ctx = {entry->payload, entry->payload_size};
+        comm_reqres->res = dispatch_request(&ctx, comm_reqres->req);
+    }
+    else
+        dispatch_batch(&comm_reqres->batch_req[task->begin], &comm_reqres->batch_res[task->begin], task->end - task->begin);
+    stats_add(tasks, 1);
 
-    return NULL;
+    if (__atomic_sub_fetch(&entry->pending_tasks, 1, __ATOMIC_ACQ_REL) == 0)
+        finish_request(entry);
 }
 
 #endif
@@ -0,0 +1,292 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "common_structs.h"
+#include "doorbell.h"
+#include "channel_arena.h"
+#include "worker.h"
+#include "task_deque.h"
+
+#define MAX_WORKERS (256)
+
+// Server-side view of every registered channel, indexed by doorbell slot.
+static ChannelEntry channel_table[MAX_CLIENTS];
+
+typedef struct pool_worker_t
+{
+    int id;
+    pthread_t tid;
+    unsigned int rng; // xorshift state for picking steal victims
+    task_deque_t deque;
+} pool_worker_t;
+
+static ready_set_t *pool_ready_set;
+static pool_worker_t *pool_workers;
+static int pool_size = 0;
+
+static channel_arena_t *pool_arena;
+
+// Serialises handing slots out and taking them back, between registration,
+// unregistration and the reaper.
+static pthread_mutex_t channel_owner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_channel_table(channel_arena_t *arena)
+{
+    pool_arena = arena;
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+    {
+        channel_table[i].comm_reqres = NULL;
+        channel_table[i].pidfd = -1;
+    }
+}
+
+int acquire_channel_slot()
+{
+    int slot = alloc_arena_slot(pool_arena);
+    if (slot < 0)
+        logger("ERROR", "All %zu channel slots are in use.", pool_arena->num_slots);
+
+    return slot;
+}
+
+// Must be called with channel_owner_lock held.
+static void release_channel_slot_locked(int slot)
+{
+    if (channel_table[slot].pidfd >= 0)
+    {
+        close(channel_table[slot].pidfd); // also drops it from the reaper's epoll set
+        channel_table[slot].pidfd = -1;
+    }
+    __atomic_store_n(&channel_table[slot].comm_reqres, NULL, __ATOMIC_RELEASE);
+    free_arena_slot(pool_arena, slot);
+}
+
+void release_channel_slot(int slot)
+{
+    pthread_mutex_lock(&channel_owner_lock);
+    release_channel_slot_locked(slot);
+    pthread_mutex_unlock(&channel_owner_lock);
+}
+
+// Binds an attached channel to its slot. After this, doorbells rung on the
+// slot are serviced by the pool. `conn_reqres` is the registration request,
+// and `pidfd` watches its client, or is -1.
+void publish_channel(int slot, const RequestOrResponse *conn_reqres, RequestOrResponse *comm_reqres, int key,
+                     unsigned long session_token, void *payload, size_t payload_size, int pidfd)
+{
+    ChannelEntry *entry = &channel_table[slot];
+
+    pthread_mutex_lock(&channel_owner_lock);
+    // Both are MAX_CLIENT_NAME_LEN arrays, and the client may have left
+    // its name unterminated.
+    memcpy(entry->client_name, conn_reqres->client_name, MAX_CLIENT_NAME_LEN - 1);
+    entry->client_name[MAX_CLIENT_NAME_LEN - 1] = '\0';
+    entry->key = key;
+    entry->session_token = session_token;
+    entry->payload = payload;
+    entry->payload_size = payload_size;
+    entry->client_pid = conn_reqres->client_pid;
+    entry->pidfd = pidfd;
+    entry->registration_slot = conn_reqres->slot;
+    __atomic_store_n(&entry->comm_reqres, comm_reqres, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&channel_owner_lock);
+}
+
+task_t *steal_from_peers(pool_worker_t *self);
+
+// Pushes a task onto the worker's own deque, or runs it if the deque is full.
+static inline void schedule_task(pool_worker_t *self, task_t *task)
+{
+    if (push_task(&self->deque, task) < 0)
+        run_task(task);
+}
+
+// Claims every request published on the channel's request ring. Returns how
+// many were claimed.
+int accept_ring_requests(pool_worker_t *self, ChannelEntry *entry)
+{
+    int num_tasks = 0;
+    task_t *task;
+    while ((task = claim_ring_task(entry)) != NULL)
+    {
+        schedule_task(self, task);
+        ++num_tasks;
+    }
+    return num_tasks;
+}
+
+// Waits until no pipelined request of the channel is being served, helping
+// with the pool's tasks meanwhile: some of them may be the ones waited for.
+void retire_request_ring(pool_worker_t *self, ChannelEntry *entry)
+{
+    while (close_request_ring(entry) > 0)
+    {
+        void *task = take_task(&self->deque);
+        if (task == TASK_DEQUE_EMPTY)
+            task = steal_from_peers(self);
+        if (task != NULL)
+            run_task((task_t *)task);
+        else
+            cpu_relax();
+    }
+}
+
+// Claims a ringing channel and pushes the tasks of its requests onto the
+// worker's own deque: those on the request ring, and the single request if
+// one is pending. Returns false if no channel was ringing.
+bool accept_ready_channel(pool_worker_t *self, unsigned int *hint)
+{
+    int slot = claim_ready_slot(pool_ready_set, hint);
+    if (slot < 0)
+        return false;
+
+    ChannelEntry *entry = &channel_table[slot];
+    RequestOrResponse *comm_reqres = __atomic_load_n(&entry->comm_reqres, __ATOMIC_ACQUIRE);
+    if (comm_reqres == NULL)
+    {
+        logger("WARN", "Spurious doorbell on slot %d", slot);
+        return true;
+    }
+
+    int num_tasks = accept_ring_requests(self, entry);
+
+    // A doorbell rung for the ring may find its requests claimed already by
+    // the worker that answered an earlier one, and the single request taken
+    // by a worker that is still serving it.
+    if (claim_stage(comm_reqres))
+    {
+        int num_request_tasks = prepare_request(entry);
+        if (num_request_tasks < 0)
+        {
+            retire_request_ring(self, entry);
+            unregister_client(entry);
+            release_channel_slot(slot);
+            return true;
+        }
+
+        for (int i = 0; i < num_request_tasks; ++i)
+            schedule_task(self, &entry->tasks[i]);
+        num_tasks += num_request_tasks;
+    }
+
+    // Let idle workers know there is something to steal.
+    if (num_tasks > 1)
+        nudge_doorbell(pool_ready_set);
+
+    return true;
+}
+
+task_t *steal_from_peers(pool_worker_t *self)
+{
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 17;
+    self->rng ^= self->rng << 5;
+
+    int start = self->rng % pool_size;
+    for (int i = 0; i < pool_size; ++i)
+    {
+        pool_worker_t *victim = &pool_workers[(start + i) % pool_size];
+        if (victim == self)
+            continue;
+
+        void *task;
+        while ((task = steal_task(&victim->deque)) == TASK_DEQUE_ABORT)
+            cpu_relax();
+        if (task != TASK_DEQUE_EMPTY)
+        {
+            stats_add(steals, 1);
+            return (task_t *)task;
+        }
+    }
+
+    return NULL;
+}
+
+// Own tasks are run first (LIFO), then new requests are accepted, and only
+// then is work stolen from busy peers before going to sleep.
+void *pool_worker_function(void *args)
+{
+    pool_worker_t *self = (pool_worker_t *)args;
+    unsigned int hint = self->id * (READY_SET_WORDS / pool_size);
+    bind_stats_shard(self->id);
+
+    while (true)
+    {
+        int seen_seq = read_doorbell_seq(pool_ready_set);
+
+        void *task = take_task(&self->deque);
+        if (task != TASK_DEQUE_EMPTY)
+        {
+            run_task((task_t *)task);
+            continue;
+        }
+
+        if (accept_ready_channel(self, &hint))
+            continue;
+
+        task_t *stolen = steal_from_peers(self);
+        if (stolen != NULL)
+        {
+            run_task(stolen);
+            continue;
+        }
+
+        wait_for_doorbell(pool_ready_set, seen_seq);
+    }
+
+    return NULL;
+}
+
+int default_pool_size()
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu > 0 ? (int)ncpu : 1;
+}
+
+int start_worker_pool(ready_set_t *ready_set, int num_workers)
+{
+    if (num_workers <= 0)
+        num_workers = default_pool_size();
+    if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+
+    pool_workers = (pool_worker_t *)aligned_alloc(64, sizeof(pool_worker_t) * num_workers);
+    if (pool_workers == NULL)
+    {
+        logger("ERROR", "Could not allocate %d workers.", num_workers);
+        return -1;
+    }
+
+    // Workers index their peers through pool_size, so it is fixed before any
+    // of them starts.
+    pool_ready_set = ready_set;
+    pool_size = num_workers;
+    if (server_stats != NULL)
+        server_stats->pool_size = num_workers;
+    for (int i = 0; i < num_workers; ++i)
+    {
+        pool_workers[i].id = i;
+        pool_workers[i].rng = 2463534242U + i;
+        init_task_deque(&pool_workers[i].deque);
+    }
+
+    for (int i = 0; i < num_workers; ++i)
+    {
+        if (pthread_create(&pool_workers[i].tid, NULL, pool_worker_function, &pool_workers[i]) != 0)
+        {
+            logger("ERROR", "Could not start worker %d of %d.", i, num_workers);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    logger("INFO", "Started worker pool with %d threads", pool_size);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,197 @@
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "client_api.h"
+#include "logger.h"
+#include "stats.h"
+
+// A doorbell rung for the request ring while the channel's single request is
+// being served must not have a second worker take that request again. One
+// thread uses call_server() while another pipelines requests on the ring of
+// the same channel, against a server started in a scratch directory. The
+// single requests are long vectors, so that they are still being served when
+// doorbells for the ring come in.
+
+#define SERVER "bin/server"
+#define LANES (1 << 20)
+#define PAYLOAD_SIZE (12800000) // vector_payload_size(LANES), rounded up
+#ifdef STAGE_HANDOFF_POLL
+// Every call sleeps through the 500 ms stage polls there.
+#define NUM_CALLS (20)
+#else
+#define NUM_CALLS (400)
+#endif
+#define NUM_RING_REQUESTS (20000)
+#define TIMEOUT_S (60)
+
+static RequestOrResponse *channel;
+static ClientSession session = {.payload_size = PAYLOAD_SIZE};
+static int call_failures = 0;
+
+static Request addition(int n1, int n2)
+{
+    Request req = {0};
+    req.request_type = ARITHMETIC;
+    req.n1 = n1;
+    req.n2 = n2;
+    req.op = '+';
+    return req;
+}
+
+static void *run_calls(void *arg)
+{
+    int *payload = (int *)arg;
+    for (int i = 0; i < LANES; ++i)
+    {
+        payload[i] = i;
+        payload[LANES + i] = 1;
+    }
+
+    Request req = {0};
+    req.request_type = VECTOR_ARITHMETIC;
+    set_vector_payload(&req, LANES);
+    const int *out = (const int *)((char *)payload + req.reply_offset);
+
+    // Consecutive calls differ, so that an answer to the previous one shows.
+    for (int i = 0; i < NUM_CALLS; ++i)
+    {
+        req.op = i % 2 == 0 ? '+' : '-';
+        Response res = call_server(channel, &session, req);
+        int lane = (i * 7919) % LANES;
+        int want = req.op == '+' ? lane + 1 : lane - 1;
+        if (res.response_code != RESPONSE_SUCCESS || res.result != 0 || out[lane] != want)
+        {
+            printf("FAIL call %d: got %d/%d, lane %d is %d, want %d\n", i, res.response_code, res.result, lane,
+                   out[lane], want);
+            ++call_failures;
+        }
+    }
+    return NULL;
+}
+
+static int run_ring()
+{
+    int failures = 0;
+    int expected[CHANNEL_RING_SLOTS];
+    int sent = 0, answered = 0;
+    while (answered < NUM_RING_REQUESTS)
+    {
+        int queued = 0;
+        unsigned int seq;
+        while (sent < NUM_RING_REQUESTS && queue_request(channel, &session, addition(sent, 2), &seq) == 0)
+        {
+            expected[seq & RING_MASK] = sent + 2;
+            ++sent;
+            ++queued;
+        }
+        if (queued > 0)
+            notify_server(channel);
+
+        int seen_signal = ring_read_signal(channel);
+        Response res;
+        bool took = false;
+        while (ring_take_completion(channel, &res))
+        {
+            if (res.response_code != RESPONSE_SUCCESS || res.result != expected[res.client_seq_num & RING_MASK])
+            {
+                printf("FAIL ring request %u: got %d/%d\n", res.client_seq_num, res.response_code, res.result);
+                ++failures;
+            }
+            ++answered;
+            took = true;
+        }
+        if (!took)
+            ring_wait_completion(channel, seen_signal, -1);
+    }
+    return failures;
+}
+
+// Removes what the server and the test left in the scratch directory, which
+// is the current one.
+static void remove_scratch_dir(const char *dir)
+{
+    DIR *d = opendir(".");
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL)
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            remove_file(e->d_name);
+    if (d != NULL)
+        closedir(d);
+    rmdir(dir);
+}
+
+static pid_t start_server(const char *server)
+{
+    char payload_size[16];
+    snprintf(payload_size, sizeof(payload_size), "%d", PAYLOAD_SIZE);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        prctl(PR_SET_PDEATHSIG, SIGINT);
+        execl(server, server, "-w", "4", "-c", "4", "-p", payload_size, (char *)NULL);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 100 && memory_block_exists(CONNECT_CHANNEL_FNAME) != 1; ++i)
+        msleep(50);
+    // The file is created before the queue is set up.
+    msleep(200);
+    return pid;
+}
+
+int main()
+{
+    char server[PATH_MAX];
+    char dir[] = "/tmp/channel_mix_test.XXXXXX";
+    if (realpath(SERVER, server) == NULL || mkdtemp(dir) == NULL || chdir(dir) < 0)
+    {
+        printf("FAIL channel_mix_test: could not set up %s\n", dir);
+        return EXIT_FAILURE;
+    }
+
+    // A server taking a request twice may hang the client instead.
+    alarm(TIMEOUT_S);
+    pid_t pid = start_server(server);
+    if (pid < 0 || init_logger("channel_mix_test") == EXIT_FAILURE || connect_to_server("mix", &session) < 0 ||
+        (channel = get_session_channel(&session)) == NULL || session.payload_size < vector_payload_size(LANES))
+    {
+        printf("FAIL channel_mix_test: could not connect to the server\n");
+        if (pid > 0)
+            kill(pid, SIGINT);
+        return EXIT_FAILURE;
+    }
+
+    pthread_t caller;
+    pthread_create(&caller, NULL, run_calls, get_session_payload(&session));
+    int failures = run_ring();
+    pthread_join(caller, NULL);
+    failures += call_failures;
+
+    // A request taken twice is mostly answered right, so count what the
+    // server took.
+    const stats_segment_t *stats = attach_stats_segment();
+    unsigned long vector_requests = 0;
+    for (int s = 0; stats != NULL && s < STATS_NUM_SHARDS; ++s)
+        vector_requests += __atomic_load_n(&stats->shards[s].requests[VECTOR_ARITHMETIC], __ATOMIC_RELAXED);
+    if (vector_requests != NUM_CALLS)
+    {
+        printf("FAIL server took %lu vector requests, want %d\n", vector_requests, NUM_CALLS);
+        ++failures;
+    }
+
+    disconnect_from_server(channel, &session);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    remove_scratch_dir(dir);
+
+    printf("%s channel_mix_test\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logger.h"
+#include "worker.h"
+
+// A cached module type must be keyed on n2 and op as well: gcd(12, 8) and
+// gcd(12, 9) differ only in n2.
+
+#define GCD_MODULE "bin/gcd_module.so"
+
+static int failures = 0;
+
+static void expect(Request req, int result)
+{
+    Response res = dispatch_request(&no_payload, req);
+    if (res.response_code != RESPONSE_SUCCESS || res.result != result)
+    {
+        printf("FAIL type %d (%d, %d): got %d/%d, want %d\n", req.request_type, req.n1, req.n2, res.response_code,
+               res.result, result);
+        ++failures;
+    }
+}
+
+int main()
+{
+    if (init_logger("result_cache_test") == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    unsigned int types;
+    if (register_builtin_handlers() < 0 || load_handler_module(GCD_MODULE) < 0 ||
+        parse_cached_types("gcd,prime", &types) < 0 || init_result_cache(1 << 20, types) < 0)
+    {
+        printf("FAIL setup\n");
+        return EXIT_FAILURE;
+    }
+
+    Request gcd = {.request_type = FIRST_MODULE_REQUEST_TYPE, .n1 = 12, .n2 = 8};
+    expect(gcd, 4);
+    gcd.n2 = 9;
+    expect(gcd, 3);
+    gcd.n2 = 8;
+    expect(gcd, 4);
+
+    // Single-operand builtins still hit whatever is in n2.
+    Request prime = {.request_type = IS_PRIME, .n1 = 97, .n2 = 1};
+    expect(prime, 1);
+    prime.n2 = 2;
+    expect(prime, 1);
+
+    destroy_result_cache();
+    close_logger();
+    printf("%s\n", failures == 0 ? "PASS result_cache_test" : "FAIL result_cache_test");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}